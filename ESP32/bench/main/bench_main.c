@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_cpu.h"
+#include "esp_err.h"
+#include "unity.h"
+#include "dispenser.h"
+
+// Cycles per call for the firmware hot paths, linked from the same component the
+// firmware uses. Replies go to a counting sink instead of UART0 and queued orders
+// are dropped after every call, so each iteration takes the same path.
+#define BENCH_ITERS        1000
+#define BENCH_STREAM_BYTES (64 * 1024)
+#define BENCH_CHUNK        64 // bytes per uart_read_bytes in a busy uart_task
+
+typedef struct {
+    uint64_t total;
+    uint32_t min;
+    uint32_t max;
+    uint32_t calls;
+} bench_cycles_t;
+
+#define BENCH_CALL(b, expr)                                          \
+    do {                                                             \
+        uint32_t t0_ = esp_cpu_get_cycle_count();                    \
+        expr;                                                        \
+        bench_add((b), esp_cpu_get_cycle_count() - t0_);             \
+    } while (0)
+
+static uint32_t reply_count;
+static uint32_t queued_count;
+
+static int bench_output(const void* data, size_t len) {
+    static const char queued[] = "{\"status\":\"queued\"";
+    reply_count++;
+    if (len >= sizeof(queued) - 1 && memcmp(data, queued, sizeof(queued) - 1) == 0) queued_count++;
+    return (int)len;
+}
+
+static void bench_add(bench_cycles_t* b, uint32_t cycles) {
+    if (b->calls == 0 || cycles < b->min) b->min = cycles;
+    if (cycles > b->max) b->max = cycles;
+    b->total += cycles;
+    b->calls++;
+}
+
+static void bench_report(const char* name, const bench_cycles_t* b) {
+    printf("BENCH %-24s %8u cycles/call  min %u  max %u  (%u calls)\n", name,
+           (unsigned)(b->total / b->calls), (unsigned)b->min, (unsigned)b->max, (unsigned)b->calls);
+}
+
+static size_t build_v1(uint8_t* f, const uint8_t counts[4]) {
+    f[0] = UART_FRAME_START;
+    f[1] = UART_FRAME_VER_1;
+    memcpy(&f[2], counts, 4);
+    f[6] = (uint8_t)((f[1] + f[2] + f[3] + f[4] + f[5]) & 0xFF);
+    f[7] = UART_FRAME_END;
+    return UART_FRAME_LEN_V1;
+}
+
+static size_t build_v2(uint8_t* f, uint16_t seq, uint8_t opcode, const uint8_t* payload, size_t len) {
+    size_t n = 0;
+    f[n++] = UART_FRAME_START;
+    f[n++] = UART_FRAME_VER_2;
+    f[n++] = (uint8_t)(seq & 0xFF);
+    f[n++] = (uint8_t)(seq >> 8);
+    f[n++] = opcode;
+    f[n++] = (uint8_t)len;
+    if (len) memcpy(&f[n], payload, len);
+    n += len;
+    uint16_t crc = crc16_ccitt(&f[1], n - 1);
+    f[n++] = (uint8_t)(crc & 0xFF);
+    f[n++] = (uint8_t)(crc >> 8);
+    f[n++] = UART_FRAME_END;
+    return n;
+}
+
+static void bench_frame(const char* name, const uint8_t* frame, size_t len, uint32_t queued_per_call) {
+    bench_cycles_t b = {0};
+    uint32_t queued_before = queued_count;
+    uint32_t replies_before = reply_count;
+    for (int i = 0; i < BENCH_ITERS; i++) {
+        int rc;
+        BENCH_CALL(&b, rc = try_handle_sauron_frame(frame, len));
+        TEST_ASSERT_EQUAL_INT((int)len, rc);
+        dispenser_flush_orders();
+    }
+    bench_report(name, &b);
+    TEST_ASSERT_EQUAL_UINT32(queued_per_call * BENCH_ITERS, queued_count - queued_before);
+    TEST_ASSERT_NOT_EQUAL(replies_before, reply_count);
+}
+
+static void bench_line(const char* name, const char* line, uint32_t queued_per_call) {
+    bench_cycles_t b = {0};
+    size_t len = strlen(line);
+    uint32_t queued_before = queued_count;
+    for (int i = 0; i < BENCH_ITERS; i++) {
+        BENCH_CALL(&b, handle_json_command_line(line, len));
+        dispenser_flush_orders();
+    }
+    bench_report(name, &b);
+    TEST_ASSERT_EQUAL_UINT32(queued_per_call * BENCH_ITERS, queued_count - queued_before);
+}
+
+TEST_CASE("V1 order frame", "[bench]")
+{
+    static const uint8_t counts[4] = {1, 2, 3, 0};
+    uint8_t frame[UART_FRAME_LEN_V1];
+    size_t len = build_v1(frame, counts);
+    bench_frame("frame_v1", frame, len, 1);
+}
+
+TEST_CASE("V2 batch of four orders", "[bench]")
+{
+    uint8_t payload[2 + 4 * DISPENSER_NUM_CHANNELS];
+    payload[0] = 4;
+    payload[1] = DISPENSER_NUM_CHANNELS;
+    for (size_t i = 2; i < sizeof(payload); i++) payload[i] = (uint8_t)(i % 3);
+    uint8_t frame[sizeof(payload) + UART_FRAME_V2_OVERHEAD];
+    size_t len = build_v2(frame, 1, V2_OP_DISPENSE_BATCH, payload, sizeof(payload));
+    bench_frame("frame_v2_batch4", frame, len, 4);
+}
+
+TEST_CASE("V2 ping and CRC NACK", "[bench]")
+{
+    uint8_t frame[UART_FRAME_V2_OVERHEAD + 4];
+    size_t len = build_v2(frame, 2, V2_OP_PING, NULL, 0);
+    bench_frame("frame_v2_ping", frame, len, 0);
+
+    static const uint8_t baud[4] = {0x00, 0xC2, 0x01, 0x00};
+    len = build_v2(frame, 3, V2_OP_SET_BAUD, baud, sizeof(baud));
+    frame[UART_FRAME_V2_HDR_LEN] ^= 0xFF; // corrupt the payload, keep the framing
+    bench_frame("frame_v2_bad_crc", frame, len, 0);
+}
+
+TEST_CASE("JSON lines", "[bench]")
+{
+    bench_line("json_fast", "{\"Vitamin C\": 2, \"Fish Oil\": 2, \"Vitamin B\": 2, \"Tylenol\": 3}", 1);
+    bench_line("json_cjson_fallback", "{\"Vitamin C\": 2.0, \"Fish Oil\": 2, \"Vitamin B\": 2, \"Tylenol\": 3}", 1);
+    bench_line("json_control_ping", "{\"cmd\":\"ping\"}", 0);
+    bench_line("json_garbage", "{\"Vitamin C\": 2, oops", 0);
+}
+
+// Noise that can neither start a frame nor a line, so every embedded order must
+// survive it. False frame headers are planted on purpose: each one is held until
+// its claimed length has arrived, then dropped a byte at a time.
+static uint32_t bench_rand_state = 0x12345678;
+
+static uint32_t bench_rand(void) {
+    bench_rand_state = bench_rand_state * 1664525u + 1013904223u;
+    return bench_rand_state >> 8;
+}
+
+static uint8_t bench_noise_byte(void) {
+    while (1) {
+        uint8_t c = (uint8_t)bench_rand();
+        if (c != UART_FRAME_START && c != UART_FRAME_END && c != '{' && c != ' ' && c != '\t' &&
+            c != '\r' && c != '\n') {
+            return c;
+        }
+    }
+}
+
+// Fills buf with V1 orders separated by noise bursts (none if !noisy) and
+// returns the number of orders written.
+static uint32_t bench_build_stream(uint8_t* buf, size_t size, bool noisy) {
+    static const uint8_t counts[4] = {1, 2, 3, 0};
+    uint32_t orders = 0;
+    size_t n = 0;
+    while (1) {
+        size_t burst = 0;
+        uint8_t header[UART_FRAME_V2_HDR_LEN] = {0};
+        size_t header_len = 0;
+        if (noisy) {
+            burst = 8 + bench_rand() % 56;
+            switch (bench_rand() % 3) {
+            case 0: // V1 header, then a checksum/end that cannot match
+                header[0] = UART_FRAME_START;
+                header[1] = UART_FRAME_VER_1;
+                header_len = 2;
+                break;
+            case 1: // V2 header claiming a payload that ends inside the burst
+                header[0] = UART_FRAME_START;
+                header[1] = UART_FRAME_VER_2;
+                header[4] = V2_OP_DISPENSE_BATCH;
+                header[5] = (uint8_t)(33 + bench_rand() % 15); // never '\n', ' ' or '{'
+                header_len = UART_FRAME_V2_HDR_LEN;
+                if (burst < (size_t)header[5] + UART_FRAME_V2_OVERHEAD) burst = (size_t)header[5] + UART_FRAME_V2_OVERHEAD;
+                break;
+            default:
+                break;
+            }
+        }
+        if (n + burst + UART_FRAME_LEN_V1 > size) break;
+        memcpy(&buf[n], header, header_len);
+        for (size_t i = header_len; i < burst; i++) buf[n + i] = bench_noise_byte();
+        n += burst;
+        n += build_v1(&buf[n], counts);
+        orders++;
+    }
+    memset(&buf[n], 0x00, size - n); // trailing noise
+    return orders;
+}
+
+static void bench_stream(const char* name, bool noisy) {
+    uint8_t* stream = malloc(BENCH_STREAM_BYTES);
+    rx_ring_t* rx = malloc(sizeof(rx_ring_t));
+    TEST_ASSERT_NOT_NULL(stream);
+    TEST_ASSERT_NOT_NULL(rx);
+    rx->head = 0;
+    rx->tail = 0;
+    uint32_t orders = bench_build_stream(stream, BENCH_STREAM_BYTES, noisy);
+    uint32_t queued_before = queued_count;
+
+    // Mirrors uart_task: copy a chunk into the write span, then commit and parse.
+    // Only commit + parse are timed; the copy stands in for uart_read_bytes.
+    bench_cycles_t b = {0};
+    for (size_t off = 0; off < BENCH_STREAM_BYTES;) {
+        uint8_t* dst = NULL;
+        size_t span = rx_ring_write_span(rx, &dst);
+        size_t len = BENCH_STREAM_BYTES - off;
+        if (len > BENCH_CHUNK) len = BENCH_CHUNK;
+        if (len > span) len = span;
+        memcpy(dst, &stream[off], len);
+        off += len;
+        BENCH_CALL(&b, rx_ring_commit(rx, len); rx_ring_parse(rx));
+        dispenser_flush_orders();
+    }
+    printf("BENCH %-24s %8u cycles/byte  (%u bytes, %u orders)\n", name,
+           (unsigned)(b.total / BENCH_STREAM_BYTES), (unsigned)BENCH_STREAM_BYTES, (unsigned)orders);
+    bench_report(name, &b);
+    TEST_ASSERT_EQUAL_UINT32(orders, queued_count - queued_before);
+    free(rx);
+    free(stream);
+}
+
+TEST_CASE("RX ring, clean stream", "[bench]")
+{
+    bench_stream("rx_ring_clean", false);
+}
+
+TEST_CASE("RX ring, adversarial noise", "[bench]")
+{
+    bench_stream("rx_ring_noise", true);
+}
+
+TEST_CASE("angle_to_duty", "[bench]")
+{
+    bench_cycles_t b = {0};
+    volatile uint32_t sink = 0;
+    for (int i = 0; i < BENCH_ITERS; i++) {
+        // Quarter degrees, including out-of-range angles.
+        int angle_q = (i % 200 - 10) * SERVO_ANGLE_STEPS_PER_DEG + (i & 3);
+        BENCH_CALL(&b, sink += angle_to_duty(i % DISPENSER_NUM_CHANNELS, angle_q));
+    }
+    bench_report("angle_to_duty", &b);
+    TEST_ASSERT_NOT_EQUAL(0, sink);
+}
+
+void app_main(void)
+{
+    ESP_ERROR_CHECK(dispenser_core_init());
+    dispenser_set_output(bench_output);
+
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    UNITY_END();
+}
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <string.h>
+#include "nvs.h"
+#include "dispenser_internal.h"
+
+// Pill-name -> channel lookup. Keys are the per-channel names (defaults from
+// channel_map.h, overridable in NVS) plus the fixed "pill1".."pill4" aliases,
+// held in a small open-addressing FNV-1a table so a lookup is one hash and
+// usually one compare. Only uart_task reads or rebuilds it.
+#define CHANNEL_MAP_NVS_NAMESPACE "chmap"
+// Power of two, >= 2x the number of keys (a name and an alias per channel).
+#define CHANNEL_MAP_TABLE_SIZE    (DISPENSER_NUM_CHANNELS <= 4 ? 16 : DISPENSER_NUM_CHANNELS <= 8 ? 32 : 64)
+
+typedef struct {
+    const char* key; // NULL = empty slot
+    uint8_t len;
+    int8_t channel;
+    uint32_t hash;
+} channel_map_entry_t;
+
+static char channel_aliases[DISPENSER_NUM_CHANNELS][8]; // "pill1".."pillN"
+char channel_names[DISPENSER_NUM_CHANNELS][CHANNEL_NAME_MAX_LEN + 1];
+static channel_map_entry_t channel_map[CHANNEL_MAP_TABLE_SIZE];
+
+// channel_map.h's defaults; entries past DISPENSER_NUM_CHANNELS are ignored.
+static const struct {
+    const char* name;
+    int channel;
+} channel_defaults[] = {
+#define CHANNEL_MAP_DEFAULT_ENTRY(name, ch) { name, ch },
+    CHANNEL_MAP_DEFAULTS(CHANNEL_MAP_DEFAULT_ENTRY)
+#undef CHANNEL_MAP_DEFAULT_ENTRY
+};
+
+// The build default for one channel, or an empty name if it has none.
+static void channel_name_default(int channel) {
+    memset(channel_names[channel], 0, sizeof(channel_names[channel]));
+    for (size_t i = 0; i < sizeof(channel_defaults) / sizeof(channel_defaults[0]); i++) {
+        if (channel_defaults[i].channel == channel) {
+            strncpy(channel_names[channel], channel_defaults[i].name, CHANNEL_NAME_MAX_LEN);
+        }
+    }
+}
+
+static uint32_t fnv1a(const char* s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void channel_map_insert(const char* key, int channel) {
+    size_t len = strlen(key);
+    if (len == 0) return;
+    uint32_t h = fnv1a(key, len);
+    for (size_t n = 0; n < CHANNEL_MAP_TABLE_SIZE; n++) {
+        channel_map_entry_t* e = &channel_map[(h + n) & (CHANNEL_MAP_TABLE_SIZE - 1)];
+        if (e->key && (e->len != len || memcmp(e->key, key, len) != 0)) continue;
+        e->key = key; // first empty slot, or same key (later entry wins)
+        e->len = (uint8_t)len;
+        e->channel = (int8_t)channel;
+        e->hash = h;
+        return;
+    }
+}
+
+static void channel_map_rebuild(void) {
+    memset(channel_map, 0, sizeof(channel_map));
+    for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+        channel_map_insert(channel_aliases[ch], ch);
+    }
+    for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+        channel_map_insert(channel_names[ch], ch);
+    }
+}
+
+void channel_map_init(void) {
+    for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+        snprintf(channel_aliases[ch], sizeof(channel_aliases[ch]), "pill%d", ch + 1);
+        channel_name_default(ch);
+    }
+
+    nvs_handle_t nvs;
+    if (nvs_open(CHANNEL_MAP_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+            char key[8];
+            snprintf(key, sizeof(key), "name%d", ch);
+            size_t size = sizeof(channel_names[ch]);
+            char value[CHANNEL_NAME_MAX_LEN + 1];
+            if (nvs_get_str(nvs, key, value, &size) == ESP_OK) {
+                memcpy(channel_names[ch], value, sizeof(value));
+            }
+        }
+        nvs_close(nvs);
+    }
+    channel_map_rebuild();
+}
+
+// Names are echoed inside JSON replies, so keep them to plain printable ASCII.
+static bool channel_name_valid(const char* name, size_t len) {
+    if (len > CHANNEL_NAME_MAX_LEN) return false;
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] < 0x20 || name[i] > 0x7E || name[i] == '"' || name[i] == '\\') return false;
+    }
+    return true;
+}
+
+// Set (len > 0) or restore to the build default (len == 0) one channel's name and
+// persist it. Returns false on a bad channel/name or an NVS failure.
+bool channel_map_set(int channel, const char* name, size_t len) {
+    if (channel < 0 || channel >= DISPENSER_NUM_CHANNELS || !channel_name_valid(name, len)) return false;
+
+    char key[8];
+    snprintf(key, sizeof(key), "name%d", channel);
+    nvs_handle_t nvs;
+    if (nvs_open(CHANNEL_MAP_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return false;
+
+    esp_err_t err;
+    if (len == 0) {
+        err = nvs_erase_key(nvs, key);
+        if (err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+        channel_name_default(channel);
+    } else {
+        memset(channel_names[channel], 0, sizeof(channel_names[channel]));
+        memcpy(channel_names[channel], name, len);
+        err = nvs_set_str(nvs, key, channel_names[channel]);
+    }
+    if (err == ESP_OK) err = nvs_commit(nvs);
+    nvs_close(nvs);
+
+    channel_map_rebuild();
+    return err == ESP_OK;
+}
+
+// Map pill key (not NUL-terminated) to servo index
+int pill_to_index(const char* pill, size_t len) {
+    uint32_t h = fnv1a(pill, len);
+    for (size_t n = 0; n < CHANNEL_MAP_TABLE_SIZE; n++) {
+        const channel_map_entry_t* e = &channel_map[(h + n) & (CHANNEL_MAP_TABLE_SIZE - 1)];
+        if (!e->key) return -1;
+        if (e->hash == h && e->len == len && memcmp(e->key, pill, len) == 0) return e->channel;
+    }
+    return -1;
+}
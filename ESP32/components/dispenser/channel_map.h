@@ -0,0 +1,14 @@
+#pragma once
+
+// Default medication-to-slot mapping compiled into the firmware.
+// X(name, channel) with channel 0-based. A name set at runtime with
+// {"cmd":"map",...} (or V2 SET_CHANNEL_NAME) is stored in NVS and replaces the
+// default for that channel on every boot until {"cmd":"map_reset"}.
+// The "pill1".."pill4" slot aliases are always accepted in addition.
+#define CHANNEL_MAP_DEFAULTS(X) \
+    X("Vitamin C", 0)           \
+    X("Fish Oil",  1)           \
+    X("Vitamin B", 2)           \
+    X("Tylenol",   3)
+
+#define CHANNEL_NAME_MAX_LEN 31
@@ -0,0 +1,377 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/ringbuf.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include "dispenser_internal.h"
+
+static QueueHandle_t uart_event_queue;
+int64_t uart_rx_us; // time of the UART event being parsed (uart_task only)
+
+const char* const dispenser_task_names[TASK_MAX] = {
+    [TASK_UART] = "uart_task",
+    [TASK_MOTION] = "motion_task",
+    [TASK_TX] = "tx_task",
+    [TASK_LOG] = "log_task",
+    [TASK_OTA] = "ota_task",
+};
+TaskHandle_t dispenser_tasks[TASK_MAX];
+
+unsigned dispenser_task_stack_free(dispenser_task_id_t id) {
+    // A NULL handle would report the calling task.
+    return dispenser_tasks[id] ? (unsigned)uxTaskGetStackHighWaterMark(dispenser_tasks[id]) : 0;
+}
+
+static const char* TAG = "dispenser";
+
+#if DISPENSER_LOG_UART
+static RingbufHandle_t log_ring;
+static StaticRingbuffer_t log_ring_struct;
+static uint8_t log_ring_storage[LOG_RING_SIZE];
+
+// esp_log sink: runs in the logging task's context, so it must never block on the
+// log UART. Lines longer than LOG_LINE_MAX are cut (keeping the newline).
+static int log_ring_vprintf(const char* fmt, va_list args) {
+    char line[LOG_LINE_MAX];
+    int n = vsnprintf(line, sizeof(line), fmt, args);
+    if (n <= 0) return n;
+    size_t len = (size_t)n;
+    if (len >= sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    if (xRingbufferSend(log_ring, line, len, 0) != pdTRUE) {
+        stats_inc(&stats.log_drops, 1);
+    }
+    return n;
+}
+
+static void log_task(void* arg) {
+    int64_t next_telemetry_us = esp_timer_get_time() + (int64_t)TELEMETRY_PERIOD_MS * 1000;
+    while (1) {
+        size_t size = 0;
+        uint8_t* item = (uint8_t*)xRingbufferReceiveUpTo(log_ring, &size, pdMS_TO_TICKS(TELEMETRY_PERIOD_MS),
+                                                         LOG_RING_SIZE / 2);
+        if (item) {
+            uart_write_bytes(LOG_UART_NUM, item, size);
+            vRingbufferReturnItem(log_ring, item);
+        }
+        if (esp_timer_get_time() >= next_telemetry_us) {
+            next_telemetry_us += (int64_t)TELEMETRY_PERIOD_MS * 1000;
+            ESP_LOGI(TAG, "telemetry rx=%u orders=%u resync=%u crc_fail=%u bad_json=%u ovf=%u "
+                     "log_drops=%u tx_drops=%u stack_free uart=%u motion=%u tx=%u log=%u",
+                     atomic_load_explicit(&stats.rx_bytes, memory_order_relaxed),
+                     atomic_load_explicit(&stats.orders, memory_order_relaxed),
+                     atomic_load_explicit(&stats.resync_bytes, memory_order_relaxed),
+                     atomic_load_explicit(&stats.checksum_failures, memory_order_relaxed),
+                     atomic_load_explicit(&stats.bad_json, memory_order_relaxed),
+                     atomic_load_explicit(&stats.rx_overflows, memory_order_relaxed),
+                     atomic_load_explicit(&stats.log_drops, memory_order_relaxed),
+                     atomic_load_explicit(&stats.tx_drops, memory_order_relaxed),
+                     dispenser_task_stack_free(TASK_UART), dispenser_task_stack_free(TASK_MOTION),
+                     dispenser_task_stack_free(TASK_TX), dispenser_task_stack_free(TASK_LOG));
+        }
+    }
+}
+#endif
+
+static void log_init(void) {
+#if DISPENSER_LOG_UART
+    const uart_config_t cfg = {
+        .baud_rate = LOG_UART_BAUD_RATE,
+        .data_bits = UART_DATA_8_BITS,
+        .parity    = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+    };
+    // The driver needs an RX buffer even though nothing is ever read here.
+    uart_driver_install(LOG_UART_NUM, 256, 1024, 0, NULL, 0);
+    uart_param_config(LOG_UART_NUM, &cfg);
+    uart_set_pin(LOG_UART_NUM, LOG_UART_TX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    log_ring = xRingbufferCreateStatic(LOG_RING_SIZE, RINGBUF_TYPE_BYTEBUF, log_ring_storage, &log_ring_struct);
+    esp_log_set_vprintf(log_ring_vprintf);
+    esp_log_level_set("*", ESP_LOG_INFO);
+    DISPENSER_TASK_START(TASK_LOG, log_task, LOG_TASK_STACK, LOG_TASK_PRIORITY, PROTOCOL_CORE);
+#else
+    // Logs would share UART0 with the JSON replies.
+    esp_log_level_set("*", ESP_LOG_NONE);
+#endif
+}
+
+volatile schedule_mode_t schedule_mode = SCHEDULE_MODE_DEFAULT;
+
+// The orders of one motion run (motion_task only). A channel's pills go to the
+// orders in queue order: order k owns pills first[k][ch] .. first[k][ch] +
+// counts[ch] - 1 of that channel; reported[k][ch] of them have had a progress event.
+typedef struct {
+    dispense_cmd_t* cmds[CMD_POOL_SIZE];
+    int first[CMD_POOL_SIZE][DISPENSER_NUM_CHANNELS];
+    int reported[CMD_POOL_SIZE][DISPENSER_NUM_CHANNELS];
+    bool acked[CMD_POOL_SIZE];
+    int n;
+    int64_t start_us;
+} order_run_t;
+
+static order_run_t order_run;
+
+static void order_ack(dispense_cmd_t* cmd, ack_status_t status, const int dispensed[DISPENSER_NUM_CHANNELS]) {
+    if (status == ACK_CANCELLED) {
+        stats_inc(&stats.cancelled, 1);
+    } else {
+        stats_inc(&stats.orders, 1);
+    }
+    cmd->dispensed = dispensed;
+    send_ack(status, cmd, -1);
+    if (status == ACK_SHORT) {
+        for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+            if (dispensed[ch] < cmd->counts[ch]) {
+                ESP_LOGW(TAG, "channel %d short: %d of %d", ch + 1, dispensed[ch], cmd->counts[ch]);
+            }
+        }
+    }
+    cmd_pool_free(cmd);
+}
+
+// Pills of order k out so far; true once none are still to come.
+static bool order_progress(const order_run_t* r, int k, const int dispensed[DISPENSER_NUM_CHANNELS],
+                           uint16_t settled, int got[DISPENSER_NUM_CHANNELS]) {
+    bool complete = true;
+    for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+        int want = r->cmds[k]->counts[ch] > 0 ? r->cmds[k]->counts[ch] : 0;
+        int n = dispensed[ch] - r->first[k][ch];
+        got[ch] = n < 0 ? 0 : (n > want ? want : n);
+        if (got[ch] < want && !(settled & (1u << ch))) complete = false;
+    }
+    return complete;
+}
+
+// Sends a progress event for every pill counted since the last call, then ACKs
+// every order whose pills are all out. Seq-less (V1/JSON) replies are matched by
+// the host in order, so those never overtake an earlier seq-less order: a later
+// one's events wait too, and catch up once it is the oldest.
+static void order_run_progress(void* ctx, const int dispensed[DISPENSER_NUM_CHANNELS], uint16_t settled) {
+    order_run_t* r = ctx;
+    bool seqless_waiting = false;
+    for (int k = 0; k < r->n; k++) {
+        if (r->acked[k]) continue;
+        dispense_cmd_t* cmd = r->cmds[k];
+        int got[DISPENSER_NUM_CHANNELS];
+        bool complete = order_progress(r, k, dispensed, settled, got);
+        bool held = cmd->seq < 0 && seqless_waiting;
+        for (int ch = 0; ch < DISPENSER_NUM_CHANNELS && !held; ch++) {
+            if (got[ch] <= r->reported[k][ch]) continue;
+            r->reported[k][ch] = got[ch];
+            send_progress(cmd, ch, got, esp_timer_get_time() - r->start_us);
+        }
+        if (complete && !held) {
+            ack_status_t status = ACK_DONE;
+            for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+                if (got[ch] < cmd->counts[ch]) status = ACK_SHORT;
+            }
+            stats_hist_record(&stats.command, esp_timer_get_time() - r->start_us);
+            r->acked[k] = true;
+            order_ack(cmd, status, got);
+        } else if (cmd->seq < 0) {
+            seqless_waiting = true;
+        }
+    }
+}
+
+// Collects the orders for the next run: the one just received and, when
+// coalescing, whatever else is queued or arrives within COALESCE_WINDOW_MS.
+// Orders queued before a cancel are answered here without moving.
+static void order_run_collect(order_run_t* r, dispense_cmd_t* cmd, motion_run_t* run) {
+    static const int none[DISPENSER_NUM_CHANNELS];
+    dispense_cmd_t* pulled[CMD_POOL_SIZE];
+    int n = 0;
+    pulled[n++] = cmd;
+    if (schedule_mode == SCHEDULE_MODE_COALESCE) {
+        TickType_t until = xTaskGetTickCount() + pdMS_TO_TICKS(COALESCE_WINDOW_MS);
+        while (n < CMD_POOL_SIZE) {
+            TickType_t now = xTaskGetTickCount();
+            TickType_t wait = (int32_t)(until - now) > 0 ? until - now : 0;
+            if (xQueueReceive(cmd_queue, &pulled[n], wait) != pdTRUE) break;
+            n++;
+        }
+    }
+
+    memset(run, 0, sizeof(*run));
+    run->cancel_gen = atomic_load_explicit(&motion_cancel_gen, memory_order_relaxed);
+    run->on_progress = order_run_progress;
+    run->ctx = r;
+    r->n = 0;
+    r->start_us = esp_timer_get_time();
+    for (int i = 0; i < n; i++) {
+        if (pulled[i]->cancel_gen != run->cancel_gen) {
+            order_ack(pulled[i], ACK_CANCELLED, none);
+            continue;
+        }
+        int k = r->n++;
+        r->cmds[k] = pulled[i];
+        r->acked[k] = false;
+        for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+            r->first[k][ch] = run->counts[ch];
+            r->reported[k][ch] = 0;
+            if (pulled[i]->counts[ch] > 0) run->counts[ch] += pulled[i]->counts[ch];
+        }
+        stats_hist_record(&stats.latency, r->start_us - pulled[i]->rx_us);
+    }
+    run->longest_first = r->n > 1;
+}
+
+static void motion_task(void* arg) {
+    order_run_t* r = &order_run;
+    dispense_cmd_t* cmd;
+    while (1) {
+        if (xQueueReceive(cmd_queue, &cmd, portMAX_DELAY) != pdTRUE) continue;
+        motion_run_t run;
+        order_run_collect(r, cmd, &run);
+        if (r->n == 0) continue;
+
+        int dispensed[DISPENSER_NUM_CHANNELS];
+        journal_begin(r->cmds[0], run.counts, (uint8_t)r->n);
+        bool finished = execute_channel_counts(&run, dispensed);
+        journal_end();
+
+        if (finished) {
+            // Every channel is done: whatever is left completes now, in order.
+            order_run_progress(r, dispensed, (uint16_t)((1u << DISPENSER_NUM_CHANNELS) - 1));
+            continue;
+        }
+        for (int k = 0; k < r->n; k++) {
+            if (r->acked[k]) continue;
+            int got[DISPENSER_NUM_CHANNELS];
+            order_progress(r, k, dispensed, 0, got);
+            order_ack(r->cmds[k], ACK_CANCELLED, got);
+        }
+    }
+}
+
+static rx_ring_t uart_rx_ring;
+
+static void uart_task(void* arg)
+{
+    rx_ring_t* rx = &uart_rx_ring;
+
+    uart_event_t event;
+    while (1) {
+        if (xQueueReceive(uart_event_queue, &event, portMAX_DELAY) != pdTRUE) continue;
+        uart_rx_us = esp_timer_get_time();
+
+        switch (event.type) {
+        case UART_DATA:
+            break;
+        case UART_PATTERN_DET:
+            // Positions are not needed: the accumulator finds line ends itself.
+            // Drain them so the driver's pattern queue never saturates.
+            while (uart_pattern_pop_pos(UART_PORT_NUM) >= 0) {
+            }
+            break;
+        case UART_FIFO_OVF:
+        case UART_BUFFER_FULL:
+            // Bytes were lost; whatever is half-assembled can no longer be trusted.
+            stats_inc(&stats.rx_overflows, 1);
+            ESP_LOGW(TAG, "rx overflow, input flushed");
+            uart_flush_input(UART_PORT_NUM);
+            xQueueReset(uart_event_queue);
+            uart_pattern_queue_reset(UART_PORT_NUM, UART_PATTERN_QUEUE_LEN);
+            rx->head = rx->tail;
+            continue;
+        default:
+            continue;
+        }
+
+        // Drain everything the driver has buffered straight into the ring without
+        // waiting; one event may cover several frames, and later events may find
+        // nothing left to read.
+        while (1) {
+            size_t avail = 0;
+            uart_get_buffered_data_len(UART_PORT_NUM, &avail);
+            if (avail == 0) break;
+
+            uint8_t* dst = NULL;
+            size_t span = rx_ring_write_span(rx, &dst);
+            if (avail > span) avail = span;
+            int len = uart_read_bytes(UART_PORT_NUM, dst, (uint32_t)avail, 0);
+            if (len <= 0) break;
+            rx_ring_commit(rx, (size_t)len);
+            stats_inc(&stats.rx_bytes, (unsigned)len);
+            rx_ring_parse(rx);
+        }
+    }
+}
+
+esp_err_t dispenser_core_init(void)
+{
+    // NVS holds runtime overrides of the pill-name -> channel map, the motion
+    // profiles and the servo calibrations.
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_LOGW(TAG, "NVS erased (%d)", (int)err);
+        nvs_flash_erase();
+        err = nvs_flash_init();
+    }
+    channel_map_init();
+    motion_profiles_init();
+    servo_cal_init();
+    journal_init();
+    ota_init();
+    protocol_init();
+    return cmd_queue ? err : ESP_ERR_NO_MEM;
+}
+
+void dispenser_start(void)
+{
+    // Using the board's USB cable means the USB-UART bridge is connected to UART0,
+    // which carries the protocol; logs move to their own UART (or are silenced).
+    log_init();
+    dispenser_core_init();
+
+    // Configure UART
+    uart_config_t uart_config = {
+        .baud_rate = UART_BAUD_RATE,
+        .data_bits = UART_DATA_8_BITS,
+        .parity    = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = (UART_RTS_PIN != UART_PIN_NO_CHANGE && UART_CTS_PIN != UART_PIN_NO_CHANGE)
+            ? UART_HW_FLOWCTRL_CTS_RTS : UART_HW_FLOWCTRL_DISABLE,
+        .rx_flow_ctrl_thresh = UART_RX_FLOW_THRESH,
+    };
+    uart_driver_install(UART_PORT_NUM, BUF_SIZE * 2, BUF_SIZE * 2, UART_EVENT_QUEUE_LEN, &uart_event_queue, 0);
+    uart_param_config(UART_PORT_NUM, &uart_config);
+    uart_set_pin(UART_PORT_NUM, UART_TX_PIN, UART_RX_PIN, UART_RTS_PIN, UART_CTS_PIN);
+    uart_enable_pattern_det_baud_intr(UART_PORT_NUM, UART_PATTERN_CHR, 1, 9, 0, 0);
+    uart_pattern_queue_reset(UART_PORT_NUM, UART_PATTERN_QUEUE_LEN);
+    uart_set_rx_timeout(UART_PORT_NUM, UART_RX_TOUT_SYMBOLS);
+    tx_init();
+
+    // Servo PWM, the motion timer and the drop sensors.
+    motion_init();
+
+    // Motion runs on its own task (the app core on dual-core chips) so UART stays
+    // readable while servos move. See the task topology in dispenser_internal.h.
+    DISPENSER_TASK_START(TASK_MOTION, motion_task, MOTION_TASK_STACK, MOTION_TASK_PRIORITY, MOTION_TASK_CORE);
+
+    // Start UART task
+    // Announce the new boot, and an order a reset cut short, before taking input;
+    // anything the host already sent waits in the driver. The interrupted order
+    // stays queryable with {"cmd":"journal"} until cleared.
+    send_hello("boot", -1);
+    journal_entry_t lost;
+    if (journal_interrupted(&lost)) send_journal("boot", -1, false);
+
+    DISPENSER_TASK_START(TASK_UART, uart_task, UART_TASK_STACK, UART_TASK_PRIORITY, PROTOCOL_CORE);
+#if DISPENSER_OTA_WIFI
+    ota_wifi_init();
+#endif
+    ESP_LOGI(TAG, "ready: %d channels, drop sensors %s, heap free %u (min %u)", DISPENSER_NUM_CHANNELS,
+             DISPENSER_DROP_SENSORS ? "on" : "off", (unsigned)heap_caps_get_free_size(MALLOC_CAP_DEFAULT),
+             (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT));
+}
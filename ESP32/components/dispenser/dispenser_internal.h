@@ -0,0 +1,553 @@
+#pragma once
+
+// Shared by the component's translation units only; apps include dispenser.h.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "driver/uart.h"
+#include "driver/ledc.h"
+#include "cJSON.h"
+#include "dispenser.h"
+#include "channel_map.h"
+
+#define UART_PORT_NUM      UART_NUM_0
+#define UART_BAUD_RATE     115200
+#define UART_RX_PIN        UART_PIN_NO_CHANGE
+#define UART_TX_PIN        UART_PIN_NO_CHANGE
+
+// Optional RTS/CTS. Leave at UART_PIN_NO_CHANGE on boards where only TX/RX reach
+// the USB bridge; set both to wired GPIOs to enable hardware flow control.
+#define UART_RTS_PIN       UART_PIN_NO_CHANGE
+#define UART_CTS_PIN       UART_PIN_NO_CHANGE
+#define UART_RX_FLOW_THRESH 100
+
+// Runtime baud negotiation: the host requests a rate, gets "baud_ok" at the old
+// rate, and must send any valid frame/line at the new rate within
+// UART_BAUD_CONFIRM_MS or the firmware falls back to UART_BAUD_RATE.
+#define UART_BAUD_CONFIRM_MS 1000
+
+// Logs and periodic telemetry go out on TX-only UART1 so UART0 carries nothing
+// but protocol traffic. esp_log output is formatted into a byte ring (dropped,
+// never waited on, when full) and drained by a low-priority task. Build with
+// -DDISPENSER_LOG_UART=0 to silence logging instead. ESP_EARLY_LOGx/ESP_DRAM_LOGx
+// bypass the sink and print on UART0: do not use them in this app.
+#ifndef DISPENSER_LOG_UART
+#define DISPENSER_LOG_UART   1
+#endif
+#define LOG_UART_NUM         UART_NUM_1
+#define LOG_UART_TX_PIN      5
+#define LOG_UART_BAUD_RATE   115200
+#define LOG_RING_SIZE        4096
+#define LOG_LINE_MAX         160
+#define TELEMETRY_PERIOD_MS  10000
+
+#define BUF_SIZE           RX_VIEW_MAX // UART driver RX and TX buffers are twice this
+
+// Replies waiting for tx_task; must hold the largest one (a stats reply) plus the
+// final ACKs reserved for every order in the pool.
+#define TX_RING_SIZE       4096
+// tx_task hands the UART at most this much at a time; the ring space is free again
+// once the driver has taken it (about 45 ms at 115200 baud).
+#define TX_WRITE_CHUNK     512
+// Longest done/short/cancelled JSON ACK: 3-digit counts and dispensed, seq and order.
+#define TX_FINAL_ACK_MAX   (100 + DISPENSER_NUM_CHANNELS * 8)
+// How long uart_task waits for ring space for a reply that ends an exchange (busy,
+// bad_*, control replies) before dropping it. Holds off reading the next frame,
+// so it is also the longest it can delay a cancel or e-stop behind a full ring.
+#define TX_REPLY_WAIT_MS   100
+
+// Session liveness: a {"status":"hello"} banner once the firmware is ready (and on
+// {"cmd":"hello"}), then a heartbeat line every HEARTBEAT_PERIOD_MS from tx_task.
+// The banner carries a random boot_id that every heartbeat repeats, so a host
+// holding the port open sees a reset even if it missed the banner.
+#define HEARTBEAT_PERIOD_MS 1000
+
+// Event-driven RX: wake on '\n' (JSON lines) or after the line goes idle for
+// UART_RX_TOUT_SYMBOLS character times (binary frames carry no terminator byte).
+#define UART_EVENT_QUEUE_LEN  20
+#define UART_PATTERN_CHR      '\n'
+#define UART_PATTERN_QUEUE_LEN 16
+#define UART_RX_TOUT_SYMBOLS  3
+
+#define V2_MAX_BATCH_ORDERS    CMD_QUEUE_DEPTH
+
+#define MAX_PILLS_PER_CHANNEL  20
+
+#define LEDC_GROUP_CHANNELS    8
+
+// Servo pins, in channel order; only the first DISPENSER_NUM_CHANNELS are used.
+// The first four are the original board's wiring.
+#define SERVO_PINS { 18, 19, 21, 22, 23, 25, 26, 27, 32, 33, 13, 14, 15, 16, 17, 4 }
+
+// Optional drop sensor per channel (IR break-beam receiver or a current-sense
+// comparator), active low. Build with -DDISPENSER_DROP_SENSORS=1 to enable them on
+// the input-only pins 34/35/36/39 (no internal pull-ups: fit external ones);
+// -1 = no sensor, that channel stays open loop.
+#ifndef DISPENSER_DROP_SENSORS
+#define DISPENSER_DROP_SENSORS 0
+#endif
+#if DISPENSER_DROP_SENSORS
+#define DROP_SENSOR_PINS { 34, 35, 36, 39, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 }
+#else
+#define DROP_SENSOR_PINS { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 }
+#endif
+// Extra strokes for a pill that was not seen within its cycle before the channel
+// is given up on (slot empty or jammed).
+#define DROP_MAX_RETRIES   2
+
+#define SERVO_FREQ         50
+#define SERVO_RESOLUTION   LEDC_TIMER_16_BIT
+#define SERVO_PERIOD_US    20000
+
+// Default pulse range (0 deg .. SERVO_MAX_ANGLE_DEG) for every servo until one is
+// calibrated over UART ({"cmd":"cal"} / V2_OP_SET_CALIBRATION, kept in NVS).
+// Many servos need wider than 1000-2000us to reach full motion.
+#define SERVO_MIN_PULSE_US 500
+#define SERVO_MAX_PULSE_US 2500
+#define SERVO_MAX_ANGLE_DEG 180
+// Limits for a calibrated pulse width (and for the calibration jog).
+#define SERVO_CAL_PULSE_MIN_US 300
+#define SERVO_CAL_PULSE_MAX_US 2700
+// Entries per channel in the angle -> duty table.
+#define SERVO_LUT_SIZE (SERVO_MAX_ANGLE_DEG * SERVO_ANGLE_STEPS_PER_DEG + 1)
+// Where a cancel or e-stop leaves every moving servo: home, slot closed. It is
+// then detached like any idle servo, so a jammed one stops pushing.
+#define SERVO_SAFE_ANGLE_DEG 0
+
+// Servo power. SERVO_DETACH_MS after a channel comes to rest at home its pulses
+// stop (duty 0): the servo goes limp and draws only its idle current instead of
+// holding 0 deg against nothing. The next stroke re-attaches it.
+#define SERVO_DETACH_MS    500
+// Stroke starts on different channels are at least this far apart (rounded up to
+// whole SERVO_PERIOD_US ticks): a start-up surge of ~1 A per servo for a few tens of
+// ms must never coincide with another, or the motor rail sags toward brown-out.
+#define SERVO_START_STAGGER_MS 60
+
+#define SHAKE_COUNT        3
+#define SHAKE_SPEED_MS     50
+
+// Default motion profile for every channel until one is stored in NVS. The old
+// fixed sweep was linear 0->180->0 in 1000 ms; this S-curve covers the same
+// travel in ~2x440 ms with zero acceleration at both ends of each stroke.
+#define PROFILE_DEFAULT_SHAPE       MOTION_SHAPE_SCURVE
+#define PROFILE_DEFAULT_TRAVEL_DEG  SERVO_MAX_ANGLE_DEG
+#define PROFILE_DEFAULT_VMAX_DPS    720
+#define PROFILE_DEFAULT_ACCEL_DPS2  6000
+#define PROFILE_DEFAULT_DWELL_MS    0
+#define PROFILE_DEFAULT_PAUSE_MS    200
+
+// Motion scheduler: how many servos may sweep at the same time.
+// Each stalled/accelerating servo can pull ~0.5-1 A from the motor rail, so keep
+// this within the external supply's current budget (1 = legacy serial behaviour).
+#define MAX_ACTIVE_CHANNELS 2
+
+// Serial: a channel holds its MAX_ACTIVE_CHANNELS slot until its return stroke
+// ends. Pipelined: the slot is freed when the (unloaded) return starts, so the
+// next channel's outbound stroke overlaps it. Switchable with {"cmd":"cycle_mode"}.
+#define CYCLE_MODE_DEFAULT  CYCLE_MODE_SERIAL
+
+// FIFO: every order is a motion run of its own. Coalesce: motion_task gathers the
+// orders waiting in the queue (waiting up to COALESCE_WINDOW_MS after the first
+// for more) into one run: counts add up per channel, the channel with the most
+// pills starts first, no channel sits out an order it has no pills in, and each
+// order gets its done/short ACK as soon as its own pills are counted. Pills of
+// different orders leave the chute interleaved, so coalesce only where the host
+// keeps them apart. Switchable with {"cmd":"schedule"}.
+#define SCHEDULE_MODE_DEFAULT SCHEDULE_MODE_FIFO
+#define COALESCE_WINDOW_MS  50
+
+// Validated dispense commands waiting for the motion task.
+#define CMD_QUEUE_DEPTH     8
+#define CMD_POOL_SIZE       (CMD_QUEUE_DEPTH + 1) // + the order motion_task is running
+
+// Bump arena for cJSON trees (one line at a time). The largest real command, an
+// order naming all 16 channels, needs about 1.2 KB.
+#define JSON_ARENA_SIZE     4096
+
+// Task topology. Core 0 runs everything that talks to the host: the UART ISR
+// (installed from app_main), uart_task, tx_task and log_task, next to the system
+// tasks. Core 1 runs only motion: motion_task and, with
+// CONFIG_ESP_TIMER_TASK_AFFINITY_CPU1 (sdkconfig.defaults), the esp_timer task
+// that steps the motion generator, so a parsing burst or a cJSON allocation never
+// delays a servo update. Single-core chips put everything on core 0.
+// Stacks are static; "stack_free" in the stats reply (and the telemetry line)
+// gives each task's high-water mark, so re-check it after changing a task.
+#define PROTOCOL_CORE        0
+#define MOTION_TASK_CORE     (portNUM_PROCESSORS - 1)
+
+#define MOTION_TASK_PRIORITY 11
+#define UART_TASK_PRIORITY   10
+#define TX_TASK_PRIORITY     9 // below uart_task and motion_task
+#define LOG_TASK_PRIORITY    2
+
+#define MOTION_TASK_STACK    4096 // NVS journal writes, ACK formatting
+#define UART_TASK_STACK      4096 // cJSON, reply formatting
+#define TX_TASK_STACK        3072 // heartbeat snprintf
+#define LOG_TASK_STACK       3072 // telemetry ESP_LOGI
+
+// Order journal: while an order runs, its progress is rewritten in NVS at most
+// once per JOURNAL_MIN_INTERVAL_MS. Keep this well below one outbound stroke so a
+// pill is always journalled as in flight before it can drop.
+#define JOURNAL_MIN_INTERVAL_MS 100
+
+// Firmware update (ota.c). Chunks are gathered into OTA_WRITE_BUF_SIZE (one flash
+// sector) before each write. An update fed nothing for OTA_IDLE_TIMEOUT_MS is
+// dropped; a freshly flashed image that has not heard from the host within
+// OTA_CONFIRM_TIMEOUT_MS of booting is rolled back.
+#define OTA_WRITE_BUF_SIZE     4096
+#define OTA_IDLE_TIMEOUT_MS    10000
+#define OTA_CONFIRM_TIMEOUT_MS 60000
+
+// An image is only made bootable if the sender proves it holds the update key:
+// OTA_END (and ota_url) carry HMAC-SHA256(key, image). The key is 32 bytes given
+// to the build as 64 hex digits, -DDISPENSER_OTA_KEY=... (see CMakeLists.txt); a
+// build without one refuses every update ("no_key"). The key sits in the app
+// image, so boards that need more than this should also enable flash encryption
+// or secure boot with signed apps, which esp_ota_end then enforces as well.
+#ifndef OTA_AUTH_KEY
+#define OTA_AUTH_KEY ""
+#endif
+#define OTA_AUTH_KEY_LEN 32
+#define OTA_AUTH_TAG_LEN 32
+
+// Updates pulled over Wi-Fi ({"cmd":"ota_url"}). Off by default: nothing else on
+// the board uses the radio. Build with -DDISPENSER_OTA_WIFI=1 and the network in
+// -DDISPENSER_OTA_WIFI_SSID=... -DDISPENSER_OTA_WIFI_PASSWORD=... (see CMakeLists.txt).
+#ifndef DISPENSER_OTA_WIFI
+#define DISPENSER_OTA_WIFI 0
+#endif
+#if DISPENSER_OTA_WIFI && !defined(OTA_WIFI_SSID)
+#error "DISPENSER_OTA_WIFI needs DISPENSER_OTA_WIFI_SSID"
+#endif
+#ifndef OTA_WIFI_PASSWORD
+#define OTA_WIFI_PASSWORD ""
+#endif
+#define OTA_URL_MAX_LEN      192
+#define OTA_WIFI_CONNECT_MS  15000
+#define OTA_HTTP_TIMEOUT_MS  10000
+#define OTA_TASK_PRIORITY    5
+#define OTA_TASK_STACK       8192 // TLS handshake in esp_http_client
+
+typedef enum {
+    SERVO_PHASE_IDLE = 0,
+    SERVO_PHASE_OUTBOUND, // 0 -> travel
+    SERVO_PHASE_DWELL,    // hold at travel so the pill can drop clear
+    SERVO_PHASE_RETURN,   // travel -> 0
+    SERVO_PHASE_PAUSE,    // settle time before the next pill on this channel
+} servo_phase_t;
+
+typedef enum {
+    CYCLE_MODE_SERIAL = 0,
+    CYCLE_MODE_PIPELINED = 1,
+} cycle_mode_t;
+
+typedef enum {
+    SCHEDULE_MODE_FIFO = 0,
+    SCHEDULE_MODE_COALESCE = 1,
+} schedule_mode_t;
+
+typedef enum {
+    MOTION_SHAPE_LINEAR = 0, // constant speed, instant start/stop (legacy sweep)
+    MOTION_SHAPE_TRAPEZOID,  // linear acceleration ramps up to vmax
+    MOTION_SHAPE_SCURVE,     // sinusoidal velocity ramps: acceleration is continuous
+    MOTION_SHAPE_MAX,
+} motion_shape_t;
+
+// Per-channel stroke, tuned to the slot (set over UART, persisted in NVS as a blob,
+// so keep the layout stable).
+typedef struct {
+    uint8_t shape;       // motion_shape_t
+    uint8_t travel_deg;  // 1..SERVO_MAX_ANGLE_DEG
+    uint16_t vmax_dps;   // peak speed, deg/s
+    uint16_t accel_dps2; // acceleration limit, deg/s^2 (unused for linear)
+    uint16_t dwell_ms;
+    uint16_t pause_ms;
+} motion_profile_t;
+
+// Per-servo pulse widths at 0 deg and at SERVO_MAX_ANGLE_DEG (persisted in NVS as
+// a blob, so keep the layout stable). min > max reverses the servo.
+typedef struct {
+    uint16_t min_pulse_us;
+    uint16_t max_pulse_us;
+} servo_cal_t;
+
+// Stroke timing derived from a profile once, so the motion timer does no sqrt.
+typedef struct {
+    uint8_t shape;
+    float travel_deg;
+    float vpeak_dps;
+    float ramp_s;   // duration of the acceleration (and the deceleration) ramp
+    float ramp_deg; // travel covered during one ramp
+    int64_t move_us; // one stroke, 0 -> travel
+    int64_t dwell_us;
+    int64_t pause_us;
+} motion_plan_t;
+
+// Structure to store servo configuration
+typedef struct {
+    ledc_mode_t mode;
+    ledc_channel_t channel;
+    const uint16_t* lut; // duty per 1/SERVO_ANGLE_STEPS_PER_DEG degree, from the calibration
+    // Motion scheduler state (owned by the motion timer while a command runs)
+    int remaining;
+    servo_phase_t phase;
+    int64_t phase_start_us;
+    int64_t cycle_start_us; // outbound start of the current pill, for stats
+    bool holds_slot; // counted in motion_active
+    motion_profile_t profile; // snapshot of the channel's profile for the current pill
+    motion_plan_t plan;
+    // Drop sensing (only used when the channel has a sensor)
+    bool dropped;  // a drop was seen during the current cycle
+    int retries;   // extra strokes spent on the current pill
+    int dispensed; // pills confirmed (or, open loop, strokes completed) this command
+    // Power management
+    bool attached;         // receiving pulses
+    int64_t idle_since_us; // when the channel last came to rest
+} servo_t;
+
+// One parsed order handed from uart_task to motion_task.
+typedef struct {
+    int counts[DISPENSER_NUM_CHANNELS];
+    const char* protocol; // static string, echoed back in the ACKs
+    int32_t seq;          // V2 sequence number, -1 for V1/JSON (no seq on the wire)
+    uint8_t order;        // index within a V2 batch
+    const int* dispensed; // actual per-channel counts for done/short ACKs, else NULL
+    int64_t rx_us;        // when uart_task picked up the bytes, for latency stats
+    unsigned cancel_gen;  // motion_cancel_gen when queued; stale = cancelled
+    bool tx_reserved;     // holds a TX_FINAL_ACK_MAX slot in the TX ring for its final ACK
+} dispense_cmd_t;
+
+// One run of the motion generator: a single order, or several coalesced ones.
+typedef struct {
+    int counts[DISPENSER_NUM_CHANNELS]; // pills per channel, all orders together
+    unsigned cancel_gen;                // generation the orders were queued under
+    bool longest_first;                 // admit the channel with the most pills left first
+    // Called from execute_channel_counts (the calling task) whenever a pill is
+    // counted; bit n of settled: channel n is finished, dispensed[n] is final.
+    void (*on_progress)(void* ctx, const int dispensed[DISPENSER_NUM_CHANNELS], uint16_t settled);
+    void* ctx;
+} motion_run_t;
+
+typedef enum {
+    ACK_MODE_JSON = 0,
+    ACK_MODE_BINARY = 1,
+} ack_mode_t;
+
+// Wire codes for the binary ACK; ack_status_names gives the JSON spelling.
+typedef enum {
+    ACK_QUEUED = 1,
+    ACK_DONE,
+    ACK_BUSY,
+    ACK_BAD_JSON,
+    ACK_BAD_CRC,
+    ACK_BAD_PAYLOAD,
+    ACK_BAD_OPCODE,
+    ACK_PONG,
+    ACK_MODE_OK,
+    ACK_BAUD_OK,
+    ACK_MAP_OK,
+    ACK_PROFILE_OK,
+    ACK_SHORT, // finished, but at least one channel dispensed fewer than requested
+    ACK_CYCLE_MODE_OK,
+    ACK_STATS,
+    ACK_JOURNAL,
+    ACK_HELLO,
+    ACK_HEARTBEAT, // unsolicited, never answers a request
+    ACK_CANCELLED, // final ACK of an order stopped (or never started) by cancel/e-stop
+    ACK_CANCEL_OK,
+    ACK_ESTOP_OK,
+    ACK_ESTOP,     // order refused: e-stop latched
+    ACK_SCHEDULE_OK,
+    ACK_PROGRESS,  // a pill of a running order was counted; never final
+    ACK_OTA_OK,
+    ACK_OTA_ERROR,
+    ACK_CAL_OK,
+    ACK_STATUS_MAX,
+} ack_status_t;
+
+// One run as journalled in NVS (a blob, so keep the layout stable). After a
+// reset mid-order the host gets it back with {"cmd":"journal"} / V2_OP_GET_JOURNAL.
+// A coalesced run is journalled as one entry: protocol/seq/order name its first
+// order, counts and dispensed are the run's totals. Version 1 had no n_orders
+// (always one order).
+#define JOURNAL_VERSION 2
+
+typedef struct {
+    uint8_t version;    // JOURNAL_VERSION
+    uint8_t protocol;   // index into journal_protocols
+    uint8_t order;
+    uint8_t n_channels; // DISPENSER_NUM_CHANNELS of the build that wrote it
+    int32_t seq;
+    uint8_t counts[DISPENSER_MAX_CHANNELS];
+    uint8_t dispensed[DISPENSER_MAX_CHANNELS];
+    uint16_t in_flight; // bit n: channel n was mid-cycle, its next pill may have dropped
+    uint8_t n_orders;   // orders in the run (1 unless coalesced)
+} journal_entry_t;
+
+// Field metrics, read with {"cmd":"stats"} / V2_OP_GET_STATS. Counters and
+// histograms are relaxed atomics, so uart_task, the motion timer and motion_task
+// update them without locks; a reset racing an update may lose that one sample.
+// Histogram bucket b counts durations in [2^(b-1), 2^b) us (bucket 0: 0 us).
+#define STATS_HIST_BUCKETS 32
+
+typedef struct {
+    atomic_uint count;
+    atomic_uint max_us;
+    atomic_uint buckets[STATS_HIST_BUCKETS];
+} stats_hist_t;
+
+typedef struct {
+    atomic_uint rx_bytes;
+    atomic_uint orders;
+    atomic_uint resync_bytes;      // bytes skipped to find the next frame/line
+    atomic_uint checksum_failures; // V1 checksum and V2 CRC mismatches
+    atomic_uint bad_json;
+    atomic_uint rx_overflows;      // driver FIFO/buffer overflows (input flushed)
+    atomic_uint log_drops;         // log lines lost because the log ring was full
+    atomic_uint tx_drops;          // replies lost because the TX ring was full
+    atomic_uint tx_final_drops;    // of those, final order ACKs (0 unless the reservation is broken)
+    atomic_uint json_oom;          // JSON lines rejected because the arena was full
+    atomic_uint cancelled;         // orders ended by cancel/e-stop (running or queued)
+    stats_hist_t latency;          // bytes received -> order starts moving
+    stats_hist_t cycle;            // one pill: outbound start -> end of pause
+    stats_hist_t command;          // whole order in the motion task
+} dispenser_stats_t;
+
+static inline void stats_inc(atomic_uint* counter, unsigned n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+typedef enum {
+    TASK_UART = 0,
+    TASK_MOTION,
+    TASK_TX,
+    TASK_LOG,
+    TASK_OTA, // only with DISPENSER_OTA_WIFI
+    TASK_MAX,
+} dispenser_task_id_t;
+
+// Creates a long-lived task on a static stack (ESP-IDF stacks are in bytes) and
+// records its handle for the high-water mark reports.
+#define DISPENSER_TASK_START(id, fn, stack_bytes, priority, core)                         \
+    do {                                                                                  \
+        static StackType_t stack_[stack_bytes];                                           \
+        static StaticTask_t tcb_;                                                         \
+        dispenser_tasks[id] = xTaskCreateStaticPinnedToCore(fn, dispenser_task_names[id], \
+                                                            stack_bytes, NULL, priority,  \
+                                                            stack_, &tcb_, core);         \
+    } while (0)
+
+// stats.c
+extern dispenser_stats_t stats;
+void stats_hist_record(stats_hist_t* h, int64_t us);
+void stats_reset(void);
+
+// channel_map.c
+extern char channel_names[DISPENSER_NUM_CHANNELS][CHANNEL_NAME_MAX_LEN + 1];
+void channel_map_init(void);
+bool channel_map_set(int channel, const char* name, size_t len);
+int pill_to_index(const char* pill, size_t len);
+
+// motion.c
+extern const char* const motion_shape_names[MOTION_SHAPE_MAX];
+extern motion_profile_t motion_profiles[DISPENSER_NUM_CHANNELS];
+extern motion_plan_t motion_plans[DISPENSER_NUM_CHANNELS];
+extern volatile cycle_mode_t cycle_mode;
+extern atomic_uint motion_cancel_gen;
+void motion_profiles_init(void);
+bool motion_profile_set(int channel, const motion_profile_t* p);
+extern servo_cal_t servo_cals[DISPENSER_NUM_CHANNELS];
+void servo_cal_init(void);
+bool servo_cal_set(int channel, const servo_cal_t* c);
+bool servo_pulse_test(int channel, uint16_t pulse_us);
+void motion_init(void);
+void motion_cancel(void); // the running order and every order queued so far stop
+void motion_estimate(const int counts[DISPENSER_NUM_CHANNELS], uint32_t* eta_ms, uint32_t* gap_ms);
+bool execute_channel_counts(const motion_run_t* run, int dispensed[DISPENSER_NUM_CHANNELS]); // false if cancelled
+
+// journal.c
+extern const char* const journal_protocols[3];
+void journal_init(void); // after nvs_flash_init: moves a leftover active order to "interrupted"
+void journal_begin(const dispense_cmd_t* first, const int counts[DISPENSER_NUM_CHANNELS], uint8_t n_orders);
+void journal_progress(const int dispensed[DISPENSER_NUM_CHANNELS], uint16_t in_flight);
+void journal_end(void);
+bool journal_interrupted(journal_entry_t* out);
+void journal_clear_interrupted(void);
+
+// ota.c
+typedef enum {
+    OTA_SRC_NONE = 0,
+    OTA_SRC_UART,
+    OTA_SRC_WIFI,
+} ota_source_t;
+
+typedef enum {
+    OTA_OK = 0,
+    OTA_ERR_BUSY,         // another source is updating
+    OTA_ERR_NOT_STARTED,  // no update from this source in progress
+    OTA_ERR_NO_PARTITION, // partition table without an ota_0/ota_1 pair
+    OTA_ERR_SIZE,
+    OTA_ERR_OFFSET,       // chunk out of order; resume from ota_offset()
+    OTA_ERR_FLASH,
+    OTA_ERR_CRC,
+    OTA_ERR_IMAGE,        // esp_ota_end rejected the image
+    OTA_ERR_NETWORK,
+    OTA_ERR_TIMEOUT,
+    OTA_ERR_AUTH,         // HMAC tag does not match the image
+    OTA_ERR_NO_KEY,       // built without DISPENSER_OTA_KEY
+    OTA_ERR_MAX,
+} ota_err_t;
+
+extern const char* const ota_err_names[OTA_ERR_MAX];
+void ota_init(void);        // boot: holds a freshly flashed image on trial
+void ota_app_confirm(void); // the host talks to this image: keep it
+bool ota_in_progress(void); // an update owns the flash, orders are refused
+ota_err_t ota_begin(ota_source_t src, uint32_t size, uint32_t crc32);
+ota_err_t ota_write(ota_source_t src, uint32_t offset, const uint8_t* data, size_t len);
+// tag: HMAC-SHA256 of the image under OTA_AUTH_KEY. On OTA_OK the new image boots next.
+ota_err_t ota_finish(ota_source_t src, const uint8_t tag[OTA_AUTH_TAG_LEN]);
+void ota_abort(ota_source_t src);
+uint32_t ota_offset(void); // bytes accepted so far
+const char* ota_state_name(void);
+const char* ota_running_label(void);
+const char* ota_app_version(void);
+#if DISPENSER_OTA_WIFI
+void ota_wifi_init(void);
+// hmac: the image's tag as 64 hex digits. False if busy or the tag is malformed.
+bool ota_wifi_start(const char* url, uint32_t size, uint32_t crc32, const char* hmac);
+#endif
+
+// pool.c
+void cmd_pool_init(void);
+dispense_cmd_t* cmd_pool_alloc(void); // NULL when every object is in use
+void cmd_pool_free(dispense_cmd_t* cmd);
+unsigned cmd_pool_available(void);
+void json_arena_init(void);  // installs the cJSON hooks
+size_t json_arena_mark(void);
+void json_arena_release(size_t mark); // after cJSON_Delete / a failed parse
+void json_arena_take_usage(size_t* peak, uint32_t* allocs);
+
+// protocol.c
+extern const char* const ack_status_names[ACK_STATUS_MAX];
+extern QueueHandle_t cmd_queue; // dispense_cmd_t* taken from the command pool
+void protocol_init(void); // baud confirm timer, command queue and pool, JSON arena
+void tx_init(void);       // TX ring and tx_task; replies are written synchronously before this
+void send_ack(ack_status_t status, const dispense_cmd_t* cmd, int queue_depth);
+// Pill got[channel] of cmd's counts[channel] (0-based channel) is out, elapsed_us
+// into its run; got[] is the order's per-channel total so far.
+void send_progress(const dispense_cmd_t* cmd, int channel, const int got[DISPENSER_NUM_CHANNELS], int64_t elapsed_us);
+void send_journal(const char* protocol, int32_t seq, bool clear);
+void send_hello(const char* protocol, int32_t seq);
+void send_ota_reply(const char* protocol, int32_t seq, ota_err_t err);
+void dispenser_reboot(void); // lets queued replies drain first
+
+// dispenser.c
+extern int64_t uart_rx_us; // time of the UART event being parsed (uart_task only)
+extern const char* const dispenser_task_names[TASK_MAX];
+extern TaskHandle_t dispenser_tasks[TASK_MAX]; // NULL until started
+extern volatile schedule_mode_t schedule_mode;
+unsigned dispenser_task_stack_free(dispenser_task_id_t id); // bytes never used, 0 if not running
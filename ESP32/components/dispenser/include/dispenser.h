@@ -0,0 +1,104 @@
+#pragma once
+
+// Pill dispenser firmware core: UART protocol parsing, motion scheduling and
+// servo output. The firmware app only calls dispenser_start(); the bench app in
+// ESP32/bench links the same code and drives the hot paths directly.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "rx_ring.h"
+
+// Number of dispenser channels (one servo each). Override at build time with
+// `idf.py -DDISPENSER_NUM_CHANNELS=12 build`. Channels 0-7 use the LEDC high-speed
+// group, 8-15 the low-speed group.
+#ifndef DISPENSER_NUM_CHANNELS
+#define DISPENSER_NUM_CHANNELS 4
+#endif
+#define DISPENSER_MAX_CHANNELS 16
+
+#if DISPENSER_NUM_CHANNELS < 1 || DISPENSER_NUM_CHANNELS > DISPENSER_MAX_CHANNELS
+#error "DISPENSER_NUM_CHANNELS must be between 1 and 16"
+#endif
+
+// Servo angle resolution: the motion generator and angle_to_duty() work in
+// quarter degrees.
+#define SERVO_ANGLE_STEPS_PER_DEG 4
+
+// SAURON_UART_V1 binary frame (Jetson/FSM -> ESP32)
+#define UART_FRAME_START   0xAA
+#define UART_FRAME_END     0x55
+#define UART_FRAME_VER_1   0x01
+#define UART_FRAME_LEN_V1  8
+
+// SAURON_UART_V2 frame:
+//   [0] 0xAA  [1] 0x02  [2..3] seq (LE)  [4] opcode  [5] payload length N
+//   [6..6+N-1] payload  [6+N..7+N] CRC16-CCITT over bytes 1..5+N (LE)  [8+N] 0x55
+#define UART_FRAME_VER_2       0x02
+#define UART_FRAME_V2_HDR_LEN  6
+#define UART_FRAME_V2_OVERHEAD 9
+#define UART_FRAME_V2_MAX_PAYLOAD 240
+
+#define V2_OP_DISPENSE_BATCH   0x01 // payload: n_orders, n_channels, then n_channels counts per order
+#define V2_OP_PING             0x02 // payload: none
+#define V2_OP_SET_ACK_MODE     0x03 // payload: ack_mode_t
+#define V2_OP_SET_BAUD         0x04 // payload: u32 baud (LE)
+#define V2_OP_SET_CHANNEL_NAME 0x05 // payload: channel (1-based), name bytes (empty = default)
+#define V2_OP_SET_PROFILE      0x06 // payload: channel (1-based), then V2_PROFILE_PAYLOAD_LEN
+                                    //   bytes (empty = default): shape, travel_deg,
+                                    //   vmax_dps, accel_dps2, dwell_ms, pause_ms (u16 LE)
+#define V2_PROFILE_PAYLOAD_LEN 10
+#define V2_OP_SET_CYCLE_MODE   0x07 // payload: cycle_mode_t
+#define V2_OP_GET_STATS        0x08 // payload: none, or flags (bit 0: reset after reading)
+#define V2_OP_GET_JOURNAL      0x09 // payload: none, or flags (bit 0: clear the interrupted order)
+#define V2_OP_HELLO            0x0A // payload: none; replies with the boot banner
+#define V2_OP_CANCEL           0x0B // payload: none; stops the running order, drops the queued ones
+#define V2_OP_ESTOP            0x0C // payload: none (engage), or flags (bit 0: release)
+#define V2_OP_SET_SCHEDULE     0x0D // payload: schedule_mode_t (0 fifo, 1 coalesce)
+// Firmware update into the inactive OTA partition. Replies are always JSON
+// ota_ok/ota_error lines carrying the bytes accepted so far ("offset").
+#define V2_OP_OTA_BEGIN        0x0E // payload: u32 image size, u32 CRC32 of the image (LE)
+#define V2_OP_OTA_DATA         0x0F // payload: u32 offset (LE), then up to 236 image bytes
+#define V2_OP_OTA_END          0x10 // payload: HMAC-SHA256 of the image (32 bytes); verify, switch
+                                    //   partitions, reboot
+#define V2_OP_OTA_ABORT        0x11 // payload: none
+#define V2_OP_SET_CALIBRATION  0x12 // payload: channel (1-based), then u16 pulse_us at 0 deg and
+                                    //   at 180 deg (LE; empty = default)
+#define V2_OP_SERVO_PULSE      0x13 // payload: channel (1-based), u16 pulse_us (LE): calibration jog
+
+// Compact binary ACK (ESP32 -> host), selected with V2_OP_SET_ACK_MODE or
+// {"cmd":"ack_mode","mode":"binary"}; JSON lines stay the default:
+//   [0] 0xA5  [1..2] seq (LE, 0xFFFF = none)  [3] ack_status_t  [4] order
+//   [5] n_channels N  [6..5+N] counts  [6+N..7+N] detail (LE)
+//   [8+N..9+N] CRC16-CCITT over bytes 1..7+N (LE)  [10+N] 0x5A
+// For done/short the counts are the pills actually dispensed and detail holds the
+// per-channel result bits (bit n set: channel n reached its requested count);
+// for progress the counts are the pills out so far and detail is the channel
+// (1-based) whose pill was just counted; detail is the queue depth for
+// queued/busy and 0 otherwise.
+#define ACK_FRAME_START        0xA5
+#define ACK_FRAME_END          0x5A
+#define ACK_FRAME_OVERHEAD     11
+
+// Bring up everything: log sink, NVS-backed settings, UART0, servos and the
+// uart/motion tasks.
+void dispenser_start(void);
+
+// NVS, channel map, motion profiles and the command queue only: no UART, LEDC
+// or tasks. Enough to call the parsers below; orders just sit in the queue.
+esp_err_t dispenser_core_init(void);
+
+// Where replies go. NULL (the default) writes to UART0.
+typedef int (*dispenser_output_fn)(const void* data, size_t len);
+void dispenser_set_output(dispenser_output_fn fn);
+
+// Drop every order waiting for the motion task.
+void dispenser_flush_orders(void);
+
+// Hot paths, called from uart_task in the firmware.
+uint16_t crc16_ccitt(const uint8_t* data, size_t len);
+uint32_t angle_to_duty(int channel, int angle_q); // angle_q in 1/SERVO_ANGLE_STEPS_PER_DEG degree
+int try_handle_sauron_frame(const uint8_t* frame, size_t len);
+void handle_json_command_line(const char* line, size_t len);
+void rx_ring_parse(rx_ring_t* rx);
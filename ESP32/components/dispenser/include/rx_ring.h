@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define RX_ACCUM_SIZE      2048 // ring capacity; must be a power of two
+#define RX_VIEW_MAX        1024 // longest frame/line handed out as one contiguous view
+
+// RX accumulator: a ring with free-running head/tail counters. The first
+// RX_VIEW_MAX bytes are mirrored past the end of the storage, so any window of up
+// to RX_VIEW_MAX bytes is contiguous in memory even when it wraps. Frames and lines
+// are parsed in place from (ptr, len) views and consumed by bumping head.
+typedef struct {
+    uint8_t buf[RX_ACCUM_SIZE + RX_VIEW_MAX];
+    uint32_t head;
+    uint32_t tail;
+} rx_ring_t;
+
+#define RX_RING_MASK (RX_ACCUM_SIZE - 1)
+
+static inline size_t rx_ring_len(const rx_ring_t* r) {
+    return (size_t)(r->tail - r->head);
+}
+
+static inline uint8_t rx_ring_at(const rx_ring_t* r, size_t off) {
+    return r->buf[(r->head + off) & RX_RING_MASK];
+}
+
+static inline void rx_ring_consume(rx_ring_t* r, size_t n) {
+    r->head += (uint32_t)n;
+}
+
+// View of the oldest bytes; len must not exceed RX_VIEW_MAX.
+static inline const uint8_t* rx_ring_view(const rx_ring_t* r) {
+    return &r->buf[r->head & RX_RING_MASK];
+}
+
+// Contiguous space at tail that uart_read_bytes can fill directly.
+static inline size_t rx_ring_write_span(rx_ring_t* r, uint8_t** out) {
+    size_t idx = r->tail & RX_RING_MASK;
+    *out = &r->buf[idx];
+    return RX_ACCUM_SIZE - idx;
+}
+
+// Publish n bytes written into the write span. If the ring overflowed, the
+// oldest bytes were overwritten and are dropped.
+static inline void rx_ring_commit(rx_ring_t* r, size_t n) {
+    size_t idx = r->tail & RX_RING_MASK;
+    if (idx < RX_VIEW_MAX) {
+        size_t mirror = RX_VIEW_MAX - idx;
+        if (mirror > n) mirror = n;
+        memcpy(&r->buf[RX_ACCUM_SIZE + idx], &r->buf[idx], mirror);
+    }
+    r->tail += (uint32_t)n;
+    if (rx_ring_len(r) > RX_ACCUM_SIZE) {
+        r->head = r->tail - RX_ACCUM_SIZE;
+    }
+}
@@ -0,0 +1,126 @@
+#include <string.h>
+#include "esp_log.h"
+#include "nvs.h"
+#include "dispenser_internal.h"
+
+// Crash-safe order journal. The running order lives under "active": written when
+// its first pill starts, rewritten as pills start and finish (rate-limited by the
+// caller) and erased once the order is done. NVS already appends every write to
+// a fresh entry, spreads them over its pages and only ever exposes the last
+// complete copy, so a brownout mid-write leaves the previous record intact.
+// Whatever is still under "active" at boot was interrupted; it moves to
+// "interrupted" and stays there until the host clears it. All writes happen in
+// motion_task (progress) or uart_task (clear), never in the motion timer.
+#define JOURNAL_NVS_NAMESPACE "journal"
+#define JOURNAL_KEY_ACTIVE    "active"
+#define JOURNAL_KEY_LOST      "interrupted"
+
+static const char* TAG = "journal";
+
+const char* const journal_protocols[3] = {"SAURON_UART_V1", "SAURON_UART_V2", "json_line"};
+
+static nvs_handle_t journal_nvs;
+static bool journal_ready;
+static journal_entry_t journal_active; // motion_task only
+static bool journal_active_stored;     // "active" exists in NVS
+static journal_entry_t journal_lost;
+static bool journal_have_lost;
+
+static bool journal_entry_valid(journal_entry_t* e) {
+    if (e->version == 1) {
+        // Same layout; the byte that is now n_orders was padding.
+        e->version = JOURNAL_VERSION;
+        e->n_orders = 1;
+    }
+    if (e->version != JOURNAL_VERSION || e->protocol >= 3 || e->n_orders < 1 ||
+        e->n_channels < 1 || e->n_channels > DISPENSER_MAX_CHANNELS) {
+        return false;
+    }
+    for (int ch = 0; ch < e->n_channels; ch++) {
+        if (e->dispensed[ch] > e->counts[ch]) return false;
+    }
+    return true;
+}
+
+static bool journal_load(const char* key, journal_entry_t* e) {
+    size_t size = sizeof(*e);
+    return nvs_get_blob(journal_nvs, key, e, &size) == ESP_OK && size == sizeof(*e) &&
+           journal_entry_valid(e);
+}
+
+void journal_init(void) {
+    if (nvs_open(JOURNAL_NVS_NAMESPACE, NVS_READWRITE, &journal_nvs) != ESP_OK) {
+        ESP_LOGW(TAG, "NVS unavailable, orders are not journalled");
+        return;
+    }
+    journal_ready = true;
+    journal_have_lost = journal_load(JOURNAL_KEY_LOST, &journal_lost);
+
+    journal_entry_t e;
+    if (journal_load(JOURNAL_KEY_ACTIVE, &e)) {
+        // A newer interruption replaces one the host never collected.
+        journal_lost = e;
+        journal_have_lost = true;
+        nvs_set_blob(journal_nvs, JOURNAL_KEY_LOST, &e, sizeof(e));
+    }
+    nvs_erase_key(journal_nvs, JOURNAL_KEY_ACTIVE);
+    nvs_commit(journal_nvs);
+
+    if (journal_have_lost) {
+        ESP_LOGW(TAG, "interrupted order: %s seq %d order %u", journal_protocols[journal_lost.protocol],
+                 (int)journal_lost.seq, journal_lost.order);
+    }
+}
+
+// RAM only: nothing reaches flash until the first pill starts.
+void journal_begin(const dispense_cmd_t* first, const int counts[DISPENSER_NUM_CHANNELS], uint8_t n_orders) {
+    memset(&journal_active, 0, sizeof(journal_active));
+    journal_active.version = JOURNAL_VERSION;
+    for (uint8_t i = 0; i < 3; i++) {
+        if (strcmp(first->protocol, journal_protocols[i]) == 0) journal_active.protocol = i;
+    }
+    journal_active.order = first->order;
+    journal_active.n_channels = DISPENSER_NUM_CHANNELS;
+    journal_active.seq = first->seq;
+    journal_active.n_orders = n_orders;
+    for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+        journal_active.counts[ch] = (uint8_t)(counts[ch] > 0 ? counts[ch] : 0);
+    }
+    journal_active_stored = false;
+}
+
+void journal_progress(const int dispensed[DISPENSER_NUM_CHANNELS], uint16_t in_flight) {
+    if (!journal_ready) return;
+    bool changed = !journal_active_stored || journal_active.in_flight != in_flight;
+    for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+        uint8_t n = (uint8_t)(dispensed[ch] < journal_active.counts[ch] ? dispensed[ch] : journal_active.counts[ch]);
+        if (journal_active.dispensed[ch] != n) changed = true;
+        journal_active.dispensed[ch] = n;
+    }
+    journal_active.in_flight = in_flight;
+    if (!changed) return;
+    if (nvs_set_blob(journal_nvs, JOURNAL_KEY_ACTIVE, &journal_active, sizeof(journal_active)) == ESP_OK &&
+        nvs_commit(journal_nvs) == ESP_OK) {
+        journal_active_stored = true;
+    }
+}
+
+void journal_end(void) {
+    if (!journal_ready || !journal_active_stored) return;
+    nvs_erase_key(journal_nvs, JOURNAL_KEY_ACTIVE);
+    nvs_commit(journal_nvs);
+    journal_active_stored = false;
+}
+
+bool journal_interrupted(journal_entry_t* out) {
+    if (!journal_have_lost) return false;
+    *out = journal_lost;
+    return true;
+}
+
+void journal_clear_interrupted(void) {
+    if (!journal_have_lost) return;
+    journal_have_lost = false;
+    nvs_erase_key(journal_nvs, JOURNAL_KEY_LOST);
+    nvs_commit(journal_nvs);
+}
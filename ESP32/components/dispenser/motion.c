@@ -0,0 +1,734 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "dispenser_internal.h"
+
+static servo_t servos[DISPENSER_NUM_CHANNELS];
+static const int servo_pins[DISPENSER_MAX_CHANNELS] = SERVO_PINS;
+static const int drop_sensor_pins[DISPENSER_MAX_CHANNELS] = DROP_SENSOR_PINS;
+static volatile uint8_t drop_seen[DISPENSER_NUM_CHANNELS]; // set by the sensor ISR
+
+// Per-servo calibration. uart_task owns servo_cals[] and rebuilds the channel's
+// duty table from it; the motion timer only ever reads the table, one load per
+// servo per tick instead of a multiply/divide chain. Tables are rebuilt only
+// while no order is queued or running, so a stroke never mixes two calibrations.
+#define SERVO_CAL_NVS_NAMESPACE "servo"
+
+servo_cal_t servo_cals[DISPENSER_NUM_CHANNELS];
+static uint16_t servo_lut[DISPENSER_NUM_CHANNELS][SERVO_LUT_SIZE];
+
+static const servo_cal_t servo_cal_default = {
+    .min_pulse_us = SERVO_MIN_PULSE_US,
+    .max_pulse_us = SERVO_MAX_PULSE_US,
+};
+
+static uint32_t pulse_to_duty(uint32_t pulse_us)
+{
+    // Map pulse width (us) to LEDC duty over a 20 ms period.
+    return (pulse_us * ((1U << 16) - 1)) / SERVO_PERIOD_US;
+}
+
+// min > max is a servo mounted the other way round; either way the range must
+// leave at least 1 us per degree.
+static bool servo_cal_valid(const servo_cal_t* c)
+{
+    int span = (int)c->max_pulse_us - (int)c->min_pulse_us;
+    return c->min_pulse_us >= SERVO_CAL_PULSE_MIN_US && c->min_pulse_us <= SERVO_CAL_PULSE_MAX_US &&
+           c->max_pulse_us >= SERVO_CAL_PULSE_MIN_US && c->max_pulse_us <= SERVO_CAL_PULSE_MAX_US &&
+           (span >= SERVO_MAX_ANGLE_DEG || -span >= SERVO_MAX_ANGLE_DEG);
+}
+
+static void servo_cal_apply(int channel, const servo_cal_t* c)
+{
+    servo_cals[channel] = *c;
+    int32_t span = (int32_t)c->max_pulse_us - (int32_t)c->min_pulse_us;
+    for (int q = 0; q < SERVO_LUT_SIZE; q++) {
+        // In 1/16 us, so every step keeps its own duty value instead of the pulse
+        // rounding to whole microseconds first.
+        uint32_t pulse_x16 = (uint32_t)((int32_t)c->min_pulse_us * 16 + span * 16 * q / (SERVO_LUT_SIZE - 1));
+        servo_lut[channel][q] = (uint16_t)(pulse_to_duty(pulse_x16) / 16);
+    }
+}
+
+void servo_cal_init(void)
+{
+    nvs_handle_t nvs;
+    bool have_nvs = nvs_open(SERVO_CAL_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK;
+    for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+        servo_cal_t c = servo_cal_default;
+        if (have_nvs) {
+            char key[8];
+            snprintf(key, sizeof(key), "cal%d", ch);
+            servo_cal_t stored;
+            size_t size = sizeof(stored);
+            if (nvs_get_blob(nvs, key, &stored, &size) == ESP_OK && size == sizeof(stored) &&
+                servo_cal_valid(&stored)) {
+                c = stored;
+            }
+        }
+        servo_cal_apply(ch, &c);
+    }
+    if (have_nvs) nvs_close(nvs);
+}
+
+// Set (c != NULL) or restore to the build default (c == NULL) one channel's pulse
+// range and persist it. Returns false on a bad channel/range or an NVS failure.
+// uart_task only, with no order queued or running.
+bool servo_cal_set(int channel, const servo_cal_t* c)
+{
+    if (channel < 0 || channel >= DISPENSER_NUM_CHANNELS || (c && !servo_cal_valid(c))) return false;
+
+    char key[8];
+    snprintf(key, sizeof(key), "cal%d", channel);
+    nvs_handle_t nvs;
+    if (nvs_open(SERVO_CAL_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return false;
+
+    esp_err_t err;
+    if (!c) {
+        err = nvs_erase_key(nvs, key);
+        if (err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+        c = &servo_cal_default;
+    } else {
+        err = nvs_set_blob(nvs, key, c, sizeof(*c));
+    }
+    if (err == ESP_OK) err = nvs_commit(nvs);
+    nvs_close(nvs);
+
+    servo_cal_apply(channel, c);
+    return err == ESP_OK;
+}
+
+// angle_q in 1/SERVO_ANGLE_STEPS_PER_DEG degree, clamped to 0..SERVO_MAX_ANGLE_DEG.
+uint32_t angle_to_duty(int channel, int angle_q)
+{
+    if (angle_q < 0) angle_q = 0;
+    if (angle_q >= SERVO_LUT_SIZE) angle_q = SERVO_LUT_SIZE - 1;
+    return servo_lut[channel][angle_q];
+}
+
+// Writing an angle (re-)attaches a detached servo.
+static void servo_write_angle(servo_t* s, int angle_q)
+{
+    ledc_set_duty(s->mode, s->channel, s->lut[angle_q]);
+    ledc_update_duty(s->mode, s->channel);
+    s->attached = true;
+}
+
+// No pulses at all: the servo stops holding its position and draws only its idle
+// current.
+static void servo_detach(servo_t* s)
+{
+    ledc_set_duty(s->mode, s->channel, 0);
+    ledc_update_duty(s->mode, s->channel);
+    s->attached = false;
+}
+
+// Motion profiles. uart_task owns motion_profiles[] and recomputes motion_plans[];
+// the motion timer copies a channel's plan under the lock when it starts a pill,
+// so a profile change takes effect from the next pill, never mid-stroke.
+#define MOTION_PROFILE_NVS_NAMESPACE "motion"
+
+const char* const motion_shape_names[MOTION_SHAPE_MAX] = {
+    [MOTION_SHAPE_LINEAR] = "linear",
+    [MOTION_SHAPE_TRAPEZOID] = "trapezoid",
+    [MOTION_SHAPE_SCURVE] = "scurve",
+};
+
+motion_profile_t motion_profiles[DISPENSER_NUM_CHANNELS];
+motion_plan_t motion_plans[DISPENSER_NUM_CHANNELS];
+static portMUX_TYPE motion_plan_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const motion_profile_t motion_profile_default = {
+    .shape = PROFILE_DEFAULT_SHAPE,
+    .travel_deg = PROFILE_DEFAULT_TRAVEL_DEG,
+    .vmax_dps = PROFILE_DEFAULT_VMAX_DPS,
+    .accel_dps2 = PROFILE_DEFAULT_ACCEL_DPS2,
+    .dwell_ms = PROFILE_DEFAULT_DWELL_MS,
+    .pause_ms = PROFILE_DEFAULT_PAUSE_MS,
+};
+
+static bool motion_profile_valid(const motion_profile_t* p) {
+    return p->shape < MOTION_SHAPE_MAX &&
+           p->travel_deg >= 1 && p->travel_deg <= SERVO_MAX_ANGLE_DEG &&
+           p->vmax_dps > 0 && p->accel_dps2 > 0;
+}
+
+// A ramp reaching speed v covers v*t/2 for both ramp shapes; the sinusoidal one
+// peaks at pi/2 times the mean acceleration, so it needs a longer ramp to stay
+// within accel_dps2. If the travel is too short to reach vmax the stroke becomes
+// two ramps meeting at a lower peak speed.
+static void motion_plan_compute(const motion_profile_t* p, motion_plan_t* m) {
+    m->shape = p->shape;
+    m->travel_deg = p->travel_deg;
+    m->vpeak_dps = p->vmax_dps;
+    m->ramp_s = 0.0f;
+    m->ramp_deg = 0.0f;
+    if (p->shape != MOTION_SHAPE_LINEAR) {
+        float k = p->shape == MOTION_SHAPE_SCURVE ? (float)M_PI / 2.0f : 1.0f;
+        float a = p->accel_dps2;
+        m->ramp_s = k * m->vpeak_dps / a;
+        m->ramp_deg = m->vpeak_dps * m->ramp_s / 2.0f;
+        if (2.0f * m->ramp_deg > m->travel_deg) {
+            m->vpeak_dps = sqrtf(a * m->travel_deg / k);
+            m->ramp_s = k * m->vpeak_dps / a;
+            m->ramp_deg = m->travel_deg / 2.0f;
+        }
+    }
+    float move_s = 2.0f * m->ramp_s + (m->travel_deg - 2.0f * m->ramp_deg) / m->vpeak_dps;
+    m->move_us = (int64_t)(move_s * 1e6f);
+    m->dwell_us = (int64_t)p->dwell_ms * 1000;
+    m->pause_us = (int64_t)p->pause_ms * 1000;
+}
+
+// Distance covered t seconds into an acceleration ramp.
+static float motion_ramp_deg(const motion_plan_t* m, float t) {
+    if (m->shape == MOTION_SHAPE_SCURVE) {
+        return m->vpeak_dps * (t / 2.0f - m->ramp_s / (2.0f * (float)M_PI) * sinf((float)M_PI * t / m->ramp_s));
+    }
+    return 0.5f * m->vpeak_dps / m->ramp_s * t * t;
+}
+
+// Angle travelled t seconds into a stroke (0 <= t < move).
+static float motion_plan_position(const motion_plan_t* m, float t) {
+    float move_s = m->move_us * 1e-6f;
+    if (m->shape == MOTION_SHAPE_LINEAR) return m->vpeak_dps * t;
+    if (t < m->ramp_s) return motion_ramp_deg(m, t);
+    if (move_s - t < m->ramp_s) return m->travel_deg - motion_ramp_deg(m, move_s - t);
+    return m->ramp_deg + m->vpeak_dps * (t - m->ramp_s);
+}
+
+static void motion_profile_apply(int channel, const motion_profile_t* p) {
+    motion_plan_t plan;
+    motion_plan_compute(p, &plan);
+    portENTER_CRITICAL(&motion_plan_lock);
+    motion_profiles[channel] = *p;
+    motion_plans[channel] = plan;
+    portEXIT_CRITICAL(&motion_plan_lock);
+}
+
+void motion_profiles_init(void) {
+    nvs_handle_t nvs;
+    bool have_nvs = nvs_open(MOTION_PROFILE_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK;
+    for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+        motion_profile_t p = motion_profile_default;
+        if (have_nvs) {
+            char key[8];
+            snprintf(key, sizeof(key), "prof%d", ch);
+            motion_profile_t stored;
+            size_t size = sizeof(stored);
+            if (nvs_get_blob(nvs, key, &stored, &size) == ESP_OK && size == sizeof(stored) &&
+                motion_profile_valid(&stored)) {
+                p = stored;
+            }
+        }
+        motion_profile_apply(ch, &p);
+    }
+    if (have_nvs) nvs_close(nvs);
+}
+
+// Set (p != NULL) or restore to the default (p == NULL) one channel's profile and
+// persist it. Returns false on a bad channel/profile or an NVS failure.
+bool motion_profile_set(int channel, const motion_profile_t* p) {
+    if (channel < 0 || channel >= DISPENSER_NUM_CHANNELS || (p && !motion_profile_valid(p))) return false;
+
+    char key[8];
+    snprintf(key, sizeof(key), "prof%d", channel);
+    nvs_handle_t nvs;
+    if (nvs_open(MOTION_PROFILE_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return false;
+
+    esp_err_t err;
+    if (!p) {
+        err = nvs_erase_key(nvs, key);
+        if (err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+        p = &motion_profile_default;
+    } else {
+        err = nvs_set_blob(nvs, key, p, sizeof(*p));
+    }
+    if (err == ESP_OK) err = nvs_commit(nvs);
+    nvs_close(nvs);
+
+    motion_profile_apply(channel, p);
+    return err == ESP_OK;
+}
+
+// What the host should expect of an order run on its own: the nominal duration
+// (each channel's pills back to back, MAX_ACTIVE_CHANNELS strokes at a time) and
+// the longest wait for the next pill to be counted (a sensed channel's worst pill
+// takes DROP_MAX_RETRIES extra strokes). Longer than that without a progress event
+// means the run is stuck, not slow.
+void motion_estimate(const int counts[DISPENSER_NUM_CHANNELS], uint32_t* eta_ms, uint32_t* gap_ms) {
+    int64_t total_us = 0, longest_us = 0, gap_us = 0;
+    portENTER_CRITICAL(&motion_plan_lock);
+    for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+        if (counts[ch] <= 0) continue;
+        const motion_plan_t* m = &motion_plans[ch];
+        int64_t cycle_us = 2 * m->move_us + m->dwell_us + m->pause_us + (int64_t)SERVO_START_STAGGER_MS * 1000;
+        int64_t channel_us = cycle_us * counts[ch];
+        int64_t worst_us = drop_sensor_pins[ch] < 0 ? cycle_us : cycle_us * (1 + DROP_MAX_RETRIES);
+        total_us += channel_us;
+        if (channel_us > longest_us) longest_us = channel_us;
+        if (worst_us > gap_us) gap_us = worst_us;
+    }
+    portEXIT_CRITICAL(&motion_plan_lock);
+    total_us /= MAX_ACTIVE_CHANNELS;
+    *eta_ms = (uint32_t)((total_us > longest_us ? total_us : longest_us) / 1000);
+    *gap_ms = (uint32_t)(gap_us / 1000);
+}
+
+// Motion generator: one esp_timer fires once per servo PWM period and recomputes
+// every active channel's angle from elapsed time, so sweep timing does not depend
+// on the FreeRTOS tick and the calling task just blocks on a notification. Both
+// timer callbacks below only ever run on the esp_timer task, one at a time, so
+// they share the servos without a lock.
+static esp_timer_handle_t motion_timer;
+static esp_timer_handle_t servo_detach_timer; // one-shot: detaches channels left idle after an order
+static TaskHandle_t motion_waiter;
+// Notification bits for motion_waiter.
+#define MOTION_NOTIFY_DONE     (1u << 0) // every channel idle, order finished
+#define MOTION_NOTIFY_PROGRESS (1u << 1) // a pill started or finished: journal it
+#define MOTION_NOTIFY_CANCELLED (1u << 2) // with DONE: stopped by motion_cancel()
+static int motion_active;
+static bool motion_periodic; // motion_timer is past its first, one-shot tick
+static int motion_next_start;
+static bool motion_longest_first; // per run, see motion_pick_channel()
+// Bit n: channel n is idle with nothing left to do in this run, so its dispensed
+// count is final. Published at the end of every tick, after the counts.
+static atomic_uint motion_settled;
+volatile cycle_mode_t cycle_mode = CYCLE_MODE_DEFAULT;
+static servo_phase_t motion_release_phase; // first phase that no longer holds a slot, per command
+static int64_t motion_last_start_us; // last stroke start on any channel, for the stagger
+
+// Cancel generation: every order is stamped with it when queued, and the running
+// one stops as soon as it moves on. Bumped only by uart_task (motion_cancel()).
+atomic_uint motion_cancel_gen;
+static unsigned motion_gen; // generation of the running order
+
+static int64_t servo_phase_us(const servo_t* s)
+{
+    switch (s->phase) {
+    case SERVO_PHASE_OUTBOUND:
+    case SERVO_PHASE_RETURN:
+        return s->plan.move_us;
+    case SERVO_PHASE_DWELL:
+        return s->plan.dwell_us;
+    case SERVO_PHASE_PAUSE:
+        return s->plan.pause_us;
+    default:
+        return 0;
+    }
+}
+
+// Returns 1 when the servo has finished the current phase at time now_us.
+static int servo_motion_update(servo_t* s, int64_t now_us)
+{
+    int64_t elapsed = now_us - s->phase_start_us;
+    int travel = (int)(s->plan.travel_deg * SERVO_ANGLE_STEPS_PER_DEG + 0.5f);
+
+    if (s->phase == SERVO_PHASE_DWELL || s->phase == SERVO_PHASE_PAUSE) {
+        return elapsed >= servo_phase_us(s);
+    }
+    if (elapsed >= s->plan.move_us) {
+        servo_write_angle(s, s->phase == SERVO_PHASE_OUTBOUND ? travel : 0);
+        return 1;
+    }
+
+    int angle = (int)(motion_plan_position(&s->plan, elapsed * 1e-6f) * SERVO_ANGLE_STEPS_PER_DEG + 0.5f);
+    if (angle > travel) angle = travel;
+    servo_write_angle(s, s->phase == SERVO_PHASE_OUTBOUND ? angle : travel - angle);
+    return 0;
+}
+
+// Power management, on the esp_timer task like the motion generator: a channel
+// idle since idle_since_us loses its pulses SERVO_DETACH_MS later.
+static void servo_idle_update(servo_t* s, int64_t now_us)
+{
+    if (s->attached && now_us - s->idle_since_us >= (int64_t)SERVO_DETACH_MS * 1000) servo_detach(s);
+}
+
+static void servo_detach_timer_cb(void* arg)
+{
+    int64_t now_us = esp_timer_get_time();
+    for (int idx = 0; idx < DISPENSER_NUM_CHANNELS; idx++) {
+        if (servos[idx].phase == SERVO_PHASE_IDLE) servo_idle_update(&servos[idx], now_us);
+    }
+}
+
+// Once the motion timer stops, nothing else would detach the channels that are
+// still counting down.
+static void servo_detach_timer_arm(void)
+{
+    esp_timer_stop(servo_detach_timer);
+    esp_timer_start_once(servo_detach_timer, (uint64_t)SERVO_DETACH_MS * 1000);
+}
+
+// Calibration jog: put one servo at a raw pulse width so the host can find the
+// ends of its working range. It detaches SERVO_DETACH_MS later like any idle
+// servo, which leaves the horn where it went. uart_task only, with no order
+// queued or running.
+bool servo_pulse_test(int channel, uint16_t pulse_us)
+{
+    if (channel < 0 || channel >= DISPENSER_NUM_CHANNELS || !servo_detach_timer ||
+        pulse_us < SERVO_CAL_PULSE_MIN_US || pulse_us > SERVO_CAL_PULSE_MAX_US) {
+        return false;
+    }
+    servo_t* s = &servos[channel];
+    ledc_set_duty(s->mode, s->channel, pulse_to_duty(pulse_us));
+    ledc_update_duty(s->mode, s->channel);
+    s->attached = true;
+    s->idle_since_us = esp_timer_get_time();
+    servo_detach_timer_arm();
+    return true;
+}
+
+static void IRAM_ATTR drop_sensor_isr(void* arg)
+{
+    drop_seen[(int)(intptr_t)arg] = 1;
+}
+
+// The pill is out: cut the rest of the cycle short. Mid-stroke the servo turns
+// back from where it is (re-planned over the shortened travel); a drop during
+// dwell starts the return now, and one during the pause ends it.
+static void servo_drop_detected(servo_t* s, int64_t now_us)
+{
+    switch (s->phase) {
+    case SERVO_PHASE_OUTBOUND: {
+        float t = (now_us - s->phase_start_us) * 1e-6f;
+        motion_profile_t shortened = s->profile;
+        int angle = (int)(motion_plan_position(&s->plan, t) + 0.5f);
+        shortened.travel_deg = (uint8_t)(angle < 1 ? 1 : angle);
+        motion_plan_compute(&shortened, &s->plan);
+        s->phase = SERVO_PHASE_RETURN;
+        s->phase_start_us = now_us;
+        break;
+    }
+    case SERVO_PHASE_DWELL:
+        s->phase = SERVO_PHASE_RETURN;
+        s->phase_start_us = now_us;
+        break;
+    case SERVO_PHASE_PAUSE:
+        s->phase_start_us = now_us - s->plan.pause_us;
+        break;
+    default:
+        break;
+    }
+}
+
+// End of one cycle (stroke, return, pause): count the pill, or retry it if the
+// sensor never saw it.
+static void servo_cycle_finished(servo_t* s, int idx)
+{
+    stats_hist_record(&stats.cycle, s->phase_start_us - s->cycle_start_us);
+    if (drop_sensor_pins[idx] < 0 || s->dropped) {
+        s->dispensed++;
+        s->retries = 0;
+    } else if (s->retries < DROP_MAX_RETRIES) {
+        s->retries++;
+        s->remaining++;
+    } else {
+        s->remaining = 0;
+    }
+}
+
+// Cancelled or e-stopped: every servo that is mid-cycle is commanded straight to
+// SERVO_SAFE_ANGLE_DEG on this tick, so the stop lands within one servo period of
+// the request. The pill in flight is not counted; the ones already out are.
+static void motion_halt(int64_t now_us)
+{
+    for (int idx = 0; idx < DISPENSER_NUM_CHANNELS; idx++) {
+        servo_t* s = &servos[idx];
+        if (s->phase != SERVO_PHASE_IDLE) {
+            servo_write_angle(s, SERVO_SAFE_ANGLE_DEG * SERVO_ANGLE_STEPS_PER_DEG);
+            s->idle_since_us = now_us;
+        }
+        s->phase = SERVO_PHASE_IDLE;
+        s->remaining = 0;
+        s->holds_slot = false;
+    }
+    motion_active = 0;
+}
+
+// Next channel to start, -1 if none is waiting. Round-robin from motion_next_start,
+// so a small cap cannot starve the last channel; in a coalesced run the channel
+// with the most pills left goes first instead, since the longest channel bounds
+// how long the whole run takes.
+static int motion_pick_channel(void)
+{
+    int best = -1;
+    for (int n = 0; n < DISPENSER_NUM_CHANNELS; n++) {
+        int idx = (motion_next_start + n) % DISPENSER_NUM_CHANNELS;
+        const servo_t* s = &servos[idx];
+        if (s->phase != SERVO_PHASE_IDLE || s->remaining <= 0) continue;
+        if (best < 0) {
+            best = idx;
+            if (!motion_longest_first) break;
+        } else if (s->remaining > servos[best].remaining) {
+            best = idx;
+        }
+    }
+    return best;
+}
+
+static void motion_timer_cb(void* arg)
+{
+    int64_t now_us = esp_timer_get_time();
+    int busy = 0;
+    uint32_t notify = 0;
+
+    if (atomic_load_explicit(&motion_cancel_gen, memory_order_relaxed) != motion_gen) {
+        motion_halt(now_us);
+        esp_timer_stop(motion_timer);
+        servo_detach_timer_arm();
+        xTaskNotify(motion_waiter, MOTION_NOTIFY_DONE | MOTION_NOTIFY_CANCELLED, eSetBits);
+        return;
+    }
+
+    for (int idx = 0; idx < DISPENSER_NUM_CHANNELS; idx++) {
+        servo_t* s = &servos[idx];
+        if (s->phase == SERVO_PHASE_IDLE) {
+            servo_idle_update(s, now_us);
+            if (s->remaining > 0) busy = 1; // waiting for a slot or the stagger
+            continue;
+        }
+        if (drop_sensor_pins[idx] >= 0 && !s->dropped && drop_seen[idx]) {
+            s->dropped = true;
+            servo_drop_detected(s, now_us);
+        }
+        while (s->phase != SERVO_PHASE_IDLE && servo_motion_update(s, now_us)) {
+            // Chain the next phase from the ideal boundary, not from this tick, so
+            // latency of one timer period never accumulates across sweeps; a short
+            // or zero-length dwell/pause falls through in the same tick.
+            s->phase_start_us += servo_phase_us(s);
+            if (s->phase == SERVO_PHASE_OUTBOUND) {
+                s->phase = SERVO_PHASE_DWELL;
+            } else if (s->phase == SERVO_PHASE_DWELL) {
+                s->phase = SERVO_PHASE_RETURN;
+            } else if (s->phase == SERVO_PHASE_RETURN) {
+                s->phase = SERVO_PHASE_PAUSE;
+            } else {
+                // Counted before the phase goes idle: a reader that sees it idle
+                // (motion_journal_progress) then also sees the count.
+                servo_cycle_finished(s, idx);
+                atomic_thread_fence(memory_order_release);
+                s->phase = SERVO_PHASE_IDLE;
+                s->idle_since_us = s->phase_start_us;
+                notify |= MOTION_NOTIFY_PROGRESS;
+            }
+        }
+        if (s->holds_slot && (s->phase == SERVO_PHASE_IDLE || s->phase >= motion_release_phase)) {
+            s->holds_slot = false;
+            motion_active--;
+        }
+        if (s->phase != SERVO_PHASE_IDLE) busy = 1;
+    }
+
+    // Admit waiting channels, at most one per SERVO_START_STAGGER_MS so no two servos
+    // draw their start-up inrush together (the slot cap alone would start them on
+    // the same tick).
+    while (motion_active < MAX_ACTIVE_CHANNELS &&
+           now_us - motion_last_start_us >= (int64_t)SERVO_START_STAGGER_MS * 1000) {
+        int idx = motion_pick_channel();
+        if (idx < 0) break;
+        servo_t* s = &servos[idx];
+        portENTER_CRITICAL(&motion_plan_lock);
+        s->profile = motion_profiles[idx];
+        s->plan = motion_plans[idx];
+        portEXIT_CRITICAL(&motion_plan_lock);
+        s->dropped = false;
+        drop_seen[idx] = 0;
+        s->phase = SERVO_PHASE_OUTBOUND;
+        s->phase_start_us = now_us;
+        s->cycle_start_us = now_us;
+        s->remaining--;
+        s->holds_slot = true;
+        motion_active++;
+        motion_last_start_us = now_us;
+        busy = 1;
+        notify |= MOTION_NOTIFY_PROGRESS;
+    }
+    motion_next_start = (motion_next_start + 1) % DISPENSER_NUM_CHANNELS;
+
+    uint32_t settled = 0;
+    for (int idx = 0; idx < DISPENSER_NUM_CHANNELS; idx++) {
+        if (servos[idx].phase == SERVO_PHASE_IDLE && servos[idx].remaining <= 0) settled |= 1u << idx;
+    }
+    atomic_store_explicit(&motion_settled, settled, memory_order_release);
+
+    if (!busy) {
+        esp_timer_stop(motion_timer);
+        servo_detach_timer_arm();
+        notify |= MOTION_NOTIFY_DONE;
+    } else if (!motion_periodic) {
+        motion_periodic = true;
+        esp_timer_start_periodic(motion_timer, SERVO_PERIOD_US);
+    }
+    if (notify) xTaskNotify(motion_waiter, notify, eSetBits);
+}
+
+void motion_init(void)
+{
+    // Configure LEDC for servos: one 50 Hz timer per speed group in use.
+    const ledc_mode_t groups[] = {LEDC_HIGH_SPEED_MODE, LEDC_LOW_SPEED_MODE};
+    for (int g = 0; g * LEDC_GROUP_CHANNELS < DISPENSER_NUM_CHANNELS; g++) {
+        ledc_timer_config_t ledc_timer = {
+            .speed_mode = groups[g],
+            .duty_resolution = SERVO_RESOLUTION,
+            .timer_num = LEDC_TIMER_0,
+            .freq_hz = SERVO_FREQ,
+            .clk_cfg = LEDC_AUTO_CLK
+        };
+        ledc_timer_config(&ledc_timer);
+    }
+
+    // Attach servos to channels. Every servo is driven home at boot, then detached
+    // like any idle channel.
+    int64_t now_us = esp_timer_get_time();
+    for (int i = 0; i < DISPENSER_NUM_CHANNELS; i++) {
+        servos[i].mode = groups[i / LEDC_GROUP_CHANNELS];
+        servos[i].channel = (ledc_channel_t)(i % LEDC_GROUP_CHANNELS);
+        servos[i].lut = servo_lut[i];
+        ledc_channel_config_t ledc_channel = {
+            .channel = servos[i].channel,
+            .duty = servo_lut[i][0],
+            .gpio_num = servo_pins[i],
+            .speed_mode = servos[i].mode,
+            .hpoint = 0,
+            .timer_sel = LEDC_TIMER_0
+        };
+        ledc_channel_config(&ledc_channel);
+        servos[i].attached = true;
+        servos[i].idle_since_us = now_us;
+    }
+
+    const esp_timer_create_args_t args = {
+        .callback = motion_timer_cb,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "motion",
+    };
+    esp_timer_create(&args, &motion_timer);
+    const esp_timer_create_args_t detach_args = {
+        .callback = servo_detach_timer_cb,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "servo_detach",
+    };
+    esp_timer_create(&detach_args, &servo_detach_timer);
+    servo_detach_timer_arm();
+
+    gpio_install_isr_service(0);
+    for (int idx = 0; idx < DISPENSER_NUM_CHANNELS; idx++) {
+        if (drop_sensor_pins[idx] < 0) continue;
+        gpio_config_t io = {
+            .pin_bit_mask = 1ULL << drop_sensor_pins[idx],
+            .mode = GPIO_MODE_INPUT,
+            .pull_up_en = GPIO_PULLUP_DISABLE, // none on 34-39: the sensor needs an external one
+            .pull_down_en = GPIO_PULLDOWN_DISABLE,
+            .intr_type = GPIO_INTR_NEGEDGE,
+        };
+        gpio_config(&io);
+        gpio_isr_handler_add(drop_sensor_pins[idx], drop_sensor_isr, (void*)(intptr_t)idx);
+    }
+}
+
+// Progress as the journal should see it. Phases are read before the counts: a pill
+// finishing in between then shows up as counted and still in flight, never as
+// neither.
+static void motion_journal_progress(void)
+{
+    int dispensed[DISPENSER_NUM_CHANNELS];
+    uint16_t in_flight = 0;
+    for (int idx = 0; idx < DISPENSER_NUM_CHANNELS; idx++) {
+        if (servos[idx].phase != SERVO_PHASE_IDLE) in_flight |= (uint16_t)(1u << idx);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    for (int idx = 0; idx < DISPENSER_NUM_CHANNELS; idx++) {
+        dispensed[idx] = servos[idx].dispensed;
+    }
+    journal_progress(dispensed, in_flight);
+}
+
+// Counts whose dispensed value is final (settled channels) are read after the mask.
+static void motion_report_progress(const motion_run_t* run)
+{
+    int dispensed[DISPENSER_NUM_CHANNELS];
+    uint16_t settled = (uint16_t)atomic_load_explicit(&motion_settled, memory_order_acquire);
+    for (int idx = 0; idx < DISPENSER_NUM_CHANNELS; idx++) {
+        dispensed[idx] = servos[idx].dispensed;
+    }
+    run->on_progress(run->ctx, dispensed, settled);
+}
+
+void motion_cancel(void)
+{
+    atomic_fetch_add_explicit(&motion_cancel_gen, 1, memory_order_relaxed);
+}
+
+// Runs one order (or several coalesced ones): run->counts[idx] pills per channel,
+// up to MAX_ACTIVE_CHANNELS servos at once, blocking the calling task without
+// spinning until every sweep has settled. dispensed[] gets what each channel
+// actually delivered. Returns false if a newer cancel generation than
+// run->cancel_gen turned up first. on_progress and the journal writes (at most one
+// per JOURNAL_MIN_INTERVAL_MS) run here, in the calling task; the timer derives
+// every angle from elapsed time, so a flash stall never shifts a sweep.
+bool execute_channel_counts(const motion_run_t* run, int dispensed[DISPENSER_NUM_CHANNELS]) {
+    int pending = 0;
+    for (int idx = 0; idx < DISPENSER_NUM_CHANNELS; idx++) {
+        servos[idx].remaining = run->counts[idx] > 0 ? run->counts[idx] : 0;
+        servos[idx].phase = SERVO_PHASE_IDLE;
+        servos[idx].holds_slot = false;
+        servos[idx].retries = 0;
+        servos[idx].dispensed = 0;
+        dispensed[idx] = 0;
+        pending += servos[idx].remaining;
+    }
+    if (pending == 0) return true;
+
+    motion_gen = run->cancel_gen;
+    motion_longest_first = run->longest_first;
+    motion_active = 0;
+    motion_next_start = 0;
+    atomic_store_explicit(&motion_settled, 0, memory_order_relaxed);
+    motion_release_phase = cycle_mode == CYCLE_MODE_PIPELINED ? SERVO_PHASE_RETURN : SERVO_PHASE_PAUSE;
+    motion_waiter = xTaskGetCurrentTaskHandle();
+    xTaskNotifyWait(0, UINT32_MAX, NULL, 0);
+
+    // The first tick starts the sweeps now rather than one period late, and goes
+    // periodic unless the order is already over.
+    motion_periodic = false;
+    esp_timer_start_once(motion_timer, 0);
+
+    TickType_t next_write = xTaskGetTickCount();
+    bool dirty = false;
+    bool cancelled = false;
+    while (1) {
+        TickType_t wait = portMAX_DELAY;
+        if (dirty) {
+            TickType_t now = xTaskGetTickCount();
+            wait = (int32_t)(next_write - now) > 0 ? next_write - now : 0;
+        }
+        uint32_t bits = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &bits, wait);
+        if (bits & MOTION_NOTIFY_DONE) {
+            cancelled = (bits & MOTION_NOTIFY_CANCELLED) != 0;
+            break;
+        }
+        if (bits & MOTION_NOTIFY_PROGRESS) {
+            dirty = true;
+            if (run->on_progress) motion_report_progress(run);
+        }
+        TickType_t now = xTaskGetTickCount();
+        if (dirty && (int32_t)(now - next_write) >= 0) {
+            motion_journal_progress();
+            next_write = now + pdMS_TO_TICKS(JOURNAL_MIN_INTERVAL_MS);
+            dirty = false;
+        }
+    }
+
+    for (int idx = 0; idx < DISPENSER_NUM_CHANNELS; idx++) {
+        dispensed[idx] = servos[idx].dispensed;
+    }
+    return !cancelled;
+}
@@ -0,0 +1,409 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_app_desc.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+#if DISPENSER_OTA_WIFI
+#include "esp_crt_bundle.h"
+#include "esp_event.h"
+#include "esp_http_client.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
+#include "freertos/event_groups.h"
+#endif
+#include "dispenser_internal.h"
+
+// Firmware update into the inactive half of the A/B (ota_0/ota_1) partition
+// table. An image arrives in order, in chunks (over UART, or pulled over Wi-Fi
+// when built with DISPENSER_OTA_WIFI), is buffered into whole flash sectors,
+// CRC32-checked against what the sender announced, authenticated against the
+// sender's HMAC tag (OTA_AUTH_KEY), validated by esp_ota_end and only then made
+// the boot partition: the running image stays untouched until the switch, so an
+// aborted, corrupt or forged update costs nothing but the time.
+//
+// Rollback: the bootloader starts a new image as "pending verify". It is kept
+// once the host is heard from (any valid frame or line, see ota_app_confirm); a
+// crash or watchdog reset before that, or OTA_CONFIRM_TIMEOUT_MS of silence,
+// boots the previous image again.
+static const char* TAG = "ota";
+
+const char* const ota_err_names[OTA_ERR_MAX] = {
+    [OTA_OK] = "ok",
+    [OTA_ERR_BUSY] = "busy",
+    [OTA_ERR_NOT_STARTED] = "not_started",
+    [OTA_ERR_NO_PARTITION] = "no_partition",
+    [OTA_ERR_SIZE] = "size",
+    [OTA_ERR_OFFSET] = "offset",
+    [OTA_ERR_FLASH] = "flash",
+    [OTA_ERR_CRC] = "crc",
+    [OTA_ERR_IMAGE] = "image",
+    [OTA_ERR_NETWORK] = "network",
+    [OTA_ERR_TIMEOUT] = "timeout",
+    [OTA_ERR_AUTH] = "auth",
+    [OTA_ERR_NO_KEY] = "no_key",
+};
+
+static SemaphoreHandle_t ota_lock;
+static StaticSemaphore_t ota_lock_struct;
+
+// The update in progress (under ota_lock).
+static ota_source_t ota_owner = OTA_SRC_NONE;
+static esp_ota_handle_t ota_handle;
+static const esp_partition_t* ota_target;
+static uint32_t ota_size;     // announced image size
+static uint32_t ota_crc;      // announced CRC32 of the whole image
+static uint32_t ota_crc_acc;  // CRC32 of the bytes accepted so far
+static uint32_t ota_received; // bytes accepted (buffered or written)
+static int64_t ota_last_us;   // last chunk, for OTA_IDLE_TIMEOUT_MS
+static uint8_t ota_buf[OTA_WRITE_BUF_SIZE];
+static size_t ota_buf_len;
+static mbedtls_sha256_context ota_mac; // SHA-256((key ^ ipad) || bytes accepted so far)
+
+static uint8_t ota_key[OTA_AUTH_KEY_LEN]; // OTA_AUTH_KEY, parsed by ota_init
+static bool ota_key_set;
+
+static volatile bool ota_pending_verify;
+static esp_timer_handle_t ota_confirm_timer;
+
+static void ota_confirm_timeout_cb(void* arg) {
+    if (!ota_pending_verify) return;
+    ESP_LOGE(TAG, "new image never reached the host, rolling back");
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+}
+
+static bool ota_hex_decode(const char* hex, uint8_t* out, size_t len) {
+    if (strlen(hex) != 2 * len) return false;
+    for (size_t i = 0; i < 2 * len; i++) {
+        char c = hex[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (v < 0) return false;
+        out[i / 2] = (uint8_t)(i % 2 ? out[i / 2] | v : v << 4);
+    }
+    return true;
+}
+
+// HMAC-SHA256 (RFC 2104) by hand around one static SHA-256 context, so the image
+// can be hashed chunk by chunk without the heap mbedtls_md would use.
+static void ota_mac_pad(mbedtls_sha256_context* ctx, uint8_t pad) {
+    uint8_t block[64];
+    memset(block, pad, sizeof(block));
+    for (size_t i = 0; i < OTA_AUTH_KEY_LEN; i++) block[i] ^= ota_key[i];
+    mbedtls_sha256_starts(ctx, 0);
+    mbedtls_sha256_update(ctx, block, sizeof(block));
+}
+
+static bool ota_mac_verify_locked(const uint8_t tag[OTA_AUTH_TAG_LEN]) {
+    uint8_t mac[32];
+    mbedtls_sha256_finish(&ota_mac, mac);
+    mbedtls_sha256_context outer;
+    mbedtls_sha256_init(&outer);
+    ota_mac_pad(&outer, 0x5c);
+    mbedtls_sha256_update(&outer, mac, sizeof(mac));
+    mbedtls_sha256_finish(&outer, mac);
+    mbedtls_sha256_free(&outer);
+    uint8_t diff = 0; // constant time: no hint how much of a guessed tag was right
+    for (size_t i = 0; i < sizeof(mac); i++) diff |= mac[i] ^ tag[i];
+    return diff == 0;
+}
+
+void ota_init(void) {
+    ota_lock = xSemaphoreCreateMutexStatic(&ota_lock_struct);
+    ota_key_set = ota_hex_decode(OTA_AUTH_KEY, ota_key, sizeof(ota_key));
+    if (!ota_key_set && OTA_AUTH_KEY[0]) {
+        ESP_LOGE(TAG, "DISPENSER_OTA_KEY is not 64 hex digits, updates are refused");
+    } else if (!ota_key_set) {
+        ESP_LOGW(TAG, "built without DISPENSER_OTA_KEY, updates are refused");
+    }
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    esp_ota_img_states_t state;
+    if (running && esp_ota_get_state_partition(running, &state) == ESP_OK &&
+        state == ESP_OTA_IMG_PENDING_VERIFY) {
+        ota_pending_verify = true;
+        const esp_timer_create_args_t args = {
+            .callback = ota_confirm_timeout_cb,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "ota_confirm",
+        };
+        esp_timer_create(&args, &ota_confirm_timer);
+        esp_timer_start_once(ota_confirm_timer, (uint64_t)OTA_CONFIRM_TIMEOUT_MS * 1000);
+        ESP_LOGW(TAG, "running %s on trial", running->label);
+    }
+}
+
+void ota_app_confirm(void) {
+    if (!ota_pending_verify) return;
+    ota_pending_verify = false;
+    esp_timer_stop(ota_confirm_timer);
+    esp_ota_mark_app_valid_cancel_rollback();
+    ESP_LOGI(TAG, "image confirmed");
+}
+
+static void ota_reset_locked(void) {
+    if (ota_owner != OTA_SRC_NONE) {
+        esp_ota_abort(ota_handle);
+        mbedtls_sha256_free(&ota_mac);
+    }
+    ota_owner = OTA_SRC_NONE;
+    ota_buf_len = 0;
+}
+
+static ota_err_t ota_fail_locked(ota_err_t err) {
+    ESP_LOGW(TAG, "update failed at %u of %u: %s", (unsigned)ota_received, (unsigned)ota_size, ota_err_names[err]);
+    ota_reset_locked();
+    return err;
+}
+
+static bool ota_flush_locked(void) {
+    if (ota_buf_len == 0) return true;
+    bool ok = esp_ota_write(ota_handle, ota_buf, ota_buf_len) == ESP_OK;
+    ota_buf_len = 0;
+    return ok;
+}
+
+// An update nobody has fed for OTA_IDLE_TIMEOUT_MS is dropped, so a host that
+// vanished mid-transfer cannot keep orders locked out.
+bool ota_in_progress(void) {
+    xSemaphoreTake(ota_lock, portMAX_DELAY);
+    if (ota_owner != OTA_SRC_NONE && esp_timer_get_time() - ota_last_us > (int64_t)OTA_IDLE_TIMEOUT_MS * 1000) {
+        ota_fail_locked(OTA_ERR_TIMEOUT);
+    }
+    bool active = ota_owner != OTA_SRC_NONE;
+    xSemaphoreGive(ota_lock);
+    return active;
+}
+
+// Erases nothing up front: each sector is erased when its first buffer is flushed
+// (OTA_WITH_SEQUENTIAL_WRITES), so no single call blocks the caller, uart_task
+// included, for longer than one sector erase and write.
+ota_err_t ota_begin(ota_source_t src, uint32_t size, uint32_t crc32) {
+    xSemaphoreTake(ota_lock, portMAX_DELAY);
+    ota_err_t err = OTA_OK;
+    if (!ota_key_set) {
+        err = OTA_ERR_NO_KEY;
+    } else if (ota_owner != OTA_SRC_NONE && ota_owner != src) {
+        err = OTA_ERR_BUSY;
+    } else {
+        ota_reset_locked(); // the same source starting over
+        ota_target = esp_ota_get_next_update_partition(NULL);
+        if (!ota_target) {
+            err = OTA_ERR_NO_PARTITION;
+        } else if (size == 0 || size > ota_target->size) {
+            err = OTA_ERR_SIZE;
+        } else if (esp_ota_begin(ota_target, OTA_WITH_SEQUENTIAL_WRITES, &ota_handle) != ESP_OK) {
+            err = OTA_ERR_FLASH;
+        } else {
+            mbedtls_sha256_init(&ota_mac);
+            ota_mac_pad(&ota_mac, 0x36);
+            ota_owner = src;
+            ota_size = size;
+            ota_crc = crc32;
+            ota_crc_acc = 0;
+            ota_received = 0;
+            ota_last_us = esp_timer_get_time();
+            ESP_LOGI(TAG, "update: %u bytes into %s", (unsigned)size, ota_target->label);
+        }
+    }
+    xSemaphoreGive(ota_lock);
+    return err;
+}
+
+// Chunks must arrive in order. A repeat of bytes already taken (a retransmission
+// whose first ACK was lost) is accepted and ignored; a gap is refused, and
+// ota_offset() tells the sender where to resume.
+ota_err_t ota_write(ota_source_t src, uint32_t offset, const uint8_t* data, size_t len) {
+    xSemaphoreTake(ota_lock, portMAX_DELAY);
+    ota_err_t err = OTA_OK;
+    if (ota_owner != src) {
+        err = OTA_ERR_NOT_STARTED;
+    } else if (offset + len <= ota_received) {
+        ota_last_us = esp_timer_get_time();
+    } else if (offset != ota_received) {
+        err = OTA_ERR_OFFSET;
+    } else if (ota_received + len > ota_size) {
+        err = ota_fail_locked(OTA_ERR_SIZE);
+    } else {
+        ota_crc_acc = esp_rom_crc32_le(ota_crc_acc, data, (uint32_t)len);
+        mbedtls_sha256_update(&ota_mac, data, len);
+        ota_received += (uint32_t)len;
+        ota_last_us = esp_timer_get_time();
+        while (len > 0 && err == OTA_OK) {
+            size_t n = sizeof(ota_buf) - ota_buf_len;
+            if (n > len) n = len;
+            memcpy(&ota_buf[ota_buf_len], data, n);
+            ota_buf_len += n;
+            data += n;
+            len -= n;
+            if (ota_buf_len == sizeof(ota_buf) && !ota_flush_locked()) err = ota_fail_locked(OTA_ERR_FLASH);
+        }
+    }
+    xSemaphoreGive(ota_lock);
+    return err;
+}
+
+// Checks size, CRC and the sender's tag, lets esp_ota_end validate the image
+// (header, chip, SHA-256) and makes it the boot partition. The caller reboots into it.
+ota_err_t ota_finish(ota_source_t src, const uint8_t tag[OTA_AUTH_TAG_LEN]) {
+    xSemaphoreTake(ota_lock, portMAX_DELAY);
+    ota_err_t err = OTA_OK;
+    if (ota_owner != src) {
+        err = OTA_ERR_NOT_STARTED;
+    } else if (ota_received != ota_size) {
+        err = ota_fail_locked(OTA_ERR_SIZE);
+    } else if (ota_crc_acc != ota_crc) {
+        err = ota_fail_locked(OTA_ERR_CRC);
+    } else if (!ota_mac_verify_locked(tag)) {
+        err = ota_fail_locked(OTA_ERR_AUTH);
+    } else if (!ota_flush_locked()) {
+        err = ota_fail_locked(OTA_ERR_FLASH);
+    } else {
+        ota_owner = OTA_SRC_NONE; // esp_ota_end frees the handle whatever it returns
+        mbedtls_sha256_free(&ota_mac);
+        if (esp_ota_end(ota_handle) != ESP_OK) {
+            err = OTA_ERR_IMAGE;
+        } else if (esp_ota_set_boot_partition(ota_target) != ESP_OK) {
+            err = OTA_ERR_FLASH;
+        } else {
+            ESP_LOGI(TAG, "update complete, next boot from %s", ota_target->label);
+        }
+    }
+    xSemaphoreGive(ota_lock);
+    return err;
+}
+
+void ota_abort(ota_source_t src) {
+    xSemaphoreTake(ota_lock, portMAX_DELAY);
+    if (ota_owner == src) ota_reset_locked();
+    xSemaphoreGive(ota_lock);
+}
+
+uint32_t ota_offset(void) {
+    return ota_received;
+}
+
+const char* ota_state_name(void) {
+    if (ota_owner != OTA_SRC_NONE) return "updating";
+    return ota_pending_verify ? "pending_verify" : "valid";
+}
+
+const char* ota_running_label(void) {
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    return running ? running->label : "unknown";
+}
+
+const char* ota_app_version(void) {
+    return esp_app_get_description()->version;
+}
+
+#if DISPENSER_OTA_WIFI
+// Pull an image over HTTP(S) and feed it through the same path as UART chunks.
+// The Wi-Fi stack is only brought up for an update and lives on the heap (the
+// unit reboots into the new image afterwards, or stops Wi-Fi again on failure).
+#define OTA_WIFI_CONNECTED_BIT (1u << 0)
+
+static char ota_url[OTA_URL_MAX_LEN + 1];
+static uint32_t ota_url_size;
+static uint32_t ota_url_crc;
+static uint8_t ota_url_tag[OTA_AUTH_TAG_LEN];
+static EventGroupHandle_t ota_wifi_events;
+static StaticEventGroup_t ota_wifi_events_struct;
+static bool ota_wifi_ready;
+static volatile bool ota_wifi_busy; // a fetch is queued or running
+
+static void ota_wifi_event_cb(void* arg, esp_event_base_t base, int32_t id, void* data) {
+    if (base == WIFI_EVENT && id == WIFI_EVENT_STA_DISCONNECTED) {
+        xEventGroupClearBits(ota_wifi_events, OTA_WIFI_CONNECTED_BIT);
+        esp_wifi_connect();
+    } else if (base == IP_EVENT && id == IP_EVENT_STA_GOT_IP) {
+        xEventGroupSetBits(ota_wifi_events, OTA_WIFI_CONNECTED_BIT);
+    }
+}
+
+static bool ota_wifi_connect(void) {
+    if (!ota_wifi_ready) {
+        esp_netif_init();
+        esp_event_loop_create_default();
+        esp_netif_create_default_wifi_sta();
+        wifi_init_config_t init = WIFI_INIT_CONFIG_DEFAULT();
+        if (esp_wifi_init(&init) != ESP_OK) return false;
+        esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, ota_wifi_event_cb, NULL);
+        esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, ota_wifi_event_cb, NULL);
+        wifi_config_t cfg = {0};
+        // Fixed-size fields: a 32-character SSID fills ssid without a terminator.
+        strncpy((char*)cfg.sta.ssid, OTA_WIFI_SSID, sizeof(cfg.sta.ssid));
+        strncpy((char*)cfg.sta.password, OTA_WIFI_PASSWORD, sizeof(cfg.sta.password));
+        esp_wifi_set_mode(WIFI_MODE_STA);
+        esp_wifi_set_config(WIFI_IF_STA, &cfg);
+        ota_wifi_ready = true;
+    }
+    esp_wifi_start();
+    esp_wifi_connect();
+    return xEventGroupWaitBits(ota_wifi_events, OTA_WIFI_CONNECTED_BIT, pdFALSE, pdTRUE,
+                               pdMS_TO_TICKS(OTA_WIFI_CONNECT_MS)) & OTA_WIFI_CONNECTED_BIT;
+}
+
+static ota_err_t ota_wifi_fetch(void) {
+    if (!ota_wifi_connect()) return OTA_ERR_NETWORK;
+    if (cmd_pool_available() != CMD_POOL_SIZE) return OTA_ERR_BUSY; // an order came in meanwhile
+    ota_err_t err = ota_begin(OTA_SRC_WIFI, ota_url_size, ota_url_crc);
+    if (err != OTA_OK) return err;
+
+    esp_http_client_config_t http = {
+        .url = ota_url,
+        .timeout_ms = OTA_HTTP_TIMEOUT_MS,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&http);
+    if (!client || esp_http_client_open(client, 0) != ESP_OK || esp_http_client_fetch_headers(client) < 0 ||
+        esp_http_client_get_status_code(client) != 200) {
+        err = OTA_ERR_NETWORK;
+    }
+    static uint8_t chunk[1024];
+    uint32_t offset = 0;
+    while (err == OTA_OK) {
+        int n = esp_http_client_read(client, (char*)chunk, sizeof(chunk));
+        if (n < 0) err = OTA_ERR_NETWORK;
+        if (n <= 0) break;
+        err = ota_write(OTA_SRC_WIFI, offset, chunk, (size_t)n);
+        offset += (uint32_t)n;
+    }
+    if (client) esp_http_client_cleanup(client);
+    if (err == OTA_OK) err = ota_finish(OTA_SRC_WIFI, ota_url_tag);
+    if (err != OTA_OK) ota_abort(OTA_SRC_WIFI);
+    return err;
+}
+
+static void ota_task(void* arg) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        ota_err_t err = ota_wifi_fetch();
+        send_ota_reply("ota", -1, err);
+        if (err == OTA_OK) dispenser_reboot();
+        esp_wifi_stop();
+        ota_wifi_busy = false;
+    }
+}
+
+bool ota_wifi_start(const char* url, uint32_t size, uint32_t crc32, const char* hmac) {
+    if (!dispenser_tasks[TASK_OTA] || strlen(url) > OTA_URL_MAX_LEN || ota_wifi_busy || ota_in_progress() ||
+        !ota_hex_decode(hmac, ota_url_tag, sizeof(ota_url_tag))) {
+        return false;
+    }
+    ota_wifi_busy = true;
+    strncpy(ota_url, url, OTA_URL_MAX_LEN);
+    ota_url_size = size;
+    ota_url_crc = crc32;
+    xTaskNotifyGive(dispenser_tasks[TASK_OTA]);
+    return true;
+}
+
+void ota_wifi_init(void) {
+    ota_wifi_events = xEventGroupCreateStatic(&ota_wifi_events_struct);
+    DISPENSER_TASK_START(TASK_OTA, ota_task, OTA_TASK_STACK, OTA_TASK_PRIORITY, PROTOCOL_CORE);
+}
+#endif
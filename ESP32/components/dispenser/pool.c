@@ -0,0 +1,84 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "dispenser_internal.h"
+
+// Fixed memory plan: orders and parse trees come from static pools, so after boot
+// the protocol and motion paths never touch the heap.
+
+// Command pool. uart_task takes an object per accepted order and passes the
+// pointer through cmd_queue; motion_task returns it once the final ACK is out.
+// One more object than the queue holds covers the order that is running. The
+// free list is itself a queue, so taking and returning need no other lock.
+static dispense_cmd_t cmd_pool[CMD_POOL_SIZE];
+static QueueHandle_t cmd_free;
+static StaticQueue_t cmd_free_queue;
+static uint8_t cmd_free_storage[CMD_POOL_SIZE * sizeof(dispense_cmd_t*)];
+
+void cmd_pool_init(void) {
+    cmd_free = xQueueCreateStatic(CMD_POOL_SIZE, sizeof(dispense_cmd_t*), cmd_free_storage, &cmd_free_queue);
+    for (int i = 0; i < CMD_POOL_SIZE; i++) {
+        dispense_cmd_t* cmd = &cmd_pool[i];
+        xQueueSend(cmd_free, &cmd, 0);
+    }
+}
+
+dispense_cmd_t* cmd_pool_alloc(void) {
+    dispense_cmd_t* cmd = NULL;
+    return xQueueReceive(cmd_free, &cmd, 0) == pdTRUE ? cmd : NULL;
+}
+
+void cmd_pool_free(dispense_cmd_t* cmd) {
+    if (cmd) xQueueSend(cmd_free, &cmd, 0);
+}
+
+unsigned cmd_pool_available(void) {
+    return (unsigned)uxQueueMessagesWaiting(cmd_free);
+}
+
+// cJSON arena. Only uart_task parses JSON and every tree is freed before the next
+// line, so allocation is a pointer bump and cJSON's frees are no-ops; the caller
+// takes a mark before parsing and releases back to it after cJSON_Delete (marks
+// nest, so the JSON bench can parse while its control line's tree is alive). A
+// line whose tree does not fit fails to parse (bad_json) instead of growing the heap.
+static uint8_t json_arena[JSON_ARENA_SIZE] __attribute__((aligned(8)));
+static size_t json_arena_used;
+static size_t json_arena_peak;
+static uint32_t json_arena_allocs;
+
+static void* json_arena_malloc(size_t size) {
+    size_t need = (size + 7) & ~(size_t)7;
+    if (need > JSON_ARENA_SIZE - json_arena_used) {
+        stats_inc(&stats.json_oom, 1);
+        return NULL;
+    }
+    void* ptr = &json_arena[json_arena_used];
+    json_arena_used += need;
+    if (json_arena_used > json_arena_peak) json_arena_peak = json_arena_used;
+    json_arena_allocs++;
+    return ptr;
+}
+
+static void json_arena_free(void* ptr) {
+}
+
+void json_arena_init(void) {
+    cJSON_Hooks hooks = { .malloc_fn = json_arena_malloc, .free_fn = json_arena_free };
+    cJSON_InitHooks(&hooks);
+}
+
+size_t json_arena_mark(void) {
+    return json_arena_used;
+}
+
+void json_arena_release(size_t mark) {
+    json_arena_used = mark;
+}
+
+// Peak bytes in use and allocation count since the last call (for the JSON bench).
+void json_arena_take_usage(size_t* peak, uint32_t* allocs) {
+    *peak = json_arena_peak;
+    *allocs = json_arena_allocs;
+    json_arena_peak = json_arena_used;
+    json_arena_allocs = 0;
+}
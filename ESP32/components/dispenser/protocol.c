@@ -0,0 +1,1483 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/ringbuf.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_system.h"
+#include "dispenser_internal.h"
+
+static const char* TAG = "dispenser";
+
+const char* const ack_status_names[ACK_STATUS_MAX] = {
+    [ACK_QUEUED] = "queued",
+    [ACK_DONE] = "done",
+    [ACK_BUSY] = "busy",
+    [ACK_BAD_JSON] = "bad_json",
+    [ACK_BAD_CRC] = "bad_crc",
+    [ACK_BAD_PAYLOAD] = "bad_payload",
+    [ACK_BAD_OPCODE] = "bad_opcode",
+    [ACK_PONG] = "pong",
+    [ACK_MODE_OK] = "ack_mode_ok",
+    [ACK_BAUD_OK] = "baud_ok",
+    [ACK_MAP_OK] = "map_ok",
+    [ACK_PROFILE_OK] = "profile_ok",
+    [ACK_SHORT] = "short",
+    [ACK_CYCLE_MODE_OK] = "cycle_mode_ok",
+    [ACK_STATS] = "stats",
+    [ACK_JOURNAL] = "journal",
+    [ACK_HELLO] = "hello",
+    [ACK_HEARTBEAT] = "heartbeat",
+    [ACK_CANCELLED] = "cancelled",
+    [ACK_CANCEL_OK] = "cancel_ok",
+    [ACK_ESTOP_OK] = "estop_ok",
+    [ACK_ESTOP] = "estop",
+    [ACK_SCHEDULE_OK] = "schedule_ok",
+    [ACK_PROGRESS] = "progress",
+    [ACK_OTA_OK] = "ota_ok",
+    [ACK_OTA_ERROR] = "ota_error",
+    [ACK_CAL_OK] = "cal_ok",
+};
+
+static const uint32_t uart_supported_bauds[] = {115200, 230400, 460800, 921600, 2000000};
+static esp_timer_handle_t baud_confirm_timer;
+static volatile bool baud_confirm_pending;
+
+QueueHandle_t cmd_queue;
+
+static uint32_t boot_id;
+
+// Set by an e-stop, cleared only by an explicit release (or a reset); while set
+// every new order is refused with "estop".
+static volatile bool estop_latched;
+
+static volatile ack_mode_t ack_mode = ACK_MODE_JSON;
+static dispenser_output_fn output;
+static RingbufHandle_t tx_ring;
+static StaticRingbuffer_t tx_ring_struct;
+static uint8_t tx_ring_storage[TX_RING_SIZE];
+static SemaphoreHandle_t tx_lock;
+static StaticSemaphore_t tx_lock_struct;
+static unsigned tx_finals_reserved; // under tx_lock
+static StaticQueue_t cmd_queue_struct;
+static uint8_t cmd_queue_storage[CMD_QUEUE_DEPTH * sizeof(dispense_cmd_t*)];
+
+// CRC16-CCITT (poly 0x1021, init 0xFFFF), bitwise: frames and ACKs are short.
+uint16_t crc16_ccitt(const uint8_t* data, size_t len) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+void dispenser_set_output(dispenser_output_fn fn) {
+    output = fn;
+}
+
+// Replies are copied into tx_ring and written out by tx_task, so neither uart_task
+// nor motion_task waits for the wire. tx_task runs below both of them: replies
+// queued while they are busy (a V2 batch's ACKs, say) leave together, in writes
+// of up to TX_WRITE_CHUNK so ring space comes back while a long queue drains.
+// Each reply goes into the ring whole. What happens when it does not fit depends
+// on what the host loses without it:
+//   TX_FINAL   an accepted order's last ACK. Every order reserves TX_FINAL_ACK_MAX
+//              bytes when it is accepted, so this always fits.
+//   TX_REPLY   any other reply that ends an exchange (busy, bad_*, control
+//              replies). The sender waits up to TX_REPLY_WAIT_MS for room.
+//   TX_EVENT   queued, progress and heartbeat: dropped at once.
+// Only TX_FINAL may use reserved space; a reply that still does not fit is
+// dropped and counted.
+typedef enum {
+    TX_EVENT,
+    TX_REPLY,
+    TX_FINAL,
+} tx_kind_t;
+
+static void tx_write(const void* data, size_t len, tx_kind_t kind) {
+    if (output) {
+        output(data, len);
+        return;
+    }
+    if (!tx_ring) {
+        uart_write_bytes(UART_PORT_NUM, data, len);
+        return;
+    }
+    TickType_t start = xTaskGetTickCount();
+    while (1) {
+        xSemaphoreTake(tx_lock, portMAX_DELAY);
+        size_t keep = (size_t)(tx_finals_reserved - (kind == TX_FINAL ? 1 : 0)) * TX_FINAL_ACK_MAX;
+        bool sent = xRingbufferGetCurFreeSize(tx_ring) >= len + keep &&
+                    xRingbufferSend(tx_ring, data, len, 0) == pdTRUE;
+        bool give_up = sent || kind != TX_REPLY ||
+                       xTaskGetTickCount() - start >= pdMS_TO_TICKS(TX_REPLY_WAIT_MS);
+        if (kind == TX_FINAL) tx_finals_reserved--;
+        if (!sent && give_up) {
+            stats_inc(&stats.tx_drops, 1);
+            if (kind == TX_FINAL) stats_inc(&stats.tx_final_drops, 1);
+        }
+        xSemaphoreGive(tx_lock);
+        if (give_up) return;
+        vTaskDelay(1);
+    }
+}
+
+static void dispenser_write(const void* data, size_t len) {
+    tx_write(data, len, TX_REPLY);
+}
+
+// Room for the final ACKs of n more orders, taken all at once or not at all.
+static bool tx_reserve_finals(unsigned n) {
+    if (output || !tx_ring) return true;
+    xSemaphoreTake(tx_lock, portMAX_DELAY);
+    bool ok = xRingbufferGetCurFreeSize(tx_ring) >= (size_t)(tx_finals_reserved + n) * TX_FINAL_ACK_MAX;
+    if (ok) tx_finals_reserved += n;
+    xSemaphoreGive(tx_lock);
+    return ok;
+}
+
+// For an order dropped without any reply (dispenser_flush_orders).
+static void tx_release_final(void) {
+    if (output || !tx_ring) return;
+    xSemaphoreTake(tx_lock, portMAX_DELAY);
+    tx_finals_reserved--;
+    xSemaphoreGive(tx_lock);
+}
+
+// {"status":"heartbeat","protocol":"heartbeat",...}: always JSON. It goes through
+// the ring like any reply, so it can never split one on the wire.
+static void send_heartbeat(void) {
+    char msg[160];
+    int n = snprintf(msg, sizeof(msg),
+                     "{\"status\":\"%s\",\"protocol\":\"heartbeat\",\"boot_id\":%u,\"uptime_ms\":%lld,"
+                     "\"queue\":%u,\"estop\":%s}\n",
+                     ack_status_names[ACK_HEARTBEAT], (unsigned)boot_id, (long long)(esp_timer_get_time() / 1000),
+                     (unsigned)uxQueueMessagesWaiting(cmd_queue), estop_latched ? "true" : "false");
+    if (n > 0 && (size_t)n < sizeof(msg)) tx_write(msg, (size_t)n, TX_EVENT);
+}
+
+static void tx_task(void* arg) {
+    const int64_t period_us = (int64_t)HEARTBEAT_PERIOD_MS * 1000;
+    int64_t next_heartbeat_us = esp_timer_get_time() + period_us;
+    while (1) {
+        int64_t wait_us = next_heartbeat_us - esp_timer_get_time();
+        TickType_t wait = wait_us > 0 ? pdMS_TO_TICKS(wait_us / 1000) : 0;
+        size_t size = 0;
+        uint8_t* item = (uint8_t*)xRingbufferReceiveUpTo(tx_ring, &size, wait, TX_WRITE_CHUNK);
+        if (item) {
+            uart_write_bytes(UART_PORT_NUM, item, size);
+            vRingbufferReturnItem(tx_ring, item);
+        }
+        int64_t now_us = esp_timer_get_time();
+        if (now_us >= next_heartbeat_us) {
+            // Late (a long write at a low baud rate): skip the missed beats.
+            next_heartbeat_us = now_us - next_heartbeat_us >= period_us ? now_us + period_us
+                                                                         : next_heartbeat_us + period_us;
+            send_heartbeat();
+        }
+    }
+}
+
+void tx_init(void) {
+    tx_lock = xSemaphoreCreateMutexStatic(&tx_lock_struct);
+    tx_ring = xRingbufferCreateStatic(TX_RING_SIZE, RINGBUF_TYPE_BYTEBUF, tx_ring_storage, &tx_ring_struct);
+    DISPENSER_TASK_START(TASK_TX, tx_task, TX_TASK_STACK, TX_TASK_PRIORITY, PROTOCOL_CORE);
+}
+
+// Waits (up to timeout) until every queued reply has been shifted out.
+static void tx_drain(TickType_t timeout) {
+    TickType_t start = xTaskGetTickCount();
+    while (tx_ring && xRingbufferGetCurFreeSize(tx_ring) < TX_RING_SIZE &&
+           xTaskGetTickCount() - start < timeout) {
+        vTaskDelay(1);
+    }
+    uart_wait_tx_done(UART_PORT_NUM, timeout);
+}
+
+// queue_depth < 0 omits the field (final/error ACKs). "queued" also carries the
+// order's expected duration and its longest gap between progress events, so the
+// host can time it out on its own pace rather than on a fixed deadline.
+// An order's TX reservation goes to whatever answers it last.
+static inline tx_kind_t ack_tx_kind(ack_status_t status, const dispense_cmd_t* cmd) {
+    if (status == ACK_QUEUED || status == ACK_PROGRESS) return TX_EVENT;
+    return cmd->tx_reserved ? TX_FINAL : TX_REPLY;
+}
+
+static void send_ack_json(ack_status_t status, const dispense_cmd_t* cmd, int queue_depth) {
+    char msg[288 + DISPENSER_NUM_CHANNELS * 4];
+    int n = snprintf(
+        msg,
+        sizeof(msg),
+        "{\"status\":\"%s\",\"protocol\":\"%s\",\"counts\":[",
+        ack_status_names[status],
+        cmd->protocol ? cmd->protocol : "unknown"
+    );
+    for (int ch = 0; ch < DISPENSER_NUM_CHANNELS && n > 0 && (size_t)n < sizeof(msg); ch++) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, ch == 0 ? "%d" : ",%d", cmd->counts[ch]);
+    }
+    if (n > 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, "]");
+    }
+    if (cmd->dispensed) {
+        for (int ch = 0; ch < DISPENSER_NUM_CHANNELS && n > 0 && (size_t)n < sizeof(msg); ch++) {
+            n += snprintf(msg + n, sizeof(msg) - (size_t)n, ch == 0 ? ",\"dispensed\":[%d" : ",%d",
+                          cmd->dispensed[ch]);
+        }
+        if (n > 0 && (size_t)n < sizeof(msg)) {
+            n += snprintf(msg + n, sizeof(msg) - (size_t)n, "]");
+        }
+    }
+    if (n > 0 && cmd->seq >= 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, ",\"seq\":%d,\"order\":%d",
+                      (int)cmd->seq, (int)cmd->order);
+    }
+    if (n > 0 && queue_depth >= 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, ",\"queue_depth\":%d", queue_depth);
+    }
+    if (n > 0 && status == ACK_QUEUED && (size_t)n < sizeof(msg)) {
+        uint32_t eta_ms, gap_ms;
+        motion_estimate(cmd->counts, &eta_ms, &gap_ms);
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, ",\"eta_ms\":%u,\"gap_ms\":%u",
+                      (unsigned)eta_ms, (unsigned)gap_ms);
+    }
+    if (n > 0 && (size_t)n < sizeof(msg) - 2) {
+        msg[n++] = '}';
+        msg[n++] = '\n';
+        tx_write(msg, (size_t)n, ack_tx_kind(status, cmd));
+    }
+}
+
+static void send_ack_binary(ack_status_t status, const dispense_cmd_t* cmd, int queue_depth) {
+    uint8_t frame[ACK_FRAME_OVERHEAD + DISPENSER_NUM_CHANNELS];
+    uint16_t seq = cmd->seq >= 0 ? (uint16_t)cmd->seq : 0xFFFF;
+    const int* counts = cmd->dispensed ? cmd->dispensed : cmd->counts;
+    uint16_t detail = 0;
+    if (status == ACK_PROGRESS) {
+        detail = (uint16_t)queue_depth; // the channel, 1-based
+    } else if (cmd->dispensed) {
+        for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+            if (cmd->dispensed[ch] >= cmd->counts[ch]) detail |= (uint16_t)(1u << ch);
+        }
+    } else if (queue_depth >= 0) {
+        detail = (uint16_t)queue_depth;
+    }
+
+    size_t n = 0;
+    frame[n++] = ACK_FRAME_START;
+    frame[n++] = (uint8_t)(seq & 0xFF);
+    frame[n++] = (uint8_t)(seq >> 8);
+    frame[n++] = (uint8_t)status;
+    frame[n++] = cmd->order;
+    frame[n++] = DISPENSER_NUM_CHANNELS;
+    for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+        frame[n++] = (uint8_t)counts[ch];
+    }
+    frame[n++] = (uint8_t)(detail & 0xFF);
+    frame[n++] = (uint8_t)(detail >> 8);
+    uint16_t crc = crc16_ccitt(&frame[1], n - 1);
+    frame[n++] = (uint8_t)(crc & 0xFF);
+    frame[n++] = (uint8_t)(crc >> 8);
+    frame[n++] = ACK_FRAME_END;
+    tx_write(frame, n, ack_tx_kind(status, cmd));
+}
+
+void send_ack(ack_status_t status, const dispense_cmd_t* cmd, int queue_depth) {
+    if (ack_mode == ACK_MODE_BINARY) {
+        send_ack_binary(status, cmd, queue_depth);
+    } else {
+        send_ack_json(status, cmd, queue_depth);
+    }
+}
+
+// {"status":"progress",...,"channel":2,"pill":1,"of":3,"elapsed_ms":812,"dispensed":[...]}
+// from motion_task, one per pill counted. A TX_EVENT: on a full ring it is
+// dropped (and counted), never waited for.
+void send_progress(const dispense_cmd_t* cmd, int channel, const int got[DISPENSER_NUM_CHANNELS], int64_t elapsed_us) {
+    if (ack_mode == ACK_MODE_BINARY) {
+        dispense_cmd_t progress = *cmd;
+        progress.dispensed = got;
+        send_ack_binary(ACK_PROGRESS, &progress, channel + 1);
+        return;
+    }
+    char msg[160 + DISPENSER_NUM_CHANNELS * 4];
+    int n = snprintf(msg, sizeof(msg),
+                     "{\"status\":\"%s\",\"protocol\":\"%s\",\"channel\":%d,\"pill\":%d,\"of\":%d,"
+                     "\"elapsed_ms\":%lld",
+                     ack_status_names[ACK_PROGRESS], cmd->protocol ? cmd->protocol : "unknown", channel + 1,
+                     got[channel], cmd->counts[channel], (long long)(elapsed_us / 1000));
+    for (int ch = 0; ch < DISPENSER_NUM_CHANNELS && n > 0 && (size_t)n < sizeof(msg); ch++) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, ch == 0 ? ",\"dispensed\":[%d" : ",%d", got[ch]);
+    }
+    if (n > 0 && cmd->seq >= 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, "],\"seq\":%d,\"order\":%d}\n",
+                      (int)cmd->seq, (int)cmd->order);
+    } else if (n > 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, "]}\n");
+    }
+    if (n > 0 && (size_t)n < sizeof(msg)) tx_write(msg, (size_t)n, TX_EVENT);
+}
+
+static void send_status(ack_status_t status, const char* protocol, int32_t seq) {
+    dispense_cmd_t cmd = { .protocol = protocol, .seq = seq, .order = 0 };
+    send_ack(status, &cmd, -1);
+}
+
+// Hand a validated order to the motion task and ACK receipt immediately, so the
+// host can send the next order (or a cancel) while this one is still dispensing.
+// A batch reserves its orders' final ACKs up front (tx_reserved set); a single
+// order that finds the TX ring too full to promise one is refused as busy.
+static void enqueue_dispense(const dispense_cmd_t* cmd) {
+    if (estop_latched) {
+        send_ack(ACK_ESTOP, cmd, -1);
+        return;
+    }
+    if (ota_in_progress() || (!cmd->tx_reserved && !tx_reserve_finals(1))) {
+        send_ack(ACK_BUSY, cmd, (int)uxQueueMessagesWaiting(cmd_queue));
+        return;
+    }
+    dispense_cmd_t* queued = cmd_pool_alloc();
+    if (queued) {
+        *queued = *cmd;
+        queued->tx_reserved = true;
+        queued->rx_us = uart_rx_us;
+        queued->cancel_gen = atomic_load_explicit(&motion_cancel_gen, memory_order_relaxed);
+        if (xQueueSend(cmd_queue, &queued, 0) == pdTRUE) {
+            send_ack(ACK_QUEUED, cmd, (int)uxQueueMessagesWaiting(cmd_queue));
+            return;
+        }
+        cmd_pool_free(queued);
+    }
+    dispense_cmd_t refused = *cmd;
+    refused.tx_reserved = true; // the busy ACK is its final one
+    send_ack(ACK_BUSY, &refused, (int)uxQueueMessagesWaiting(cmd_queue));
+}
+
+void dispenser_flush_orders(void) {
+    dispense_cmd_t* cmd;
+    while (xQueueReceive(cmd_queue, &cmd, 0) == pdTRUE) {
+        tx_release_final();
+        cmd_pool_free(cmd);
+    }
+}
+
+static void baud_confirm_timeout_cb(void* arg) {
+    if (!baud_confirm_pending) return;
+    // Nothing valid arrived at the new rate: go back to the boot rate the host
+    // will retry with.
+    baud_confirm_pending = false;
+    uart_set_baudrate(UART_PORT_NUM, UART_BAUD_RATE);
+    ESP_LOGW(TAG, "baud switch not confirmed, back to %d", UART_BAUD_RATE);
+}
+
+// Any valid frame or line proves the host followed a baud switch, and that it can
+// talk to a freshly updated image.
+static inline void uart_host_seen(void) {
+    if (baud_confirm_pending) {
+        baud_confirm_pending = false;
+        esp_timer_stop(baud_confirm_timer);
+    }
+    ota_app_confirm();
+}
+
+static void set_baud_rate(uint32_t baud, const char* protocol, int32_t seq) {
+    bool supported = false;
+    for (size_t i = 0; i < sizeof(uart_supported_bauds) / sizeof(uart_supported_bauds[0]); i++) {
+        if (uart_supported_bauds[i] == baud) supported = true;
+    }
+    if (!supported) {
+        send_status(ACK_BAD_PAYLOAD, protocol, seq);
+        return;
+    }
+
+    // Reply at the current rate and let it drain before switching.
+    send_status(ACK_BAUD_OK, protocol, seq);
+    tx_drain(pdMS_TO_TICKS(50));
+    uart_set_baudrate(UART_PORT_NUM, baud);
+    ESP_LOGI(TAG, "baud -> %u", (unsigned)baud);
+    if (baud != UART_BAUD_RATE) {
+        baud_confirm_pending = true;
+        esp_timer_stop(baud_confirm_timer);
+        esp_timer_start_once(baud_confirm_timer, (uint64_t)UART_BAUD_CONFIRM_MS * 1000);
+    }
+}
+
+void protocol_init(void) {
+    const esp_timer_create_args_t baud_timer_args = {
+        .callback = baud_confirm_timeout_cb,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "baud_confirm",
+    };
+    esp_timer_create(&baud_timer_args, &baud_confirm_timer);
+    cmd_queue = xQueueCreateStatic(CMD_QUEUE_DEPTH, sizeof(dispense_cmd_t*), cmd_queue_storage, &cmd_queue_struct);
+    cmd_pool_init();
+    json_arena_init();
+    boot_id = esp_random();
+}
+
+static void set_ack_mode(ack_mode_t mode, const char* protocol, int32_t seq) {
+    ack_mode = mode;
+    // Confirm in the new format so the host knows the switch took effect.
+    send_status(ACK_MODE_OK, protocol, seq);
+}
+
+// Takes effect from the next order; one already running keeps its mode.
+static void set_cycle_mode(cycle_mode_t mode, const char* protocol, int32_t seq) {
+    cycle_mode = mode;
+    send_status(ACK_CYCLE_MODE_OK, protocol, seq);
+}
+
+// Takes effect from the next run; orders already gathered into one stay together.
+static void set_schedule_mode(schedule_mode_t mode, const char* protocol, int32_t seq) {
+    schedule_mode = mode;
+    send_status(ACK_SCHEDULE_OK, protocol, seq);
+}
+
+// Cancel: the running order stops on the next motion tick (within one servo
+// period), every moving servo going straight to SERVO_SAFE_ANGLE_DEG, and orders
+// still queued are dropped without moving. Each of them then gets its final
+// "cancelled" ACK with what it dispensed. The confirmation goes out first, so the
+// host sees cancel_ok before those ACKs. Handled here in uart_task, which keeps
+// reading while motion runs, so it never waits behind the orders it cancels.
+static void cancel_orders(const char* protocol, int32_t seq) {
+    send_status(ACK_CANCEL_OK, protocol, seq);
+    motion_cancel();
+}
+
+// E-stop: a cancel that also latches, refusing orders until released. Releasing
+// moves nothing; the servos are already at the safe angle.
+static void set_estop(bool engage, const char* protocol, int32_t seq) {
+    if (engage) {
+        estop_latched = true;
+        send_status(ACK_ESTOP_OK, protocol, seq);
+        motion_cancel();
+        ESP_LOGW(TAG, "e-stop");
+    } else {
+        estop_latched = false;
+        send_status(ACK_ESTOP_OK, protocol, seq);
+        ESP_LOGI(TAG, "e-stop released");
+    }
+}
+
+// {"status":"ota_ok"|"ota_error","protocol":...,"offset":N[,"error":"crc"]}: always
+// JSON. offset is how much of the image the firmware holds, so after an error the
+// sender resumes from there (or starts over once the update was dropped).
+void send_ota_reply(const char* protocol, int32_t seq, ota_err_t err) {
+    char msg[128];
+    int n = snprintf(msg, sizeof(msg), "{\"status\":\"%s\",\"protocol\":\"%s\"",
+                     ack_status_names[err == OTA_OK ? ACK_OTA_OK : ACK_OTA_ERROR], protocol);
+    if (seq >= 0 && n > 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, ",\"seq\":%d", (int)seq);
+    }
+    if (n > 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, ",\"offset\":%u", (unsigned)ota_offset());
+    }
+    if (err != OTA_OK && n > 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, ",\"error\":\"%s\"", ota_err_names[err]);
+    }
+    if (n > 0 && (size_t)n < sizeof(msg) - 2) {
+        msg[n++] = '}';
+        msg[n++] = '\n';
+        dispenser_write(msg, (size_t)n);
+    }
+}
+
+void dispenser_reboot(void) {
+    tx_drain(pdMS_TO_TICKS(100));
+    esp_restart();
+}
+
+// Every sector the update erases stalls flash access on both cores for a few tens
+// of ms: only start with no order queued or running.
+static void ota_begin_cmd(uint32_t size, uint32_t crc32, const char* protocol, int32_t seq) {
+    if (cmd_pool_available() != CMD_POOL_SIZE) {
+        send_status(ACK_BUSY, protocol, seq);
+        return;
+    }
+    send_ota_reply(protocol, seq, ota_begin(OTA_SRC_UART, size, crc32));
+}
+
+static void ota_end_cmd(const uint8_t tag[OTA_AUTH_TAG_LEN], const char* protocol, int32_t seq) {
+    ota_err_t err = ota_finish(OTA_SRC_UART, tag);
+    send_ota_reply(protocol, seq, err);
+    if (err == OTA_OK) dispenser_reboot();
+}
+
+// Control lines look like {"cmd":"<name>", ...}; anything else is a dispense order.
+// {"status":"map_ok","protocol":...,"names":[...]} (always JSON: names are text).
+static void send_channel_map(const char* protocol, int32_t seq) {
+    char msg[96 + DISPENSER_NUM_CHANNELS * (CHANNEL_NAME_MAX_LEN + 3)];
+    int n = snprintf(msg, sizeof(msg), "{\"status\":\"%s\",\"protocol\":\"%s\"",
+                     ack_status_names[ACK_MAP_OK], protocol);
+    if (seq >= 0 && n > 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, ",\"seq\":%d", (int)seq);
+    }
+    for (int ch = 0; ch < DISPENSER_NUM_CHANNELS && n > 0 && (size_t)n < sizeof(msg); ch++) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, "%s\"%s\"",
+                      ch == 0 ? ",\"names\":[" : ",", channel_names[ch]);
+    }
+    if (n > 0 && (size_t)n < sizeof(msg) - 3) {
+        msg[n++] = ']';
+        msg[n++] = '}';
+        msg[n++] = '\n';
+        dispenser_write(msg, (size_t)n);
+    }
+}
+
+// Reply with every channel's profile plus the resulting pill cycle time, which is
+// what a host tuning a slot actually cares about. Static buffer: only uart_task
+// replies here.
+static void send_motion_profiles(const char* protocol, int32_t seq) {
+    static char msg[96 + DISPENSER_NUM_CHANNELS * 128];
+    int n = snprintf(msg, sizeof(msg), "{\"status\":\"%s\",\"protocol\":\"%s\"",
+                     ack_status_names[ACK_PROFILE_OK], protocol);
+    if (seq >= 0 && n > 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, ",\"seq\":%d", (int)seq);
+    }
+    for (int ch = 0; ch < DISPENSER_NUM_CHANNELS && n > 0 && (size_t)n < sizeof(msg); ch++) {
+        const motion_profile_t* p = &motion_profiles[ch];
+        const motion_plan_t* m = &motion_plans[ch];
+        int cycle_ms = (int)((2 * m->move_us + m->dwell_us + m->pause_us) / 1000);
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n,
+                      "%s{\"shape\":\"%s\",\"travel\":%u,\"vmax\":%u,\"accel\":%u,"
+                      "\"dwell\":%u,\"pause\":%u,\"cycle_ms\":%d}",
+                      ch == 0 ? ",\"profiles\":[" : ",", motion_shape_names[p->shape],
+                      p->travel_deg, p->vmax_dps, p->accel_dps2, p->dwell_ms, p->pause_ms, cycle_ms);
+    }
+    if (n > 0 && (size_t)n < sizeof(msg) - 3) {
+        msg[n++] = ']';
+        msg[n++] = '}';
+        msg[n++] = '\n';
+        dispenser_write(msg, (size_t)n);
+    }
+}
+
+// {"status":"cal_ok","protocol":...,"cals":[{"min_us":N,"max_us":N},...]}: every
+// channel's pulse range, 0 deg and SERVO_MAX_ANGLE_DEG. Static buffer: only
+// uart_task replies here.
+static void send_servo_cals(const char* protocol, int32_t seq) {
+    static char msg[96 + DISPENSER_NUM_CHANNELS * 32];
+    int n = snprintf(msg, sizeof(msg), "{\"status\":\"%s\",\"protocol\":\"%s\"",
+                     ack_status_names[ACK_CAL_OK], protocol);
+    if (seq >= 0 && n > 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, ",\"seq\":%d", (int)seq);
+    }
+    for (int ch = 0; ch < DISPENSER_NUM_CHANNELS && n > 0 && (size_t)n < sizeof(msg); ch++) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, "%s{\"min_us\":%u,\"max_us\":%u}",
+                      ch == 0 ? ",\"cals\":[" : ",", servo_cals[ch].min_pulse_us, servo_cals[ch].max_pulse_us);
+    }
+    if (n > 0 && (size_t)n < sizeof(msg) - 3) {
+        msg[n++] = ']';
+        msg[n++] = '}';
+        msg[n++] = '\n';
+        dispenser_write(msg, (size_t)n);
+    }
+}
+
+static int append_stats_hist(char* msg, size_t size, int n, const char* name, stats_hist_t* h) {
+    int last = -1;
+    for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+        if (atomic_load_explicit(&h->buckets[b], memory_order_relaxed)) last = b;
+    }
+    if (n <= 0 || (size_t)n >= size) return n;
+    n += snprintf(msg + n, size - (size_t)n, ",\"%s\":{\"count\":%u,\"max\":%u,\"log2\":[", name,
+                  atomic_load_explicit(&h->count, memory_order_relaxed),
+                  atomic_load_explicit(&h->max_us, memory_order_relaxed));
+    for (int b = 0; b <= last && n > 0 && (size_t)n < size; b++) {
+        n += snprintf(msg + n, size - (size_t)n, b == 0 ? "%u" : ",%u",
+                      atomic_load_explicit(&h->buckets[b], memory_order_relaxed));
+    }
+    if (n > 0 && (size_t)n < size) n += snprintf(msg + n, size - (size_t)n, "]}");
+    return n;
+}
+
+// {"status":"stats",...}: counters, then latency_us / cycle_us / command_us
+// histograms trimmed after the last non-empty bucket. Always JSON.
+static void send_stats(const char* protocol, int32_t seq, bool reset) {
+    static char msg[320 + 3 * (64 + STATS_HIST_BUCKETS * 11) + TASK_MAX * 24];
+    int n = snprintf(msg, sizeof(msg), "{\"status\":\"%s\",\"protocol\":\"%s\"",
+                     ack_status_names[ACK_STATS], protocol);
+    if (seq >= 0 && n > 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, ",\"seq\":%d", (int)seq);
+    }
+    if (n > 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n,
+                      ",\"uptime_ms\":%lld,\"rx_bytes\":%u,\"orders\":%u,\"resync_bytes\":%u,"
+                      "\"checksum_failures\":%u,\"bad_json\":%u,\"rx_overflows\":%u,\"log_drops\":%u,"
+                      "\"tx_drops\":%u,\"tx_final_drops\":%u,\"json_oom\":%u,\"cancelled\":%u,\"cmd_pool_free\":%u,"
+                      "\"heap_min_free\":%u",
+                      (long long)(esp_timer_get_time() / 1000),
+                      atomic_load_explicit(&stats.rx_bytes, memory_order_relaxed),
+                      atomic_load_explicit(&stats.orders, memory_order_relaxed),
+                      atomic_load_explicit(&stats.resync_bytes, memory_order_relaxed),
+                      atomic_load_explicit(&stats.checksum_failures, memory_order_relaxed),
+                      atomic_load_explicit(&stats.bad_json, memory_order_relaxed),
+                      atomic_load_explicit(&stats.rx_overflows, memory_order_relaxed),
+                      atomic_load_explicit(&stats.log_drops, memory_order_relaxed),
+                      atomic_load_explicit(&stats.tx_drops, memory_order_relaxed),
+                      atomic_load_explicit(&stats.tx_final_drops, memory_order_relaxed),
+                      atomic_load_explicit(&stats.json_oom, memory_order_relaxed),
+                      atomic_load_explicit(&stats.cancelled, memory_order_relaxed), cmd_pool_available(),
+                      (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT));
+    }
+    n = append_stats_hist(msg, sizeof(msg), n, "latency_us", &stats.latency);
+    n = append_stats_hist(msg, sizeof(msg), n, "cycle_us", &stats.cycle);
+    n = append_stats_hist(msg, sizeof(msg), n, "command_us", &stats.command);
+    for (int t = 0; t < TASK_MAX && n > 0 && (size_t)n < sizeof(msg); t++) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, "%s\"%s\":%u", t == 0 ? ",\"stack_free\":{" : ",",
+                      dispenser_task_names[t], dispenser_task_stack_free((dispenser_task_id_t)t));
+    }
+    if (n > 0 && (size_t)n < sizeof(msg)) n += snprintf(msg + n, sizeof(msg) - (size_t)n, "}");
+    if (n > 0 && (size_t)n < sizeof(msg) - 2) {
+        msg[n++] = '}';
+        msg[n++] = '\n';
+        dispenser_write(msg, (size_t)n);
+    }
+    if (reset) stats_reset();
+}
+
+static const char* reset_reason_name(esp_reset_reason_t reason) {
+    switch (reason) {
+    case ESP_RST_POWERON: return "poweron";
+    case ESP_RST_BROWNOUT: return "brownout";
+    case ESP_RST_SW: return "software";
+    case ESP_RST_PANIC: return "panic";
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT: return "watchdog";
+    case ESP_RST_EXT: return "external";
+    case ESP_RST_DEEPSLEEP: return "deepsleep";
+    default: return "other";
+    }
+}
+
+// {"status":"hello",...}: what the host needs to (re)build its session: boot_id,
+// why the chip last reset, the channel count and the heartbeat period, the running
+// firmware (version, partition, "ota": valid/pending_verify/updating), plus the
+// memory plan: the static buffers and what the heap has left (the heap is only
+// used during boot, so heap_min_free should never move afterwards). Always JSON.
+void send_hello(const char* protocol, int32_t seq) {
+    char msg[672];
+    int n = snprintf(msg, sizeof(msg), "{\"status\":\"%s\",\"protocol\":\"%s\"",
+                     ack_status_names[ACK_HELLO], protocol);
+    if (seq >= 0 && n > 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, ",\"seq\":%d", (int)seq);
+    }
+    if (n > 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n,
+                      ",\"boot_id\":%u,\"reset_reason\":\"%s\",\"uptime_ms\":%lld,\"channels\":%d,"
+                      "\"drop_sensors\":%s,\"max_batch\":%d,\"heartbeat_ms\":%d,\"estop\":%s",
+                      (unsigned)boot_id, reset_reason_name(esp_reset_reason()),
+                      (long long)(esp_timer_get_time() / 1000), DISPENSER_NUM_CHANNELS,
+                      DISPENSER_DROP_SENSORS ? "true" : "false", V2_MAX_BATCH_ORDERS,
+                      tx_ring ? HEARTBEAT_PERIOD_MS : 0, estop_latched ? "true" : "false");
+    }
+    if (n > 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n,
+                      ",\"app\":\"%s\",\"partition\":\"%s\",\"ota\":\"%s\",\"ota_wifi\":%s",
+                      ota_app_version(), ota_running_label(), ota_state_name(),
+                      DISPENSER_OTA_WIFI ? "true" : "false");
+    }
+    if (n > 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n,
+                      ",\"mem\":{\"heap_free\":%u,\"heap_min_free\":%u,\"heap_largest\":%u,"
+                      "\"rx_ring\":%u,\"tx_ring\":%u,\"log_ring\":%u,\"cmd_pool\":%u,\"json_arena\":%u,"
+                      "\"ota_buf\":%u,\"servo_lut\":%u,\"stacks\":%u}}\n",
+                      (unsigned)heap_caps_get_free_size(MALLOC_CAP_DEFAULT),
+                      (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT),
+                      (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT),
+                      (unsigned)sizeof(rx_ring_t), (unsigned)TX_RING_SIZE,
+                      (unsigned)(DISPENSER_LOG_UART ? LOG_RING_SIZE : 0),
+                      (unsigned)(CMD_POOL_SIZE * sizeof(dispense_cmd_t)), (unsigned)JSON_ARENA_SIZE,
+                      (unsigned)OTA_WRITE_BUF_SIZE,
+                      (unsigned)(DISPENSER_NUM_CHANNELS * SERVO_LUT_SIZE * sizeof(uint16_t)),
+                      (unsigned)(MOTION_TASK_STACK + UART_TASK_STACK + TX_TASK_STACK +
+                                 (DISPENSER_LOG_UART ? LOG_TASK_STACK : 0) +
+                                 (DISPENSER_OTA_WIFI ? OTA_TASK_STACK : 0)));
+    }
+    if (n > 0 && (size_t)n < sizeof(msg)) dispenser_write(msg, (size_t)n);
+}
+
+// {"status":"journal",...,"interrupted":{...}|null}: the order a reset cut short,
+// if any. Channels in in_flight were mid-cycle, so one more pill may have dropped
+// there than dispensed says. "orders" > 1: a coalesced run starting at seq/order,
+// with counts and dispensed summed over its orders. Always JSON; also sent
+// unsolicited at boot.
+void send_journal(const char* protocol, int32_t seq, bool clear) {
+    char msg[192 + DISPENSER_MAX_CHANNELS * 8];
+    int n = snprintf(msg, sizeof(msg), "{\"status\":\"%s\",\"protocol\":\"%s\"",
+                     ack_status_names[ACK_JOURNAL], protocol);
+    if (seq >= 0 && n > 0 && (size_t)n < sizeof(msg)) {
+        n += snprintf(msg + n, sizeof(msg) - (size_t)n, ",\"seq\":%d", (int)seq);
+    }
+    journal_entry_t e;
+    if (!journal_interrupted(&e)) {
+        if (n > 0 && (size_t)n < sizeof(msg)) n += snprintf(msg + n, sizeof(msg) - (size_t)n, ",\"interrupted\":null");
+    } else {
+        if (n > 0 && (size_t)n < sizeof(msg)) {
+            n += snprintf(msg + n, sizeof(msg) - (size_t)n,
+                          ",\"interrupted\":{\"protocol\":\"%s\",\"seq\":%d,\"order\":%u,\"orders\":%u,"
+                          "\"in_flight\":%u",
+                          journal_protocols[e.protocol], (int)e.seq, e.order, e.n_orders, e.in_flight);
+        }
+        for (int ch = 0; ch < e.n_channels && n > 0 && (size_t)n < sizeof(msg); ch++) {
+            n += snprintf(msg + n, sizeof(msg) - (size_t)n, "%s%u", ch == 0 ? ",\"counts\":[" : ",", e.counts[ch]);
+        }
+        for (int ch = 0; ch < e.n_channels && n > 0 && (size_t)n < sizeof(msg); ch++) {
+            n += snprintf(msg + n, sizeof(msg) - (size_t)n, "%s%u", ch == 0 ? "],\"dispensed\":[" : ",", e.dispensed[ch]);
+        }
+        if (n > 0 && (size_t)n < sizeof(msg)) n += snprintf(msg + n, sizeof(msg) - (size_t)n, "]}");
+    }
+    if (n > 0 && (size_t)n < sizeof(msg) - 2) {
+        msg[n++] = '}';
+        msg[n++] = '\n';
+        dispenser_write(msg, (size_t)n);
+    }
+    if (clear) journal_clear_interrupted();
+}
+
+// Optional u16 field: absent leaves *out unchanged, anything but 0..65535 fails.
+static bool json_profile_field(const cJSON* json, const char* key, uint16_t* out) {
+    const cJSON* v = cJSON_GetObjectItemCaseSensitive(json, key);
+    if (!v) return true;
+    if (!cJSON_IsNumber(v) || v->valueint < 0 || v->valueint > 0xFFFF) return false;
+    *out = (uint16_t)v->valueint;
+    return true;
+}
+
+// {"cmd":"profile","channel":1..N,...}: fields left out keep their current value;
+// "default":true restores the build default.
+static bool motion_profile_from_json(const cJSON* json) {
+    const cJSON* channel = cJSON_GetObjectItemCaseSensitive(json, "channel");
+    if (!cJSON_IsNumber(channel)) return false;
+    int ch = channel->valueint - 1;
+    if (ch < 0 || ch >= DISPENSER_NUM_CHANNELS) return false;
+    if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(json, "default"))) {
+        return motion_profile_set(ch, NULL);
+    }
+
+    motion_profile_t p = motion_profiles[ch];
+    const cJSON* shape = cJSON_GetObjectItemCaseSensitive(json, "shape");
+    if (shape) {
+        if (!cJSON_IsString(shape)) return false;
+        int found = -1;
+        for (int i = 0; i < MOTION_SHAPE_MAX; i++) {
+            if (strcmp(shape->valuestring, motion_shape_names[i]) == 0) found = i;
+        }
+        if (found < 0) return false;
+        p.shape = (uint8_t)found;
+    }
+    uint16_t travel = p.travel_deg;
+    if (!json_profile_field(json, "travel", &travel) ||
+        !json_profile_field(json, "vmax", &p.vmax_dps) ||
+        !json_profile_field(json, "accel", &p.accel_dps2) ||
+        !json_profile_field(json, "dwell", &p.dwell_ms) ||
+        !json_profile_field(json, "pause", &p.pause_ms) ||
+        travel > SERVO_MAX_ANGLE_DEG) {
+        return false;
+    }
+    p.travel_deg = (uint8_t)travel;
+    return motion_profile_set(ch, &p);
+}
+
+// {"cmd":"cal","channel":1..N,"min_us":N,"max_us":N}: a field left out keeps its
+// current value; "default":true restores the build default; "pulse":N instead
+// jogs the servo to a raw pulse width to find its ends.
+static bool servo_cal_from_json(const cJSON* json) {
+    const cJSON* channel = cJSON_GetObjectItemCaseSensitive(json, "channel");
+    if (!cJSON_IsNumber(channel)) return false;
+    int ch = channel->valueint - 1;
+    if (ch < 0 || ch >= DISPENSER_NUM_CHANNELS) return false;
+    if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(json, "default"))) {
+        return servo_cal_set(ch, NULL);
+    }
+    uint16_t pulse = 0;
+    if (!json_profile_field(json, "pulse", &pulse)) return false;
+    if (pulse) return servo_pulse_test(ch, pulse);
+
+    servo_cal_t c = servo_cals[ch];
+    if (!json_profile_field(json, "min_us", &c.min_pulse_us) ||
+        !json_profile_field(json, "max_us", &c.max_pulse_us)) {
+        return false;
+    }
+    return servo_cal_set(ch, &c);
+}
+
+static inline bool json_is_ws(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Allocation-free parser for the hot-path shape {"<pill>": <int>, ...}, writing
+// straight into counts[]. Returns false for anything outside that shape (escapes,
+// non-integer values, control lines, malformed input) and leaves those to cJSON,
+// which then decides between a control command and bad_json.
+static bool json_fast_parse_counts(const char* p, size_t len, int counts[DISPENSER_NUM_CHANNELS]) {
+    const char* end = p + len;
+    int parsed[DISPENSER_NUM_CHANNELS] = {0};
+
+#define SKIP_WS() while (p < end && json_is_ws(*p)) p++
+    SKIP_WS();
+    if (p == end || *p++ != '{') return false;
+    SKIP_WS();
+    if (p < end && *p == '}') {
+        p++;
+    } else {
+        while (1) {
+            if (p == end || *p++ != '"') return false;
+            const char* key = p;
+            while (p < end && *p != '"' && *p != '\\') p++;
+            if (p == end || *p == '\\') return false;
+            size_t key_len = (size_t)(p - key);
+            p++;
+
+            SKIP_WS();
+            if (p == end || *p++ != ':') return false;
+            SKIP_WS();
+
+            bool negative = false;
+            if (p < end && *p == '-') {
+                negative = true;
+                p++;
+            }
+            if (p == end || *p < '0' || *p > '9') return false;
+            int value = 0;
+            while (p < end && *p >= '0' && *p <= '9') {
+                if (value <= MAX_PILLS_PER_CHANNEL) value = value * 10 + (*p - '0');
+                p++;
+            }
+            if (p < end && (*p == '.' || *p == 'e' || *p == 'E')) return false;
+
+            int idx = pill_to_index(key, key_len);
+            if (idx >= 0) {
+                if (negative) value = 0;
+                parsed[idx] = value > MAX_PILLS_PER_CHANNEL ? MAX_PILLS_PER_CHANNEL : value;
+            }
+
+            SKIP_WS();
+            if (p == end) return false;
+            if (*p == ',') {
+                p++;
+                SKIP_WS();
+                continue;
+            }
+            if (*p++ != '}') return false;
+            break;
+        }
+    }
+    SKIP_WS();
+#undef SKIP_WS
+    if (p != end) return false;
+
+    memcpy(counts, parsed, sizeof(parsed));
+    return true;
+}
+
+static void json_counts_from_tree(const cJSON* json, int counts[DISPENSER_NUM_CHANNELS]) {
+    const cJSON* item = NULL;
+    cJSON_ArrayForEach(item, json) {
+        if (!item || !item->string || !cJSON_IsNumber(item)) {
+            continue;
+        }
+        int idx = pill_to_index(item->string, strlen(item->string));
+        if (idx < 0) continue;
+        int count = item->valueint;
+        if (count < 0) count = 0;
+        if (count > MAX_PILLS_PER_CHANNEL) count = MAX_PILLS_PER_CHANNEL;
+        counts[idx] = count;
+    }
+}
+
+// Benchmark: {"cmd":"bench_json","iterations":N} times the fast parser against
+// the cJSON path on a typical order line and reports per-line cost and cJSON heap
+// traffic (counted through cJSON hooks). Always answers with a JSON line.
+#define JSON_BENCH_DEFAULT_ITERS 200
+#define JSON_BENCH_MAX_ITERS     5000
+
+static void run_json_bench(int iterations) {
+    static const char sample[] = "{\"Vitamin C\": 2, \"Fish Oil\": 2, \"Vitamin B\": 2, \"Tylenol\": 3}";
+    const size_t sample_len = sizeof(sample) - 1;
+    int counts[DISPENSER_NUM_CHANNELS];
+    int ok_fast = 0;
+    int ok_cjson = 0;
+
+    if (iterations <= 0) iterations = JSON_BENCH_DEFAULT_ITERS;
+    if (iterations > JSON_BENCH_MAX_ITERS) iterations = JSON_BENCH_MAX_ITERS;
+
+    size_t heap_before = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    int64_t t0 = esp_timer_get_time();
+    for (int i = 0; i < iterations; i++) {
+        ok_fast += json_fast_parse_counts(sample, sample_len, counts);
+    }
+    int64_t t1 = esp_timer_get_time();
+
+    // Nested inside the control line's own tree, so release to a mark, not to 0.
+    size_t arena_mark = json_arena_mark();
+    size_t arena_peak = 0;
+    uint32_t arena_allocs = 0;
+    json_arena_take_usage(&arena_peak, &arena_allocs);
+    int64_t t2 = esp_timer_get_time();
+    for (int i = 0; i < iterations; i++) {
+        cJSON* json = cJSON_ParseWithLength(sample, sample_len);
+        if (json) {
+            json_counts_from_tree(json, counts);
+            cJSON_Delete(json);
+            ok_cjson++;
+        }
+        json_arena_release(arena_mark);
+    }
+    int64_t t3 = esp_timer_get_time();
+    json_arena_take_usage(&arena_peak, &arena_allocs);
+
+    char msg[256];
+    int n = snprintf(
+        msg,
+        sizeof(msg),
+        "{\"status\":\"bench\",\"bench\":\"json\",\"iterations\":%d,\"ok\":[%d,%d],"
+        "\"fast_ns_per_line\":%lld,\"cjson_ns_per_line\":%lld,\"fast_allocs_per_line\":0,"
+        "\"cjson_allocs_per_line\":%u,\"cjson_peak_arena_bytes\":%u,"
+        "\"heap_free\":%u,\"heap_min_free\":%u}\n",
+        iterations, ok_fast, ok_cjson,
+        (long long)((t1 - t0) * 1000 / iterations),
+        (long long)((t3 - t2) * 1000 / iterations),
+        (unsigned)(arena_allocs / (uint32_t)iterations),
+        (unsigned)(arena_peak - arena_mark),
+        (unsigned)heap_before,
+        (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT)
+    );
+    if (n > 0 && (size_t)n < sizeof(msg)) {
+        dispenser_write(msg, (size_t)n);
+    }
+}
+
+static void handle_json_control(const cJSON* json, const char* name) {
+    if (strcmp(name, "ack_mode") == 0) {
+        const cJSON* mode = cJSON_GetObjectItemCaseSensitive(json, "mode");
+        if (cJSON_IsString(mode) && strcmp(mode->valuestring, "binary") == 0) {
+            set_ack_mode(ACK_MODE_BINARY, "json_line", -1);
+            return;
+        }
+        if (cJSON_IsString(mode) && strcmp(mode->valuestring, "json") == 0) {
+            set_ack_mode(ACK_MODE_JSON, "json_line", -1);
+            return;
+        }
+        send_status(ACK_BAD_PAYLOAD, "json_line", -1);
+        return;
+    }
+    if (strcmp(name, "cycle_mode") == 0) {
+        const cJSON* mode = cJSON_GetObjectItemCaseSensitive(json, "mode");
+        if (cJSON_IsString(mode) && strcmp(mode->valuestring, "pipelined") == 0) {
+            set_cycle_mode(CYCLE_MODE_PIPELINED, "json_line", -1);
+            return;
+        }
+        if (cJSON_IsString(mode) && strcmp(mode->valuestring, "serial") == 0) {
+            set_cycle_mode(CYCLE_MODE_SERIAL, "json_line", -1);
+            return;
+        }
+        send_status(ACK_BAD_PAYLOAD, "json_line", -1);
+        return;
+    }
+    if (strcmp(name, "schedule") == 0) {
+        const cJSON* mode = cJSON_GetObjectItemCaseSensitive(json, "mode");
+        if (cJSON_IsString(mode) && strcmp(mode->valuestring, "coalesce") == 0) {
+            set_schedule_mode(SCHEDULE_MODE_COALESCE, "json_line", -1);
+            return;
+        }
+        if (cJSON_IsString(mode) && strcmp(mode->valuestring, "fifo") == 0) {
+            set_schedule_mode(SCHEDULE_MODE_FIFO, "json_line", -1);
+            return;
+        }
+        send_status(ACK_BAD_PAYLOAD, "json_line", -1);
+        return;
+    }
+    if (strcmp(name, "baud") == 0) {
+        const cJSON* rate = cJSON_GetObjectItemCaseSensitive(json, "rate");
+        if (!cJSON_IsNumber(rate) || rate->valuedouble <= 0) {
+            send_status(ACK_BAD_PAYLOAD, "json_line", -1);
+            return;
+        }
+        set_baud_rate((uint32_t)rate->valuedouble, "json_line", -1);
+        return;
+    }
+    if (strcmp(name, "ping") == 0) {
+        send_status(ACK_PONG, "json_line", -1);
+        return;
+    }
+    if (strcmp(name, "cancel") == 0) {
+        cancel_orders("json_line", -1);
+        return;
+    }
+    if (strcmp(name, "estop") == 0) {
+        // {"cmd":"estop"} engages, {"cmd":"estop","release":true} releases.
+        set_estop(!cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(json, "release")), "json_line", -1);
+        return;
+    }
+    if (strcmp(name, "hello") == 0) {
+        send_hello("json_line", -1);
+        return;
+    }
+    if (strcmp(name, "map") == 0) {
+        // {"cmd":"map","channel":1..N,"name":"Aspirin"}; "name":"" restores the default.
+        const cJSON* channel = cJSON_GetObjectItemCaseSensitive(json, "channel");
+        const cJSON* pill = cJSON_GetObjectItemCaseSensitive(json, "name");
+        if (!cJSON_IsNumber(channel) || !cJSON_IsString(pill) ||
+            !channel_map_set(channel->valueint - 1, pill->valuestring, strlen(pill->valuestring))) {
+            send_status(ACK_BAD_PAYLOAD, "json_line", -1);
+            return;
+        }
+        send_channel_map("json_line", -1);
+        return;
+    }
+    if (strcmp(name, "map_reset") == 0) {
+        bool ok = true;
+        for (int ch = 0; ch < DISPENSER_NUM_CHANNELS; ch++) {
+            ok = channel_map_set(ch, "", 0) && ok;
+        }
+        if (!ok) {
+            send_status(ACK_BAD_PAYLOAD, "json_line", -1);
+            return;
+        }
+        send_channel_map("json_line", -1);
+        return;
+    }
+    if (strcmp(name, "map_get") == 0) {
+        send_channel_map("json_line", -1);
+        return;
+    }
+    if (strcmp(name, "profile") == 0) {
+        if (!motion_profile_from_json(json)) {
+            send_status(ACK_BAD_PAYLOAD, "json_line", -1);
+            return;
+        }
+        send_motion_profiles("json_line", -1);
+        return;
+    }
+    if (strcmp(name, "profile_get") == 0) {
+        send_motion_profiles("json_line", -1);
+        return;
+    }
+    if (strcmp(name, "cal") == 0) {
+        // Rebuilds the channel's duty table (or moves the servo): never under a
+        // running order.
+        if (cmd_pool_available() != CMD_POOL_SIZE) {
+            send_status(ACK_BUSY, "json_line", -1);
+            return;
+        }
+        if (!servo_cal_from_json(json)) {
+            send_status(ACK_BAD_PAYLOAD, "json_line", -1);
+            return;
+        }
+        send_servo_cals("json_line", -1);
+        return;
+    }
+    if (strcmp(name, "cal_get") == 0) {
+        send_servo_cals("json_line", -1);
+        return;
+    }
+    if (strcmp(name, "stats") == 0) {
+        send_stats("json_line", -1, cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(json, "reset")));
+        return;
+    }
+    if (strcmp(name, "journal") == 0) {
+        send_journal("json_line", -1, cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(json, "clear")));
+        return;
+    }
+    if (strcmp(name, "ota_abort") == 0) {
+        ota_abort(OTA_SRC_UART);
+        send_ota_reply("json_line", -1, OTA_OK);
+        return;
+    }
+#if DISPENSER_OTA_WIFI
+    if (strcmp(name, "ota_url") == 0) {
+        // {"cmd":"ota_url","url":"https://...","size":N,"crc32":N,"hmac":"<64 hex>"}:
+        // "ota_ok" once the fetch is started; the result follows as an unsolicited
+        // {"status":"ota_ok"|"ota_error","protocol":"ota",...} (then a reboot).
+        const cJSON* url = cJSON_GetObjectItemCaseSensitive(json, "url");
+        const cJSON* size = cJSON_GetObjectItemCaseSensitive(json, "size");
+        const cJSON* crc = cJSON_GetObjectItemCaseSensitive(json, "crc32");
+        const cJSON* hmac = cJSON_GetObjectItemCaseSensitive(json, "hmac");
+        if (!cJSON_IsString(url) || !cJSON_IsNumber(size) || !cJSON_IsNumber(crc) || size->valuedouble <= 0 ||
+            !cJSON_IsString(hmac) || strlen(hmac->valuestring) != 2 * OTA_AUTH_TAG_LEN) {
+            send_status(ACK_BAD_PAYLOAD, "json_line", -1);
+            return;
+        }
+        if (cmd_pool_available() != CMD_POOL_SIZE ||
+            !ota_wifi_start(url->valuestring, (uint32_t)size->valuedouble, (uint32_t)crc->valuedouble,
+                            hmac->valuestring)) {
+            send_status(ACK_BUSY, "json_line", -1);
+            return;
+        }
+        send_ota_reply("json_line", -1, OTA_OK);
+        return;
+    }
+#endif
+    if (strcmp(name, "bench_json") == 0) {
+        const cJSON* iters = cJSON_GetObjectItemCaseSensitive(json, "iterations");
+        run_json_bench(cJSON_IsNumber(iters) ? iters->valueint : 0);
+        return;
+    }
+    send_status(ACK_BAD_OPCODE, "json_line", -1);
+}
+
+void handle_json_command_line(const char* line, size_t len) {
+    dispense_cmd_t cmd = { .protocol = "json_line", .seq = -1, .order = 0 };
+    if (!line) {
+        stats_inc(&stats.bad_json, 1);
+        send_ack(ACK_BAD_JSON, &cmd, -1);
+        return;
+    }
+
+    // Trim leading whitespace
+    while (len > 0 && (*line == ' ' || *line == '\t' || *line == '\r' || *line == '\n')) {
+        line++;
+        len--;
+    }
+    if (len == 0) {
+        return;
+    }
+
+    if (json_fast_parse_counts(line, len, cmd.counts)) {
+        uart_host_seen();
+        enqueue_dispense(&cmd);
+        return;
+    }
+
+    // Unusual shape (control command, escapes, floats) or garbage: let cJSON decide.
+    size_t arena_mark = json_arena_mark();
+    cJSON* json = cJSON_ParseWithLength(line, len);
+    if (!json) {
+        json_arena_release(arena_mark);
+        stats_inc(&stats.bad_json, 1);
+        send_ack(ACK_BAD_JSON, &cmd, -1);
+        return;
+    }
+
+    uart_host_seen();
+
+    const cJSON* control = cJSON_GetObjectItemCaseSensitive(json, "cmd");
+    if (cJSON_IsString(control)) {
+        handle_json_control(json, control->valuestring);
+        cJSON_Delete(json);
+        json_arena_release(arena_mark);
+        return;
+    }
+
+    json_counts_from_tree(json, cmd.counts);
+    cJSON_Delete(json);
+    json_arena_release(arena_mark);
+
+    enqueue_dispense(&cmd);
+}
+
+// The host states how many channels each order carries; orders narrower than
+// the build's DISPENSER_NUM_CHANNELS leave the remaining channels at zero.
+static void handle_v2_dispense_batch(uint16_t seq, const uint8_t* payload, size_t len) {
+    if (len < 2 || payload[0] == 0 || payload[0] > V2_MAX_BATCH_ORDERS ||
+        payload[1] == 0 || payload[1] > DISPENSER_NUM_CHANNELS ||
+        len != 2 + (size_t)payload[0] * payload[1]) {
+        send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+        return;
+    }
+
+    // Accept all orders of a batch or none, so the host never has to work out
+    // which half of a batch made it. A coalesced run holds up to CMD_POOL_SIZE
+    // orders outside the queue, so queue space alone does not guarantee a pool
+    // object for each; uart_task is the only allocator, so neither can shrink
+    // before the loop below. The orders' final ACKs are reserved here as well.
+    uint8_t n_orders = payload[0];
+    uint8_t n_channels = payload[1];
+    if (estop_latched) {
+        send_status(ACK_ESTOP, "SAURON_UART_V2", seq);
+        return;
+    }
+    if (uxQueueSpacesAvailable(cmd_queue) < n_orders || cmd_pool_available() < n_orders || ota_in_progress() ||
+        !tx_reserve_finals(n_orders)) {
+        send_status(ACK_BUSY, "SAURON_UART_V2", seq);
+        return;
+    }
+
+    for (uint8_t o = 0; o < n_orders; o++) {
+        dispense_cmd_t cmd = { .protocol = "SAURON_UART_V2", .seq = seq, .order = o, .tx_reserved = true };
+        for (int ch = 0; ch < n_channels; ch++) {
+            int count = payload[2 + o * n_channels + ch];
+            cmd.counts[ch] = count > MAX_PILLS_PER_CHANNEL ? MAX_PILLS_PER_CHANNEL : count;
+        }
+        enqueue_dispense(&cmd);
+    }
+}
+
+static inline uint32_t v2_u32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void handle_v2_frame(uint16_t seq, uint8_t opcode, const uint8_t* payload, size_t len) {
+    uart_host_seen();
+
+    switch (opcode) {
+    case V2_OP_DISPENSE_BATCH:
+        handle_v2_dispense_batch(seq, payload, len);
+        break;
+    case V2_OP_PING:
+        send_status(ACK_PONG, "SAURON_UART_V2", seq);
+        break;
+    case V2_OP_CANCEL:
+        cancel_orders("SAURON_UART_V2", seq);
+        break;
+    case V2_OP_ESTOP:
+        if (len > 1) {
+            send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+            break;
+        }
+        set_estop(!(len == 1 && (payload[0] & 0x01)), "SAURON_UART_V2", seq);
+        break;
+    case V2_OP_SET_ACK_MODE:
+        if (len != 1 || payload[0] > ACK_MODE_BINARY) {
+            send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+            break;
+        }
+        set_ack_mode((ack_mode_t)payload[0], "SAURON_UART_V2", seq);
+        break;
+    case V2_OP_SET_CYCLE_MODE:
+        if (len != 1 || payload[0] > CYCLE_MODE_PIPELINED) {
+            send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+            break;
+        }
+        set_cycle_mode((cycle_mode_t)payload[0], "SAURON_UART_V2", seq);
+        break;
+    case V2_OP_SET_SCHEDULE:
+        if (len != 1 || payload[0] > SCHEDULE_MODE_COALESCE) {
+            send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+            break;
+        }
+        set_schedule_mode((schedule_mode_t)payload[0], "SAURON_UART_V2", seq);
+        break;
+    case V2_OP_GET_STATS:
+        if (len > 1) {
+            send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+            break;
+        }
+        send_stats("SAURON_UART_V2", seq, len == 1 && (payload[0] & 0x01));
+        break;
+    case V2_OP_HELLO:
+        send_hello("SAURON_UART_V2", seq);
+        break;
+    case V2_OP_GET_JOURNAL:
+        if (len > 1) {
+            send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+            break;
+        }
+        send_journal("SAURON_UART_V2", seq, len == 1 && (payload[0] & 0x01));
+        break;
+    case V2_OP_SET_CHANNEL_NAME:
+        if (len < 1 || !channel_map_set((int)payload[0] - 1, (const char*)&payload[1], len - 1)) {
+            send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+            break;
+        }
+        send_channel_map("SAURON_UART_V2", seq);
+        break;
+    case V2_OP_SET_PROFILE: {
+        if (len != 1 && len != 1 + V2_PROFILE_PAYLOAD_LEN) {
+            send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+            break;
+        }
+        motion_profile_t p = {0};
+        if (len > 1) {
+            p = (motion_profile_t){
+                .shape = payload[1],
+                .travel_deg = payload[2],
+                .vmax_dps = (uint16_t)(payload[3] | (payload[4] << 8)),
+                .accel_dps2 = (uint16_t)(payload[5] | (payload[6] << 8)),
+                .dwell_ms = (uint16_t)(payload[7] | (payload[8] << 8)),
+                .pause_ms = (uint16_t)(payload[9] | (payload[10] << 8)),
+            };
+        }
+        if (!motion_profile_set((int)payload[0] - 1, len == 1 ? NULL : &p)) {
+            send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+            break;
+        }
+        send_motion_profiles("SAURON_UART_V2", seq);
+        break;
+    }
+    case V2_OP_SET_CALIBRATION:
+    case V2_OP_SERVO_PULSE: {
+        bool jog = opcode == V2_OP_SERVO_PULSE;
+        if (jog ? len != 3 : (len != 1 && len != 5)) {
+            send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+            break;
+        }
+        if (cmd_pool_available() != CMD_POOL_SIZE) {
+            send_status(ACK_BUSY, "SAURON_UART_V2", seq);
+            break;
+        }
+        int ch = (int)payload[0] - 1;
+        servo_cal_t c = {0};
+        if (len == 5) {
+            c.min_pulse_us = (uint16_t)(payload[1] | (payload[2] << 8));
+            c.max_pulse_us = (uint16_t)(payload[3] | (payload[4] << 8));
+        }
+        bool ok = jog ? servo_pulse_test(ch, (uint16_t)(payload[1] | (payload[2] << 8)))
+                      : servo_cal_set(ch, len == 1 ? NULL : &c);
+        if (!ok) {
+            send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+            break;
+        }
+        send_servo_cals("SAURON_UART_V2", seq);
+        break;
+    }
+    case V2_OP_OTA_BEGIN:
+        if (len != 8) {
+            send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+            break;
+        }
+        ota_begin_cmd(v2_u32(&payload[0]), v2_u32(&payload[4]), "SAURON_UART_V2", seq);
+        break;
+    case V2_OP_OTA_DATA:
+        if (len < 4) {
+            send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+            break;
+        }
+        send_ota_reply("SAURON_UART_V2", seq, ota_write(OTA_SRC_UART, v2_u32(payload), &payload[4], len - 4));
+        break;
+    case V2_OP_OTA_END:
+        if (len != OTA_AUTH_TAG_LEN) {
+            send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+            break;
+        }
+        ota_end_cmd(payload, "SAURON_UART_V2", seq);
+        break;
+    case V2_OP_OTA_ABORT:
+        ota_abort(OTA_SRC_UART);
+        send_ota_reply("SAURON_UART_V2", seq, OTA_OK);
+        break;
+    case V2_OP_SET_BAUD:
+        if (len != 4) {
+            send_status(ACK_BAD_PAYLOAD, "SAURON_UART_V2", seq);
+            break;
+        }
+        set_baud_rate(v2_u32(payload), "SAURON_UART_V2", seq);
+        break;
+    default:
+        send_status(ACK_BAD_OPCODE, "SAURON_UART_V2", seq);
+        break;
+    }
+}
+
+// Returns the number of bytes consumed (>0), 0 if more bytes are needed, or -1
+// if the bytes at frame[0] are not a valid frame (caller drops one and resyncs).
+int try_handle_sauron_frame(const uint8_t* frame, size_t len) {
+    if (!frame || len < 2) return 0;
+    if (frame[0] != UART_FRAME_START) return -1;
+
+    uint8_t ver = frame[1];
+    if (ver == UART_FRAME_VER_1) {
+        if (len < UART_FRAME_LEN_V1) return 0;
+        if (frame[UART_FRAME_LEN_V1 - 1] != UART_FRAME_END) return -1;
+
+        uint8_t checksum = (uint8_t)((frame[1] + frame[2] + frame[3] + frame[4] + frame[5]) & 0xFF);
+        if (checksum != frame[6]) {
+            stats_inc(&stats.checksum_failures, 1);
+            return -1;
+        }
+
+        // V1 always carries four counts; they map to the first four channels.
+        dispense_cmd_t cmd = { .protocol = "SAURON_UART_V1", .seq = -1, .order = 0 };
+        for (int ch = 0; ch < 4 && ch < DISPENSER_NUM_CHANNELS; ch++) {
+            cmd.counts[ch] = frame[2 + ch];
+        }
+        uart_host_seen();
+        enqueue_dispense(&cmd);
+        return UART_FRAME_LEN_V1;
+    }
+
+    if (ver != UART_FRAME_VER_2) return -1;
+    if (len < UART_FRAME_V2_HDR_LEN) return 0;
+
+    size_t payload_len = frame[5];
+    if (payload_len > UART_FRAME_V2_MAX_PAYLOAD) return -1;
+    size_t frame_len = payload_len + UART_FRAME_V2_OVERHEAD;
+    if (len < frame_len) return 0;
+    if (frame[frame_len - 1] != UART_FRAME_END) return -1;
+
+    uint16_t seq = (uint16_t)(frame[2] | (frame[3] << 8));
+    uint16_t crc = (uint16_t)(frame[6 + payload_len] | (frame[7 + payload_len] << 8));
+    if (crc16_ccitt(&frame[1], UART_FRAME_V2_HDR_LEN - 1 + payload_len) != crc) {
+        stats_inc(&stats.checksum_failures, 1);
+        // Framing looked right, so the seq is probably intact: NACK it so the host
+        // can retransmit at once instead of waiting for its ACK timeout.
+        send_status(ACK_BAD_CRC, "SAURON_UART_V2", seq);
+        return (int)frame_len;
+    }
+
+    handle_v2_frame(seq, frame[4], &frame[UART_FRAME_V2_HDR_LEN], payload_len);
+    return (int)frame_len;
+}
+
+// Parse as many complete messages as the ring holds.
+void rx_ring_parse(rx_ring_t* rx)
+{
+    while (rx_ring_len(rx) > 0) {
+        size_t avail = rx_ring_len(rx);
+
+        size_t window = avail < RX_VIEW_MAX ? avail : RX_VIEW_MAX;
+        const uint8_t* view = rx_ring_view(rx);
+
+        // Path A: binary frame (V1 or V2) starts with 0xAA
+        if (view[0] == UART_FRAME_START) {
+            int frame_result = try_handle_sauron_frame(view, window);
+            if (frame_result == 0) {
+                break; // wait for more bytes
+            }
+            if (frame_result > 0) {
+                rx_ring_consume(rx, (size_t)frame_result);
+                continue;
+            }
+            // Invalid frame start or bad checksum/version/end; drop one byte and resync.
+            stats_inc(&stats.resync_bytes, 1);
+            rx_ring_consume(rx, 1);
+            continue;
+        }
+
+        // Path B: newline-delimited JSON (legacy compatibility).
+        const uint8_t* newline = (const uint8_t*)memchr(view, '\n', window);
+        if (!newline) {
+            if (window == RX_VIEW_MAX) {
+                // Over-long line: it could never be parsed, so reject and skip it.
+                stats_inc(&stats.bad_json, 1);
+                stats_inc(&stats.resync_bytes, RX_VIEW_MAX);
+                send_status(ACK_BAD_JSON, "json_line", -1);
+                rx_ring_consume(rx, RX_VIEW_MAX);
+                continue;
+            }
+            // No newline yet. Drop leading non-JSON noise to avoid buffer clogging.
+            if (view[0] != '{' && view[0] != ' ' && view[0] != '\t' && view[0] != '\r') {
+                stats_inc(&stats.resync_bytes, 1);
+                rx_ring_consume(rx, 1);
+                continue;
+            }
+            break;
+        }
+        // Noise in front of a binary frame whose seq or CRC holds a '\n' byte would
+        // otherwise take the frame down with it as one bad line.
+        if (view[0] != '{' && view[0] != ' ' && view[0] != '\t' && view[0] != '\r') {
+            const uint8_t* start = (const uint8_t*)memchr(view, UART_FRAME_START, (size_t)(newline - view));
+            if (start) {
+                stats_inc(&stats.resync_bytes, (unsigned)(start - view));
+                rx_ring_consume(rx, (size_t)(start - view));
+                continue;
+            }
+        }
+
+        // Consume line (+ newline) before handling to keep parser state simple;
+        // the view stays valid until the next read refills the ring.
+        size_t line_len = (size_t)(newline - view);
+        rx_ring_consume(rx, line_len + 1);
+        handle_json_command_line((const char*)view, line_len);
+    }
+}
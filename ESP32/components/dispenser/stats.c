@@ -0,0 +1,40 @@
+#include "dispenser_internal.h"
+
+dispenser_stats_t stats;
+
+void stats_hist_record(stats_hist_t* h, int64_t us) {
+    uint32_t v = us <= 0 ? 0 : us >= UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+    int b = v ? 32 - __builtin_clz(v) : 0;
+    if (b >= STATS_HIST_BUCKETS) b = STATS_HIST_BUCKETS - 1;
+    atomic_fetch_add_explicit(&h->buckets[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    unsigned max = atomic_load_explicit(&h->max_us, memory_order_relaxed);
+    while (v > max && !atomic_compare_exchange_weak_explicit(&h->max_us, &max, v, memory_order_relaxed,
+                                                             memory_order_relaxed)) {
+    }
+}
+
+static void stats_hist_reset(stats_hist_t* h) {
+    atomic_store_explicit(&h->count, 0, memory_order_relaxed);
+    atomic_store_explicit(&h->max_us, 0, memory_order_relaxed);
+    for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+        atomic_store_explicit(&h->buckets[b], 0, memory_order_relaxed);
+    }
+}
+
+void stats_reset(void) {
+    atomic_store_explicit(&stats.rx_bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats.orders, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats.resync_bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats.checksum_failures, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats.bad_json, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats.rx_overflows, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats.log_drops, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats.tx_drops, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats.tx_final_drops, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats.json_oom, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats.cancelled, 0, memory_order_relaxed);
+    stats_hist_reset(&stats.latency);
+    stats_hist_reset(&stats.cycle);
+    stats_hist_reset(&stats.command);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT     (1 << 2)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_DEFAULT  (1 << 12)
+
+// The firmware never allocates after boot and the simulator has no ESP32 heap
+// to measure, so these report a fixed SIM_HEAP_SIZE: a soak still sees any
+// change the firmware itself reports, but not the real headroom.
+#define SIM_HEAP_SIZE (200 * 1024)
+
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_minimum_free_size(uint32_t caps);
+size_t heap_caps_get_largest_free_block(uint32_t caps);
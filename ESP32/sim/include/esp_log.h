@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stdint.h>
+
+typedef enum {
+    ESP_LOG_NONE = 0,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE,
+} esp_log_level_t;
+
+typedef int (*vprintf_like_t)(const char* fmt, va_list args);
+
+// Like ESP-IDF: one level for every tag ("*") and a replaceable sink, which
+// defaults to stderr.
+void esp_log_level_set(const char* tag, esp_log_level_t level);
+vprintf_like_t esp_log_set_vprintf(vprintf_like_t func);
+uint32_t esp_log_timestamp(void);
+void esp_log_write(esp_log_level_t level, const char* tag, const char* fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#define ESP_LOG_SIM(level, letter, tag, fmt, ...) \
+    esp_log_write(level, tag, letter " (%u) %s: " fmt "\n", (unsigned)esp_log_timestamp(), tag, ##__VA_ARGS__)
+#define ESP_LOGE(tag, fmt, ...) ESP_LOG_SIM(ESP_LOG_ERROR, "E", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) ESP_LOG_SIM(ESP_LOG_WARN, "W", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) ESP_LOG_SIM(ESP_LOG_INFO, "I", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) ESP_LOG_SIM(ESP_LOG_DEBUG, "D", tag, fmt, ##__VA_ARGS__)
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+
+// CRC-32 (IEEE, reflected), chainable: esp_rom_crc32_le(0, ...) on the whole
+// image equals zlib.crc32().
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const* buf, uint32_t len);
@@ -0,0 +1,39 @@
+#pragma once
+
+// Host simulator: FreeRTOS on POSIX threads. Every task is a thread; priorities
+// and core affinity are accepted and ignored, so the simulator checks protocol
+// behaviour and throughput under real concurrency, not scheduling order.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_attr.h"
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint8_t StackType_t; // ESP-IDF sizes stacks in bytes
+
+#define configTICK_RATE_HZ 100 // ESP-IDF default (CONFIG_FREERTOS_HZ)
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms)  ((TickType_t)(((uint64_t)(ms) * configTICK_RATE_HZ) / 1000))
+#define portMAX_DELAY      ((TickType_t)0xffffffffUL)
+#define portNUM_PROCESSORS 2
+
+#define pdFALSE 0
+#define pdTRUE  1
+#define pdFAIL  pdFALSE
+#define pdPASS  pdTRUE
+
+// Critical sections are a (recursive) mutex: there are no interrupts to mask.
+typedef struct {
+    pthread_mutex_t mutex;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP }
+#define portENTER_CRITICAL(mux)     pthread_mutex_lock(&(mux)->mutex)
+#define portEXIT_CRITICAL(mux)      pthread_mutex_unlock(&(mux)->mutex)
+#define portENTER_CRITICAL_ISR(mux) portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_ISR(mux)  portEXIT_CRITICAL(mux)
+#define portYIELD_FROM_ISR(woken)   ((void)(woken))
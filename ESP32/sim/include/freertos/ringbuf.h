@@ -0,0 +1,22 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+// Byte buffers only (RINGBUF_TYPE_BYTEBUF), which is all the firmware uses.
+typedef struct sim_ringbuf* RingbufHandle_t;
+typedef struct {
+    int unused;
+} StaticRingbuffer_t;
+
+typedef enum {
+    RINGBUF_TYPE_NOSPLIT = 0,
+    RINGBUF_TYPE_ALLOWSPLIT,
+    RINGBUF_TYPE_BYTEBUF,
+} RingbufferType_t;
+
+RingbufHandle_t xRingbufferCreateStatic(size_t size, RingbufferType_t type, uint8_t* storage,
+                                        StaticRingbuffer_t* ringbuf);
+BaseType_t xRingbufferSend(RingbufHandle_t rb, const void* data, size_t size, TickType_t ticks);
+void* xRingbufferReceiveUpTo(RingbufHandle_t rb, size_t* size, TickType_t ticks, size_t max_size);
+void vRingbufferReturnItem(RingbufHandle_t rb, void* item);
+size_t xRingbufferGetCurFreeSize(RingbufHandle_t rb);
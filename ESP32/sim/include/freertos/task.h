@@ -0,0 +1,35 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct sim_task* TaskHandle_t;
+typedef struct {
+    int unused;
+} StaticTask_t;
+typedef void (*TaskFunction_t)(void*);
+
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+typedef enum {
+    eNoAction = 0,
+    eSetBits,
+    eIncrement,
+    eSetValueWithOverwrite,
+    eSetValueWithoutOverwrite,
+} eNotifyAction;
+
+// The thread gets its own stack sized for the host (glibc's printf alone needs
+// more than some firmware tasks have); the firmware's static buffer is unused.
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t fn, const char* name, uint32_t stack_bytes, void* arg,
+                                           UBaseType_t priority, StackType_t* stack, StaticTask_t* tcb,
+                                           BaseType_t core);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+// Twice the firmware's stack size (host frames are deeper) minus what the
+// task's larger, painted host stack has used so far: it tracks stack growth
+// over a soak, while the ESP32's exact headroom differs with compiler and ABI.
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action);
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit, uint32_t* value, TickType_t ticks);
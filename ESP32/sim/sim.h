@@ -0,0 +1,35 @@
+#pragma once
+
+// Shared between the simulator's translation units.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+
+typedef struct {
+    char** argv;           // for esp_restart()
+    const char* nvs_path;  // NULL = NVS lives in memory only
+    const char* pty_link;  // symlink to the UART0 pty, or NULL
+    double drop_miss;      // probability that a drop sensor misses a pill
+    unsigned seed;
+} sim_options_t;
+
+extern sim_options_t sim_options;
+
+// Monotonic time since this boot of the simulator.
+int64_t sim_now_us(void);
+void sim_sleep_until_us(int64_t when_us);
+// Condition variables on the monotonic clock, and deadlines for them.
+void sim_cond_init(pthread_cond_t* cond);
+struct timespec sim_deadline_us(int64_t when_us);
+// Absolute deadline for a FreeRTOS tick timeout; INT64_MAX for portMAX_DELAY.
+int64_t sim_ticks_deadline_us(TickType_t ticks);
+// Waits on cond (mutex held) until signalled or deadline_us; false on timeout.
+bool sim_cond_wait_until(pthread_cond_t* cond, pthread_mutex_t* mutex, int64_t deadline_us);
+
+// UART0 pseudo-terminal: a new one on power-on, the same one after esp_restart().
+void sim_uart_attach(void);
+// The pty's file descriptors, kept open across esp_restart().
+void sim_uart_fds(int* master, int* slave);
@@ -0,0 +1,107 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "driver/gpio.h"
+#include "driver/ledc.h"
+#include "sim.h"
+
+// LEDC duties drive the simulated drop sensors: a channel whose duty moves a
+// 300 us pulse or more away from where it was configured (home) has swung out
+// far enough to drop a pill, and its sensor fires once, unless --drop-miss says
+// this pill goes unseen. Back near home re-arms it. Duty 0 is a detached servo.
+
+#define SIM_LEDC_SLOTS (LEDC_SPEED_MODE_MAX * LEDC_CHANNEL_MAX)
+#define SIM_DROP_DUTY  ((300u * 65535u) / 20000u)
+
+typedef struct {
+    uint32_t duty;
+    uint32_t pending;
+    uint32_t home;
+    bool armed;
+    gpio_isr_t isr;
+    void* isr_arg;
+} sim_ledc_slot_t;
+
+static sim_ledc_slot_t slots[SIM_LEDC_SLOTS];
+static pthread_mutex_t hw_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static sim_ledc_slot_t* slot_for(ledc_mode_t mode, ledc_channel_t channel) {
+    if ((int)mode < 0 || mode >= LEDC_SPEED_MODE_MAX || channel < 0 || channel >= LEDC_CHANNEL_MAX) return NULL;
+    return &slots[mode * LEDC_CHANNEL_MAX + channel];
+}
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t* config) {
+    return config && config->freq_hz ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t ledc_channel_config(const ledc_channel_config_t* config) {
+    sim_ledc_slot_t* s = config ? slot_for(config->speed_mode, config->channel) : NULL;
+    if (!s) return ESP_ERR_INVALID_ARG;
+    pthread_mutex_lock(&hw_lock);
+    s->duty = s->pending = s->home = config->duty;
+    s->armed = true;
+    pthread_mutex_unlock(&hw_lock);
+    return ESP_OK;
+}
+
+esp_err_t ledc_set_duty(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty) {
+    sim_ledc_slot_t* s = slot_for(mode, channel);
+    if (!s) return ESP_ERR_INVALID_ARG;
+    pthread_mutex_lock(&hw_lock);
+    s->pending = duty;
+    pthread_mutex_unlock(&hw_lock);
+    return ESP_OK;
+}
+
+static bool drop_missed(void) {
+    static unsigned state;
+    static bool seeded;
+    if (sim_options.drop_miss <= 0.0) return false;
+    if (!seeded) {
+        state = sim_options.seed;
+        seeded = true;
+    }
+    return (double)rand_r(&state) / RAND_MAX < sim_options.drop_miss;
+}
+
+esp_err_t ledc_update_duty(ledc_mode_t mode, ledc_channel_t channel) {
+    sim_ledc_slot_t* s = slot_for(mode, channel);
+    if (!s) return ESP_ERR_INVALID_ARG;
+    gpio_isr_t fire = NULL;
+    void* arg = NULL;
+    pthread_mutex_lock(&hw_lock);
+    s->duty = s->pending;
+    if (s->duty != 0) {
+        uint32_t swing = s->duty > s->home ? s->duty - s->home : s->home - s->duty;
+        if (s->armed && swing >= SIM_DROP_DUTY) {
+            s->armed = false;
+            if (s->isr && !drop_missed()) {
+                fire = s->isr;
+                arg = s->isr_arg;
+            }
+        } else if (swing < SIM_DROP_DUTY / 2) {
+            s->armed = true;
+        }
+    }
+    pthread_mutex_unlock(&hw_lock);
+    if (fire) fire(arg);
+    return ESP_OK;
+}
+
+esp_err_t gpio_config(const gpio_config_t* config) {
+    return config ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags) {
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t pin, gpio_isr_t isr, void* arg) {
+    intptr_t idx = (intptr_t)arg;
+    if (idx < 0 || idx >= SIM_LEDC_SLOTS) return ESP_ERR_INVALID_ARG;
+    pthread_mutex_lock(&hw_lock);
+    slots[idx].isr = isr;
+    slots[idx].isr_arg = arg;
+    pthread_mutex_unlock(&hw_lock);
+    return ESP_OK;
+}
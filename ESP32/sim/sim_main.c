@@ -0,0 +1,76 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "dispenser.h"
+#include "esp_system.h"
+#include "sim.h"
+
+// The dispenser firmware as a host process: UART0 on a pseudo-terminal the host
+// tools open like the board's serial port, NVS and OTA state in a file, servos
+// and drop sensors simulated. See "Host Simulator" in the README.
+
+sim_options_t sim_options = {
+    .nvs_path = "dispenser_sim.nvs",
+};
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [--link PATH] [--nvs PATH | --no-nvs] [--erase-nvs] [--drop-miss P] [--seed N]\n"
+            "  --link PATH    symlink PATH to the UART0 pty (e.g. /tmp/dispenser)\n"
+            "  --nvs PATH     NVS file (default dispenser_sim.nvs)\n"
+            "  --no-nvs       keep NVS in memory only\n"
+            "  --erase-nvs    start from empty NVS (power-on only, not on esp_restart)\n"
+            "  --drop-miss P  probability that a drop sensor misses a pill (needs DISPENSER_DROP_SENSORS)\n"
+            "  --seed N       seed for esp_random and missed drops\n",
+            prog);
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        {"link", required_argument, NULL, 'l'},
+        {"nvs", required_argument, NULL, 'n'},
+        {"no-nvs", no_argument, NULL, 'N'},
+        {"erase-nvs", no_argument, NULL, 'e'},
+        {"drop-miss", required_argument, NULL, 'm'},
+        {"seed", required_argument, NULL, 's'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    bool erase = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 'l':
+            sim_options.pty_link = optarg;
+            break;
+        case 'n':
+            sim_options.nvs_path = optarg;
+            break;
+        case 'N':
+            sim_options.nvs_path = NULL;
+            break;
+        case 'e':
+            erase = true;
+            break;
+        case 'm':
+            sim_options.drop_miss = atof(optarg);
+            break;
+        case 's':
+            sim_options.seed = (unsigned)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    sim_options.argv = argv;
+
+    bool power_on = esp_reset_reason() == ESP_RST_POWERON;
+    if (power_on && erase && sim_options.nvs_path) remove(sim_options.nvs_path);
+    sim_uart_attach();
+    if (!power_on) fprintf(stderr, "dispenser_sim: restarted\n");
+
+    dispenser_start();
+    for (;;) pause();
+}
@@ -0,0 +1,263 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "sim.h"
+
+// NVS as a list of entries in memory, saved whole to the --nvs file on every
+// commit (written aside and renamed, so a killed simulator never leaves half a
+// file) and read back at nvs_flash_init. Names are limited to 15 characters
+// like the real thing.
+
+#define SIM_NVS_NAME_MAX 16
+#define SIM_NVS_HANDLES  32
+#define SIM_NVS_MAGIC    "dispenser-sim-nvs 1\n"
+
+typedef enum { SIM_NVS_STR = 1, SIM_NVS_BLOB = 2 } sim_nvs_type_t;
+
+typedef struct sim_nvs_entry {
+    char ns[SIM_NVS_NAME_MAX];
+    char key[SIM_NVS_NAME_MAX];
+    uint8_t type;
+    uint32_t len;
+    uint8_t* data;
+    struct sim_nvs_entry* next;
+} sim_nvs_entry_t;
+
+typedef struct {
+    bool open;
+    bool writable;
+    char ns[SIM_NVS_NAME_MAX];
+} sim_nvs_handle_t;
+
+static pthread_mutex_t nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_nvs_entry_t* entries;
+static sim_nvs_handle_t handles[SIM_NVS_HANDLES]; // nvs_handle_t is index + 1
+static bool nvs_ready;
+
+static bool name_valid(const char* name) {
+    return name && name[0] && strlen(name) < SIM_NVS_NAME_MAX;
+}
+
+static sim_nvs_entry_t** entry_find(const char* ns, const char* key) {
+    sim_nvs_entry_t** e = &entries;
+    while (*e && (strcmp((*e)->ns, ns) != 0 || strcmp((*e)->key, key) != 0)) e = &(*e)->next;
+    return e;
+}
+
+static void entries_free(void) {
+    while (entries) {
+        sim_nvs_entry_t* next = entries->next;
+        free(entries->data);
+        free(entries);
+        entries = next;
+    }
+}
+
+static esp_err_t nvs_save(void) {
+    if (!sim_options.nvs_path) return ESP_OK;
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", sim_options.nvs_path);
+    FILE* f = fopen(tmp, "wb");
+    if (!f) return ESP_FAIL;
+    bool ok = fputs(SIM_NVS_MAGIC, f) >= 0;
+    for (sim_nvs_entry_t* e = entries; e && ok; e = e->next) {
+        ok = fwrite(e->ns, sizeof(e->ns), 1, f) == 1 && fwrite(e->key, sizeof(e->key), 1, f) == 1 &&
+             fwrite(&e->type, 1, 1, f) == 1 && fwrite(&e->len, sizeof(e->len), 1, f) == 1 &&
+             (e->len == 0 || fwrite(e->data, e->len, 1, f) == 1);
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, sim_options.nvs_path) != 0) {
+        remove(tmp);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static void nvs_load(void) {
+    entries_free();
+    FILE* f = sim_options.nvs_path ? fopen(sim_options.nvs_path, "rb") : NULL;
+    if (!f) return;
+    char magic[sizeof(SIM_NVS_MAGIC)] = {0};
+    if (fread(magic, 1, strlen(SIM_NVS_MAGIC), f) != strlen(SIM_NVS_MAGIC) || strcmp(magic, SIM_NVS_MAGIC) != 0) {
+        fprintf(stderr, "dispenser_sim: %s is not an NVS file, starting empty\n", sim_options.nvs_path);
+        fclose(f);
+        return;
+    }
+    sim_nvs_entry_t** tail = &entries;
+    for (;;) {
+        sim_nvs_entry_t* e = calloc(1, sizeof(*e));
+        if (!e) abort();
+        if (fread(e->ns, sizeof(e->ns), 1, f) != 1 || fread(e->key, sizeof(e->key), 1, f) != 1 ||
+            fread(&e->type, 1, 1, f) != 1 || fread(&e->len, sizeof(e->len), 1, f) != 1 ||
+            !(e->data = malloc(e->len ? e->len : 1)) || (e->len && fread(e->data, e->len, 1, f) != 1)) {
+            free(e->data);
+            free(e);
+            break;
+        }
+        e->ns[SIM_NVS_NAME_MAX - 1] = e->key[SIM_NVS_NAME_MAX - 1] = '\0';
+        *tail = e;
+        tail = &e->next;
+    }
+    fclose(f);
+}
+
+esp_err_t nvs_flash_init(void) {
+    pthread_mutex_lock(&nvs_lock);
+    if (!nvs_ready) nvs_load();
+    nvs_ready = true;
+    pthread_mutex_unlock(&nvs_lock);
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void) {
+    pthread_mutex_lock(&nvs_lock);
+    entries_free();
+    esp_err_t err = nvs_save();
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+static sim_nvs_handle_t* handle_get(nvs_handle_t handle) {
+    if (handle == 0 || handle > SIM_NVS_HANDLES || !handles[handle - 1].open) return NULL;
+    return &handles[handle - 1];
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t mode, nvs_handle_t* out) {
+    if (!name_valid(name)) return ESP_ERR_NVS_INVALID_NAME;
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+    pthread_mutex_lock(&nvs_lock);
+    if (!nvs_ready) {
+        err = ESP_ERR_NVS_NOT_INITIALIZED;
+        goto out;
+    }
+    if (mode == NVS_READONLY) {
+        // As on the board, a namespace only exists once something was written to it.
+        sim_nvs_entry_t* e = entries;
+        while (e && strcmp(e->ns, name) != 0) e = e->next;
+        if (!e) goto out;
+    }
+    err = ESP_FAIL;
+    for (int i = 0; i < SIM_NVS_HANDLES; i++) {
+        if (handles[i].open) continue;
+        handles[i].open = true;
+        handles[i].writable = mode == NVS_READWRITE;
+        snprintf(handles[i].ns, sizeof(handles[i].ns), "%s", name);
+        *out = (nvs_handle_t)(i + 1);
+        err = ESP_OK;
+        break;
+    }
+out:
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+void nvs_close(nvs_handle_t handle) {
+    pthread_mutex_lock(&nvs_lock);
+    sim_nvs_handle_t* h = handle_get(handle);
+    if (h) h->open = false;
+    pthread_mutex_unlock(&nvs_lock);
+}
+
+static esp_err_t entry_get(nvs_handle_t handle, const char* key, uint8_t type, void* out, size_t* length) {
+    if (!key || !length) return ESP_ERR_INVALID_ARG;
+    esp_err_t err = ESP_OK;
+    pthread_mutex_lock(&nvs_lock);
+    sim_nvs_handle_t* h = handle_get(handle);
+    sim_nvs_entry_t* e = h ? *entry_find(h->ns, key) : NULL;
+    if (!h) {
+        err = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (!e || e->type != type) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else if (!out) {
+        *length = e->len;
+    } else if (*length < e->len) {
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    } else {
+        memcpy(out, e->data, e->len);
+        *length = e->len;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+static esp_err_t entry_set(nvs_handle_t handle, const char* key, uint8_t type, const void* value, size_t length) {
+    if (!name_valid(key)) return ESP_ERR_NVS_INVALID_NAME;
+    if (!value && length) return ESP_ERR_INVALID_ARG;
+    uint8_t* data = malloc(length ? length : 1);
+    if (!data) return ESP_ERR_NO_MEM;
+    if (length) memcpy(data, value, length);
+
+    esp_err_t err = ESP_OK;
+    pthread_mutex_lock(&nvs_lock);
+    sim_nvs_handle_t* h = handle_get(handle);
+    if (!h) {
+        err = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (!h->writable) {
+        err = ESP_ERR_NVS_READ_ONLY;
+    } else {
+        sim_nvs_entry_t** slot = entry_find(h->ns, key);
+        if (!*slot) {
+            *slot = calloc(1, sizeof(**slot));
+            if (!*slot) abort();
+            snprintf((*slot)->ns, sizeof((*slot)->ns), "%s", h->ns);
+            snprintf((*slot)->key, sizeof((*slot)->key), "%s", key);
+        }
+        free((*slot)->data);
+        (*slot)->type = type;
+        (*slot)->len = (uint32_t)length;
+        (*slot)->data = data;
+        data = NULL;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    free(data);
+    return err;
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char* key, char* out, size_t* length) {
+    return entry_get(handle, key, SIM_NVS_STR, out, length);
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char* key, const char* value) {
+    if (!value) return ESP_ERR_INVALID_ARG;
+    return entry_set(handle, key, SIM_NVS_STR, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out, size_t* length) {
+    return entry_get(handle, key, SIM_NVS_BLOB, out, length);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length) {
+    return entry_set(handle, key, SIM_NVS_BLOB, value, length);
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key) {
+    if (!key) return ESP_ERR_INVALID_ARG;
+    esp_err_t err = ESP_OK;
+    pthread_mutex_lock(&nvs_lock);
+    sim_nvs_handle_t* h = handle_get(handle);
+    sim_nvs_entry_t** slot = h ? entry_find(h->ns, key) : NULL;
+    if (!h) {
+        err = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (!h->writable) {
+        err = ESP_ERR_NVS_READ_ONLY;
+    } else if (!*slot) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else {
+        sim_nvs_entry_t* e = *slot;
+        *slot = e->next;
+        free(e->data);
+        free(e);
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    pthread_mutex_lock(&nvs_lock);
+    esp_err_t err = handle_get(handle) ? nvs_save() : ESP_ERR_NVS_INVALID_HANDLE;
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
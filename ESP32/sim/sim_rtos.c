@@ -0,0 +1,398 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/ringbuf.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sim.h"
+
+// FreeRTOS on POSIX threads: tasks, direct-to-task notifications, queues, byte
+// ring buffers and mutexes, each one a pthread mutex plus a condition variable
+// on the monotonic clock.
+
+#define SIM_STACK_MIN   (256 * 1024)
+#define SIM_STACK_PAINT 0xA5
+// x86-64 frames and glibc's stdio take about twice the stack of Xtensa and
+// newlib, so headroom is reported against twice the firmware's stack size.
+#define SIM_STACK_HOST_FACTOR 2
+
+static struct timespec sim_boot;
+
+static void __attribute__((constructor)) sim_clock_init(void) {
+    clock_gettime(CLOCK_MONOTONIC, &sim_boot);
+}
+
+int64_t sim_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)(ts.tv_sec - sim_boot.tv_sec) * 1000000 + (ts.tv_nsec - sim_boot.tv_nsec) / 1000;
+}
+
+struct timespec sim_deadline_us(int64_t when_us) {
+    int64_t ns = (int64_t)sim_boot.tv_nsec + (when_us % 1000000) * 1000;
+    struct timespec ts = {
+        .tv_sec = sim_boot.tv_sec + (time_t)(when_us / 1000000) + (time_t)(ns / 1000000000),
+        .tv_nsec = (long)(ns % 1000000000),
+    };
+    return ts;
+}
+
+void sim_sleep_until_us(int64_t when_us) {
+    struct timespec ts = sim_deadline_us(when_us);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+void sim_cond_init(pthread_cond_t* cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+int64_t sim_ticks_deadline_us(TickType_t ticks) {
+    if (ticks == portMAX_DELAY) return INT64_MAX;
+    return sim_now_us() + (int64_t)ticks * (1000000 / configTICK_RATE_HZ);
+}
+
+bool sim_cond_wait_until(pthread_cond_t* cond, pthread_mutex_t* mutex, int64_t deadline_us) {
+    if (deadline_us == INT64_MAX) {
+        pthread_cond_wait(cond, mutex);
+        return true;
+    }
+    if (sim_now_us() >= deadline_us) return false;
+    struct timespec ts = sim_deadline_us(deadline_us);
+    return pthread_cond_timedwait(cond, mutex, &ts) != ETIMEDOUT;
+}
+
+// --- Tasks ---------------------------------------------------------------
+
+struct sim_task {
+    pthread_t thread;
+    TaskFunction_t fn;
+    void* arg;
+    char name[16];
+    uint8_t* stack;
+    size_t stack_size;      // host stack
+    uint8_t* stack_entry;   // where fn's frames start (glibc keeps TLS above it)
+    uint32_t stack_budget;  // the firmware's, scaled to the host
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t notify_value;
+    bool notify_pending;
+};
+
+static __thread struct sim_task* sim_current_task;
+
+static struct sim_task* sim_task_new(const char* name) {
+    struct sim_task* t = calloc(1, sizeof(*t));
+    if (!t) abort();
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    pthread_mutex_init(&t->lock, NULL);
+    sim_cond_init(&t->cond);
+    return t;
+}
+
+static void* sim_task_entry(void* arg) {
+    struct sim_task* t = arg;
+    uint8_t here;
+    t->stack_entry = &here;
+    sim_current_task = t;
+    pthread_setname_np(pthread_self(), t->name);
+    t->fn(t->arg);
+    return NULL;
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t fn, const char* name, uint32_t stack_bytes, void* arg,
+                                           UBaseType_t priority, StackType_t* stack, StaticTask_t* tcb,
+                                           BaseType_t core) {
+    struct sim_task* t = sim_task_new(name);
+    t->fn = fn;
+    t->arg = arg;
+    t->stack_budget = stack_bytes * SIM_STACK_HOST_FACTOR;
+    t->stack_size = stack_bytes * 8 > SIM_STACK_MIN ? stack_bytes * 8 : SIM_STACK_MIN;
+    if (posix_memalign((void**)&t->stack, 64, t->stack_size) != 0) abort();
+    memset(t->stack, SIM_STACK_PAINT, t->stack_size);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, t->stack, t->stack_size);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&t->thread, &attr, sim_task_entry, t) != 0) abort();
+    pthread_attr_destroy(&attr);
+    return t;
+}
+
+// Threads the simulator starts on its own (the timer and UART threads, main)
+// get a handle the first time they ask for one.
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    if (!sim_current_task) sim_current_task = sim_task_new("sim");
+    return sim_current_task;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    sim_sleep_until_us(sim_ticks_deadline_us(ticks));
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t)(sim_now_us() / (1000000 / configTICK_RATE_HZ));
+}
+
+// Stacks grow down: the painted bytes left at the low end were never used.
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    struct sim_task* t = task ? task : xTaskGetCurrentTaskHandle();
+    if (!t->stack || !t->stack_entry) return 0;
+    size_t untouched = 0;
+    while (untouched < t->stack_size && t->stack[untouched] == SIM_STACK_PAINT) untouched++;
+    size_t used = (size_t)(t->stack_entry - (t->stack + untouched));
+    return used < t->stack_budget ? (UBaseType_t)(t->stack_budget - used) : 0;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action) {
+    BaseType_t ok = pdPASS;
+    pthread_mutex_lock(&task->lock);
+    switch (action) {
+    case eSetBits:
+        task->notify_value |= value;
+        break;
+    case eIncrement:
+        task->notify_value++;
+        break;
+    case eSetValueWithOverwrite:
+        task->notify_value = value;
+        break;
+    case eSetValueWithoutOverwrite:
+        if (task->notify_pending) {
+            ok = pdFAIL;
+        } else {
+            task->notify_value = value;
+        }
+        break;
+    default:
+        break;
+    }
+    task->notify_pending = true;
+    pthread_cond_broadcast(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+    return ok;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit, uint32_t* value, TickType_t ticks) {
+    struct sim_task* t = xTaskGetCurrentTaskHandle();
+    int64_t deadline = sim_ticks_deadline_us(ticks);
+    pthread_mutex_lock(&t->lock);
+    if (!t->notify_pending) t->notify_value &= ~clear_on_entry;
+    while (!t->notify_pending && sim_cond_wait_until(&t->cond, &t->lock, deadline)) {
+    }
+    BaseType_t got = t->notify_pending ? pdTRUE : pdFALSE;
+    if (value) *value = t->notify_value;
+    if (got) t->notify_value &= ~clear_on_exit;
+    t->notify_pending = false;
+    pthread_mutex_unlock(&t->lock);
+    return got;
+}
+
+// --- Queues ----------------------------------------------------------------
+
+struct sim_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t* storage;
+    size_t item_size;
+    size_t length;
+    size_t head;
+    size_t count;
+};
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size, uint8_t* storage, StaticQueue_t* queue) {
+    struct sim_queue* q = calloc(1, sizeof(*q));
+    if (!q) abort();
+    pthread_mutex_init(&q->lock, NULL);
+    sim_cond_init(&q->cond);
+    q->storage = storage;
+    q->item_size = item_size;
+    q->length = length;
+    return q;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    uint8_t* storage = malloc((size_t)length * item_size);
+    if (!storage) return NULL;
+    return xQueueCreateStatic(length, item_size, storage, NULL);
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void* item, TickType_t ticks) {
+    int64_t deadline = sim_ticks_deadline_us(ticks);
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->length && sim_cond_wait_until(&q->cond, &q->lock, deadline)) {
+    }
+    BaseType_t ok = q->count < q->length ? pdTRUE : pdFALSE;
+    if (ok) {
+        memcpy(q->storage + ((q->head + q->count) % q->length) * q->item_size, item, q->item_size);
+        q->count++;
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t q, const void* item, BaseType_t* woken) {
+    if (woken) *woken = pdFALSE;
+    return xQueueSend(q, item, 0);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void* item, TickType_t ticks) {
+    int64_t deadline = sim_ticks_deadline_us(ticks);
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && sim_cond_wait_until(&q->cond, &q->lock, deadline)) {
+    }
+    BaseType_t ok = q->count > 0 ? pdTRUE : pdFALSE;
+    if (ok) {
+        memcpy(item, q->storage + q->head * q->item_size, q->item_size);
+        q->head = (q->head + 1) % q->length;
+        q->count--;
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+    pthread_mutex_lock(&q->lock);
+    UBaseType_t n = (UBaseType_t)q->count;
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q) {
+    pthread_mutex_lock(&q->lock);
+    UBaseType_t n = (UBaseType_t)(q->length - q->count);
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+BaseType_t xQueueReset(QueueHandle_t q) {
+    pthread_mutex_lock(&q->lock);
+    q->head = 0;
+    q->count = 0;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    return pdPASS;
+}
+
+// --- Byte ring buffers -------------------------------------------------------
+
+// As in ESP-IDF, a byte buffer hands out one contiguous span at a time; the
+// next receive waits until it has been returned.
+struct sim_ringbuf {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t* storage;
+    size_t size;
+    size_t read;  // offset of the oldest byte
+    size_t used;  // bytes stored, including the span handed out
+    size_t held;  // bytes handed out and not yet returned
+};
+
+RingbufHandle_t xRingbufferCreateStatic(size_t size, RingbufferType_t type, uint8_t* storage,
+                                        StaticRingbuffer_t* ringbuf) {
+    if (type != RINGBUF_TYPE_BYTEBUF) return NULL;
+    struct sim_ringbuf* rb = calloc(1, sizeof(*rb));
+    if (!rb) abort();
+    pthread_mutex_init(&rb->lock, NULL);
+    sim_cond_init(&rb->cond);
+    rb->storage = storage;
+    rb->size = size;
+    return rb;
+}
+
+BaseType_t xRingbufferSend(RingbufHandle_t rb, const void* data, size_t size, TickType_t ticks) {
+    if (size > rb->size) return pdFALSE;
+    int64_t deadline = sim_ticks_deadline_us(ticks);
+    pthread_mutex_lock(&rb->lock);
+    while (rb->size - rb->used < size && sim_cond_wait_until(&rb->cond, &rb->lock, deadline)) {
+    }
+    BaseType_t ok = rb->size - rb->used >= size ? pdTRUE : pdFALSE;
+    if (ok) {
+        size_t write = (rb->read + rb->used) % rb->size;
+        size_t first = rb->size - write < size ? rb->size - write : size;
+        memcpy(rb->storage + write, data, first);
+        memcpy(rb->storage, (const uint8_t*)data + first, size - first);
+        rb->used += size;
+        pthread_cond_broadcast(&rb->cond);
+    }
+    pthread_mutex_unlock(&rb->lock);
+    return ok;
+}
+
+void* xRingbufferReceiveUpTo(RingbufHandle_t rb, size_t* size, TickType_t ticks, size_t max_size) {
+    int64_t deadline = sim_ticks_deadline_us(ticks);
+    void* item = NULL;
+    pthread_mutex_lock(&rb->lock);
+    while ((rb->used == 0 || rb->held) && sim_cond_wait_until(&rb->cond, &rb->lock, deadline)) {
+    }
+    if (rb->used > 0 && !rb->held) {
+        size_t n = rb->size - rb->read < rb->used ? rb->size - rb->read : rb->used;
+        if (n > max_size) n = max_size;
+        rb->held = n;
+        *size = n;
+        item = rb->storage + rb->read;
+    }
+    pthread_mutex_unlock(&rb->lock);
+    return item;
+}
+
+void vRingbufferReturnItem(RingbufHandle_t rb, void* item) {
+    pthread_mutex_lock(&rb->lock);
+    rb->read = (rb->read + rb->held) % rb->size;
+    rb->used -= rb->held;
+    rb->held = 0;
+    pthread_cond_broadcast(&rb->cond);
+    pthread_mutex_unlock(&rb->lock);
+}
+
+size_t xRingbufferGetCurFreeSize(RingbufHandle_t rb) {
+    pthread_mutex_lock(&rb->lock);
+    size_t n = rb->size - rb->used;
+    pthread_mutex_unlock(&rb->lock);
+    return n;
+}
+
+// --- Mutexes -----------------------------------------------------------------
+
+struct sim_mutex {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool taken;
+};
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t* sem) {
+    struct sim_mutex* m = calloc(1, sizeof(*m));
+    if (!m) abort();
+    pthread_mutex_init(&m->lock, NULL);
+    sim_cond_init(&m->cond);
+    return m;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+    int64_t deadline = sim_ticks_deadline_us(ticks);
+    pthread_mutex_lock(&sem->lock);
+    while (sem->taken && sim_cond_wait_until(&sem->cond, &sem->lock, deadline)) {
+    }
+    BaseType_t ok = sem->taken ? pdFALSE : pdTRUE;
+    sem->taken = true;
+    pthread_mutex_unlock(&sem->lock);
+    return ok;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+    pthread_mutex_lock(&sem->lock);
+    sem->taken = false;
+    pthread_cond_signal(&sem->cond);
+    pthread_mutex_unlock(&sem->lock);
+    return pdTRUE;
+}
@@ -0,0 +1,425 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_app_desc.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "mbedtls/sha256.h"
+#include "nvs.h"
+#include "sim.h"
+
+// Logging, restart, randomness, CRC, SHA-256, the app description and OTA.
+
+#define SIM_ENV_RESET "DISPENSER_SIM_RESET"
+#define SIM_ENV_BOOTS "DISPENSER_SIM_BOOTS"
+
+// --- Logging -------------------------------------------------------------------
+
+static int log_to_stderr(const char* fmt, va_list args) {
+    return vfprintf(stderr, fmt, args);
+}
+
+static esp_log_level_t log_level = ESP_LOG_INFO;
+static vprintf_like_t log_vprintf = log_to_stderr;
+
+void esp_log_level_set(const char* tag, esp_log_level_t level) {
+    if (strcmp(tag, "*") == 0) log_level = level;
+}
+
+vprintf_like_t esp_log_set_vprintf(vprintf_like_t func) {
+    vprintf_like_t old = log_vprintf;
+    log_vprintf = func;
+    return old;
+}
+
+uint32_t esp_log_timestamp(void) {
+    return (uint32_t)(sim_now_us() / 1000);
+}
+
+void esp_log_write(esp_log_level_t level, const char* tag, const char* fmt, ...) {
+    if (level > log_level) return;
+    va_list args;
+    va_start(args, fmt);
+    log_vprintf(fmt, args);
+    va_end(args);
+}
+
+// --- Restart -------------------------------------------------------------------
+
+static unsigned boot_count(void) {
+    const char* boots = getenv(SIM_ENV_BOOTS);
+    return boots ? (unsigned)strtoul(boots, NULL, 10) : 0;
+}
+
+void esp_restart(void) {
+    fflush(stderr);
+    int master, slave;
+    sim_uart_fds(&master, &slave);
+    char value[32];
+    snprintf(value, sizeof(value), "%d,%d", master, slave);
+    setenv("DISPENSER_SIM_UART_FDS", value, 1);
+    snprintf(value, sizeof(value), "%u", boot_count() + 1);
+    setenv(SIM_ENV_BOOTS, value, 1);
+    setenv(SIM_ENV_RESET, "sw", 1);
+    execv("/proc/self/exe", sim_options.argv);
+    perror("dispenser_sim: restart");
+    _exit(1);
+}
+
+esp_reset_reason_t esp_reset_reason(void) {
+    const char* reset = getenv(SIM_ENV_RESET);
+    return reset && strcmp(reset, "sw") == 0 ? ESP_RST_SW : ESP_RST_POWERON;
+}
+
+// --- Randomness, CRC, heap -------------------------------------------------------
+
+// splitmix64, seeded from --seed (or the clock) and the boot count, so every
+// boot gets a fresh boot_id while a seeded run stays reproducible.
+uint32_t esp_random(void) {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static uint64_t state;
+    static bool seeded;
+    pthread_mutex_lock(&lock);
+    if (!seeded) {
+        uint64_t seed = sim_options.seed ? sim_options.seed : (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+        state = seed + 0x9E3779B97F4A7C15ull * (boot_count() + 1);
+        seeded = true;
+    }
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    pthread_mutex_unlock(&lock);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return (uint32_t)(z ^ (z >> 31));
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const* buf, uint32_t len) {
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= buf[i];
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+    }
+    return ~crc;
+}
+
+// --- SHA-256 (FIPS 180-4) --------------------------------------------------------
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(mbedtls_sha256_context* ctx, const uint8_t* p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t v[8];
+    memcpy(v, ctx->state, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = SHA256_ROR(v[4], 6) ^ SHA256_ROR(v[4], 11) ^ SHA256_ROR(v[4], 25);
+        uint32_t t1 = v[7] + s1 + ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+        uint32_t s0 = SHA256_ROR(v[0], 2) ^ SHA256_ROR(v[0], 13) ^ SHA256_ROR(v[0], 22);
+        uint32_t t2 = s0 + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(&v[1], &v[0], 7 * sizeof(v[0]));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++) ctx->state[i] += v[i];
+}
+
+void mbedtls_sha256_init(mbedtls_sha256_context* ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_sha256_free(mbedtls_sha256_context* ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+int mbedtls_sha256_starts(mbedtls_sha256_context* ctx, int is224) {
+    static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                     0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    if (is224) return -1;
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->total = 0;
+    return 0;
+}
+
+int mbedtls_sha256_update(mbedtls_sha256_context* ctx, const unsigned char* input, size_t ilen) {
+    size_t used = ctx->total % 64;
+    ctx->total += ilen;
+    while (ilen > 0) {
+        size_t n = 64 - used < ilen ? 64 - used : ilen;
+        memcpy(&ctx->buffer[used], input, n);
+        used += n;
+        input += n;
+        ilen -= n;
+        if (used == 64) {
+            sha256_block(ctx, ctx->buffer);
+            used = 0;
+        }
+    }
+    return 0;
+}
+
+int mbedtls_sha256_finish(mbedtls_sha256_context* ctx, unsigned char output[32]) {
+    uint64_t bits = ctx->total * 8;
+    uint8_t pad[72] = {0x80};
+    size_t used = ctx->total % 64;
+    size_t n = (used < 56 ? 56 : 120) - used;
+    for (int i = 0; i < 8; i++) pad[n + i] = (uint8_t)(bits >> (56 - 8 * i));
+    mbedtls_sha256_update(ctx, pad, n + 8);
+    for (int i = 0; i < 32; i++) output[i] = (uint8_t)(ctx->state[i / 4] >> (24 - 8 * (i % 4)));
+    return 0;
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+    return SIM_HEAP_SIZE;
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps) {
+    return SIM_HEAP_SIZE;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+    return SIM_HEAP_SIZE;
+}
+
+// --- OTA -------------------------------------------------------------------------
+
+// What the bootloader and otadata would remember, kept in the simulator's NVS.
+// Booting an image marked NEW puts it on trial (PENDING_VERIFY); booting one
+// still on trial means it never confirmed itself, so it is rolled back.
+#define SIM_OTA_NAMESPACE "sim_ota"
+#define SIM_OTA_KEY       "otadata"
+#define SIM_OTA_IMAGE_MAGIC 0xE9
+#define SIM_APP_DESC_OFFSET 32 // after the image and segment headers
+#define SIM_APP_DESC_MAGIC  0xABCD5432
+
+typedef struct {
+    uint8_t boot;
+    uint8_t reserved[3];
+    uint32_t state[2];
+    char version[2][32];
+} sim_otadata_t;
+
+static const esp_partition_t sim_partitions[2] = {
+    {.label = "ota_0", .address = 0x20000, .size = 0x1E0000},
+    {.label = "ota_1", .address = 0x200000, .size = 0x1E0000},
+};
+
+static pthread_mutex_t ota_lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_otadata_t otadata;
+static bool otadata_loaded;
+static int running_idx;
+static uint8_t* update_image; // the partition being written
+static size_t update_len;
+static int update_idx = -1;
+
+static void otadata_save(void) {
+    nvs_handle_t nvs;
+    if (nvs_open(SIM_OTA_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return;
+    nvs_set_blob(nvs, SIM_OTA_KEY, &otadata, sizeof(otadata));
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+// Runs the bootloader's half once, on first use after boot (NVS is up by then).
+static void otadata_load_locked(void) {
+    if (otadata_loaded) return;
+    otadata_loaded = true;
+    otadata.state[0] = otadata.state[1] = ESP_OTA_IMG_UNDEFINED;
+    nvs_handle_t nvs;
+    if (nvs_open(SIM_OTA_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        size_t size = sizeof(otadata);
+        if (nvs_get_blob(nvs, SIM_OTA_KEY, &otadata, &size) != ESP_OK || size != sizeof(otadata) ||
+            otadata.boot > 1) {
+            memset(&otadata, 0, sizeof(otadata));
+            otadata.state[0] = otadata.state[1] = ESP_OTA_IMG_UNDEFINED;
+        }
+        nvs_close(nvs);
+    }
+    running_idx = otadata.boot;
+    if (otadata.state[running_idx] == ESP_OTA_IMG_PENDING_VERIFY) {
+        otadata.state[running_idx] = ESP_OTA_IMG_ABORTED;
+        running_idx ^= 1;
+        otadata.boot = (uint8_t)running_idx;
+        otadata_save();
+    } else if (otadata.state[running_idx] == ESP_OTA_IMG_NEW) {
+        otadata.state[running_idx] = ESP_OTA_IMG_PENDING_VERIFY;
+        otadata_save();
+    }
+}
+
+static int partition_idx(const esp_partition_t* partition) {
+    if (partition == &sim_partitions[0]) return 0;
+    if (partition == &sim_partitions[1]) return 1;
+    return -1;
+}
+
+const esp_partition_t* esp_ota_get_running_partition(void) {
+    pthread_mutex_lock(&ota_lock);
+    otadata_load_locked();
+    const esp_partition_t* running = &sim_partitions[running_idx];
+    pthread_mutex_unlock(&ota_lock);
+    return running;
+}
+
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t* start_from) {
+    pthread_mutex_lock(&ota_lock);
+    otadata_load_locked();
+    int from = start_from ? partition_idx(start_from) : running_idx;
+    pthread_mutex_unlock(&ota_lock);
+    return from < 0 ? NULL : &sim_partitions[from ^ 1];
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t* partition, esp_ota_img_states_t* state) {
+    int idx = partition_idx(partition);
+    if (idx < 0 || !state) return ESP_ERR_INVALID_ARG;
+    pthread_mutex_lock(&ota_lock);
+    otadata_load_locked();
+    *state = (esp_ota_img_states_t)otadata.state[idx];
+    pthread_mutex_unlock(&ota_lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t* partition, size_t image_size, esp_ota_handle_t* out) {
+    int idx = partition_idx(partition);
+    if (idx < 0 || !out) return ESP_ERR_INVALID_ARG;
+    esp_err_t err = ESP_OK;
+    pthread_mutex_lock(&ota_lock);
+    otadata_load_locked();
+    if (idx == running_idx || update_idx >= 0) {
+        err = idx == running_idx ? ESP_FAIL : ESP_ERR_INVALID_STATE;
+    } else if (!(update_image = malloc(partition->size))) {
+        err = ESP_ERR_NO_MEM;
+    } else {
+        memset(update_image, 0xFF, partition->size);
+        update_len = 0;
+        update_idx = idx;
+        *out = 1;
+    }
+    pthread_mutex_unlock(&ota_lock);
+    return err;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void* data, size_t size) {
+    esp_err_t err = ESP_OK;
+    pthread_mutex_lock(&ota_lock);
+    if (handle != 1 || update_idx < 0) {
+        err = ESP_ERR_INVALID_ARG;
+    } else if (size > sim_partitions[update_idx].size - update_len) {
+        err = ESP_ERR_INVALID_SIZE;
+    } else {
+        memcpy(update_image + update_len, data, size);
+        update_len += size;
+    }
+    pthread_mutex_unlock(&ota_lock);
+    return err;
+}
+
+static void update_release_locked(void) {
+    free(update_image);
+    update_image = NULL;
+    update_len = 0;
+    update_idx = -1;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle) {
+    esp_err_t err = ESP_OK;
+    pthread_mutex_lock(&ota_lock);
+    if (handle != 1 || update_idx < 0) {
+        err = ESP_ERR_INVALID_ARG;
+    } else if (update_len == 0 || update_image[0] != SIM_OTA_IMAGE_MAGIC) {
+        err = ESP_ERR_OTA_VALIDATE_FAILED;
+    } else {
+        char* version = otadata.version[update_idx];
+        uint32_t magic;
+        memset(version, 0, sizeof(otadata.version[0]));
+        if (update_len >= SIM_APP_DESC_OFFSET + sizeof(esp_app_desc_t)) {
+            const esp_app_desc_t* desc = (const esp_app_desc_t*)(update_image + SIM_APP_DESC_OFFSET);
+            memcpy(&magic, &desc->magic_word, sizeof(magic));
+            if (magic == SIM_APP_DESC_MAGIC) memcpy(version, desc->version, sizeof(desc->version) - 1);
+        }
+        if (!version[0]) snprintf(version, sizeof(otadata.version[0]), "sim-ota");
+        otadata.state[update_idx] = ESP_OTA_IMG_UNDEFINED;
+    }
+    if (handle == 1) update_release_locked();
+    pthread_mutex_unlock(&ota_lock);
+    return err;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle) {
+    pthread_mutex_lock(&ota_lock);
+    if (handle == 1) update_release_locked();
+    pthread_mutex_unlock(&ota_lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t* partition) {
+    int idx = partition_idx(partition);
+    if (idx < 0) return ESP_ERR_INVALID_ARG;
+    pthread_mutex_lock(&ota_lock);
+    otadata_load_locked();
+    otadata.boot = (uint8_t)idx;
+    if (idx != running_idx) otadata.state[idx] = ESP_OTA_IMG_NEW;
+    otadata_save();
+    pthread_mutex_unlock(&ota_lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback(void) {
+    pthread_mutex_lock(&ota_lock);
+    otadata_load_locked();
+    otadata.state[running_idx] = ESP_OTA_IMG_VALID;
+    otadata_save();
+    pthread_mutex_unlock(&ota_lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot(void) {
+    pthread_mutex_lock(&ota_lock);
+    otadata_load_locked();
+    otadata.state[running_idx] = ESP_OTA_IMG_INVALID;
+    otadata.boot = (uint8_t)(running_idx ^ 1);
+    otadata_save();
+    pthread_mutex_unlock(&ota_lock);
+    esp_restart();
+}
+
+// --- App description ---------------------------------------------------------------
+
+const esp_app_desc_t* esp_app_get_description(void) {
+    static esp_app_desc_t desc = {
+        .magic_word = SIM_APP_DESC_MAGIC,
+        .project_name = "dispenser_sim",
+        .time = __TIME__,
+        .date = __DATE__,
+        .idf_ver = "host",
+    };
+    pthread_mutex_lock(&ota_lock);
+    otadata_load_locked();
+    const char* version = otadata.version[running_idx][0] ? otadata.version[running_idx] : "sim";
+    snprintf(desc.version, sizeof(desc.version), "%s", version);
+    pthread_mutex_unlock(&ota_lock);
+    return &desc;
+}
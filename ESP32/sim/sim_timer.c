@@ -0,0 +1,112 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include "esp_timer.h"
+#include "sim.h"
+
+// esp_timer on one dispatcher thread: callbacks run one at a time, outside the
+// lock, so they may start and stop timers (their own included) like on the board.
+
+struct sim_timer {
+    esp_timer_cb_t callback;
+    void* arg;
+    int64_t due_us;
+    uint64_t period_us; // 0 = one-shot
+    bool armed;
+    struct sim_timer* next;
+};
+
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+static struct sim_timer* timers;
+static bool timer_thread_started;
+
+static void* timer_thread(void* arg) {
+    pthread_setname_np(pthread_self(), "esp_timer");
+    pthread_mutex_lock(&timer_lock);
+    for (;;) {
+        struct sim_timer* soonest = NULL;
+        for (struct sim_timer* t = timers; t; t = t->next) {
+            if (t->armed && (!soonest || t->due_us < soonest->due_us)) soonest = t;
+        }
+        if (!soonest) {
+            pthread_cond_wait(&timer_cond, &timer_lock);
+            continue;
+        }
+        int64_t now = sim_now_us();
+        if (now < soonest->due_us) {
+            sim_cond_wait_until(&timer_cond, &timer_lock, soonest->due_us);
+            continue;
+        }
+        if (soonest->period_us) {
+            // Periods missed while the host was descheduled are skipped, not replayed.
+            soonest->due_us += (int64_t)soonest->period_us;
+            if (soonest->due_us <= now) soonest->due_us = now + (int64_t)soonest->period_us;
+        } else {
+            soonest->armed = false;
+        }
+        esp_timer_cb_t cb = soonest->callback;
+        void* cb_arg = soonest->arg;
+        pthread_mutex_unlock(&timer_lock);
+        cb(cb_arg);
+        pthread_mutex_lock(&timer_lock);
+    }
+    return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* out) {
+    if (!args || !args->callback || !out) return ESP_ERR_INVALID_ARG;
+    struct sim_timer* t = calloc(1, sizeof(*t));
+    if (!t) return ESP_ERR_NO_MEM;
+    t->callback = args->callback;
+    t->arg = args->arg;
+
+    pthread_mutex_lock(&timer_lock);
+    if (!timer_thread_started) {
+        sim_cond_init(&timer_cond);
+        pthread_t thread;
+        pthread_create(&thread, NULL, timer_thread, NULL);
+        pthread_detach(thread);
+        timer_thread_started = true;
+    }
+    t->next = timers;
+    timers = t;
+    pthread_mutex_unlock(&timer_lock);
+    *out = t;
+    return ESP_OK;
+}
+
+static esp_err_t timer_start(esp_timer_handle_t t, uint64_t delay_us, uint64_t period_us) {
+    esp_err_t err = ESP_OK;
+    pthread_mutex_lock(&timer_lock);
+    if (t->armed) {
+        err = ESP_ERR_INVALID_STATE;
+    } else {
+        t->due_us = sim_now_us() + (int64_t)delay_us;
+        t->period_us = period_us;
+        t->armed = true;
+        pthread_cond_signal(&timer_cond);
+    }
+    pthread_mutex_unlock(&timer_lock);
+    return err;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    return timer_start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us) {
+    if (period_us == 0) return ESP_ERR_INVALID_ARG;
+    return timer_start(timer, period_us, period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t t) {
+    pthread_mutex_lock(&timer_lock);
+    esp_err_t err = t->armed ? ESP_OK : ESP_ERR_INVALID_STATE;
+    t->armed = false;
+    pthread_mutex_unlock(&timer_lock);
+    return err;
+}
+
+int64_t esp_timer_get_time(void) {
+    return sim_now_us();
+}
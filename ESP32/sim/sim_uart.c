@@ -0,0 +1,329 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include "driver/uart.h"
+#include "sim.h"
+
+// UART0 over a pseudo-terminal. The RX thread takes what the host wrote in
+// FIFO-sized chunks, holds each chunk for as long as its bytes take on the wire
+// at the current baud rate and then moves it into the driver's RX buffer,
+// raising UART_BUFFER_FULL (and dropping the rest) when that is full, one
+// UART_PATTERN_DET per pattern character and a UART_DATA per chunk. The TX
+// thread drains the driver's TX buffer at line rate. Output the host is not
+// reading is lost as it would be on the wire, instead of stalling the firmware.
+
+#define SIM_UART_FIFO_LEN  120
+#define SIM_UART_ENV_FDS   "DISPENSER_SIM_UART_FDS"
+
+typedef struct {
+    bool installed;
+    uint32_t baud;
+    QueueHandle_t events;
+
+    uint8_t* rx_buf;
+    size_t rx_size;
+    size_t rx_head;
+    size_t rx_len;
+    int pattern_chr; // -1 = off
+    int* pattern_pos; // relative to rx_head, -1 once read past
+    size_t pattern_cap;
+    size_t pattern_head;
+    size_t pattern_len;
+
+    uint8_t* tx_buf;
+    size_t tx_size;
+    size_t tx_head;
+    size_t tx_len;
+    bool tx_busy;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} sim_uart_t;
+
+static sim_uart_t uart0 = {.baud = 115200, .pattern_chr = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+static int pty_master = -1;
+static int pty_slave = -1;
+
+static int64_t char_time_us(size_t n) {
+    // 8N1: ten bit times a character.
+    return (int64_t)n * 10 * 1000000 / (int64_t)(uart0.baud ? uart0.baud : 115200);
+}
+
+void sim_uart_attach(void) {
+    const char* fds = getenv(SIM_UART_ENV_FDS);
+    if (fds && sscanf(fds, "%d,%d", &pty_master, &pty_slave) == 2) return;
+
+    pty_master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (pty_master < 0 || grantpt(pty_master) != 0 || unlockpt(pty_master) != 0) {
+        perror("dispenser_sim: pty");
+        exit(1);
+    }
+    const char* name = ptsname(pty_master);
+    // Kept open so the master never sees EIO while no host has the port open.
+    pty_slave = open(name, O_RDWR | O_NOCTTY);
+    if (pty_slave < 0) {
+        perror("dispenser_sim: pty slave");
+        exit(1);
+    }
+    struct termios tio;
+    tcgetattr(pty_slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(pty_slave, TCSANOW, &tio);
+    fcntl(pty_master, F_SETFL, fcntl(pty_master, F_GETFL) | O_NONBLOCK);
+
+    fprintf(stderr, "dispenser_sim: UART0 is %s\n", name);
+    if (sim_options.pty_link) {
+        unlink(sim_options.pty_link);
+        if (symlink(name, sim_options.pty_link) != 0) {
+            perror("dispenser_sim: symlink");
+        } else {
+            fprintf(stderr, "dispenser_sim: linked as %s\n", sim_options.pty_link);
+        }
+    }
+}
+
+void sim_uart_fds(int* master, int* slave) {
+    *master = pty_master;
+    *slave = pty_slave;
+}
+
+static void post_event(uart_event_type_t type, size_t size) {
+    if (!uart0.events) return;
+    uart_event_t ev = {.type = type, .size = size};
+    xQueueSend(uart0.events, &ev, 0);
+}
+
+static void* rx_thread(void* arg) {
+    pthread_setname_np(pthread_self(), "uart_rx");
+    uint8_t chunk[SIM_UART_FIFO_LEN];
+    int64_t line_free_us = 0;
+    for (;;) {
+        struct pollfd pfd = {.fd = pty_master, .events = POLLIN};
+        if (poll(&pfd, 1, 100) <= 0) continue;
+        ssize_t n = read(pty_master, chunk, sizeof(chunk));
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN && errno != EINTR) usleep(10000);
+            continue;
+        }
+        int64_t now = sim_now_us();
+        int64_t start = line_free_us > now ? line_free_us : now;
+        line_free_us = start + char_time_us((size_t)n);
+        sim_sleep_until_us(line_free_us);
+
+        size_t patterns = 0;
+        bool overflow = false;
+        pthread_mutex_lock(&uart0.lock);
+        size_t space = uart0.rx_size - uart0.rx_len;
+        size_t take = (size_t)n < space ? (size_t)n : space;
+        overflow = take < (size_t)n;
+        for (size_t i = 0; i < take; i++) {
+            size_t at = uart0.rx_len;
+            uart0.rx_buf[(uart0.rx_head + at) % uart0.rx_size] = chunk[i];
+            uart0.rx_len++;
+            if (chunk[i] == uart0.pattern_chr && uart0.pattern_len < uart0.pattern_cap) {
+                uart0.pattern_pos[(uart0.pattern_head + uart0.pattern_len) % uart0.pattern_cap] = (int)at;
+                uart0.pattern_len++;
+                patterns++;
+            }
+        }
+        pthread_cond_broadcast(&uart0.cond);
+        pthread_mutex_unlock(&uart0.lock);
+
+        for (size_t i = 0; i < patterns; i++) post_event(UART_PATTERN_DET, 0);
+        if (take) post_event(UART_DATA, take);
+        if (overflow) post_event(UART_BUFFER_FULL, 0);
+    }
+    return NULL;
+}
+
+static void tx_out(const uint8_t* data, size_t len) {
+    // A reader that is not keeping up (or not there) loses bytes like the wire would.
+    if (write(pty_master, data, len) < 0 && errno != EAGAIN) usleep(1000);
+}
+
+static void* tx_thread(void* arg) {
+    pthread_setname_np(pthread_self(), "uart_tx");
+    uint8_t chunk[SIM_UART_FIFO_LEN];
+    pthread_mutex_lock(&uart0.lock);
+    for (;;) {
+        while (uart0.tx_len == 0) {
+            uart0.tx_busy = false;
+            pthread_cond_broadcast(&uart0.cond);
+            pthread_cond_wait(&uart0.cond, &uart0.lock);
+        }
+        uart0.tx_busy = true;
+        size_t n = uart0.tx_len < sizeof(chunk) ? uart0.tx_len : sizeof(chunk);
+        for (size_t i = 0; i < n; i++) chunk[i] = uart0.tx_buf[(uart0.tx_head + i) % uart0.tx_size];
+        uart0.tx_head = (uart0.tx_head + n) % uart0.tx_size;
+        uart0.tx_len -= n;
+        pthread_cond_broadcast(&uart0.cond);
+        int64_t done_us = sim_now_us() + char_time_us(n);
+        pthread_mutex_unlock(&uart0.lock);
+        tx_out(chunk, n);
+        sim_sleep_until_us(done_us);
+        pthread_mutex_lock(&uart0.lock);
+    }
+    return NULL;
+}
+
+esp_err_t uart_driver_install(uart_port_t port, int rx_buffer_size, int tx_buffer_size, int queue_size,
+                              QueueHandle_t* uart_queue, int intr_alloc_flags) {
+    if (port == UART_NUM_1) return ESP_OK;
+    if (port != UART_NUM_0 || rx_buffer_size <= SIM_UART_FIFO_LEN) return ESP_ERR_INVALID_ARG;
+    if (uart0.installed) return ESP_FAIL;
+    if (pty_master < 0) sim_uart_attach();
+
+    sim_cond_init(&uart0.cond);
+    uart0.rx_buf = malloc((size_t)rx_buffer_size);
+    uart0.rx_size = (size_t)rx_buffer_size;
+    // Without a TX buffer uart_write_bytes would block until sent; a one-chunk
+    // buffer comes close enough.
+    uart0.tx_size = tx_buffer_size > 0 ? (size_t)tx_buffer_size : SIM_UART_FIFO_LEN;
+    uart0.tx_buf = malloc(uart0.tx_size);
+    if (!uart0.rx_buf || !uart0.tx_buf) return ESP_ERR_NO_MEM;
+    if (uart_queue && queue_size > 0) {
+        uart0.events = xQueueCreate((UBaseType_t)queue_size, sizeof(uart_event_t));
+        *uart_queue = uart0.events;
+    }
+    uart0.installed = true;
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, rx_thread, NULL);
+    pthread_detach(thread);
+    pthread_create(&thread, NULL, tx_thread, NULL);
+    pthread_detach(thread);
+    return ESP_OK;
+}
+
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t* config) {
+    if (!config || config->baud_rate <= 0) return ESP_ERR_INVALID_ARG;
+    if (port == UART_NUM_0) uart0.baud = (uint32_t)config->baud_rate;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t port, int tx, int rx, int rts, int cts) {
+    return ESP_OK;
+}
+
+esp_err_t uart_set_baudrate(uart_port_t port, uint32_t baud) {
+    if (baud == 0) return ESP_ERR_INVALID_ARG;
+    if (port == UART_NUM_0) uart0.baud = baud;
+    return ESP_OK;
+}
+
+esp_err_t uart_enable_pattern_det_baud_intr(uart_port_t port, char pattern_chr, uint8_t chr_num, int chr_tout,
+                                            int post_idle, int pre_idle) {
+    if (port != UART_NUM_0 || chr_num != 1) return ESP_ERR_INVALID_ARG;
+    pthread_mutex_lock(&uart0.lock);
+    uart0.pattern_chr = (unsigned char)pattern_chr;
+    pthread_mutex_unlock(&uart0.lock);
+    return ESP_OK;
+}
+
+esp_err_t uart_pattern_queue_reset(uart_port_t port, int queue_length) {
+    if (port != UART_NUM_0 || queue_length <= 0) return ESP_ERR_INVALID_ARG;
+    int* pos = malloc(sizeof(int) * (size_t)queue_length);
+    if (!pos) return ESP_ERR_NO_MEM;
+    pthread_mutex_lock(&uart0.lock);
+    free(uart0.pattern_pos);
+    uart0.pattern_pos = pos;
+    uart0.pattern_cap = (size_t)queue_length;
+    uart0.pattern_head = 0;
+    uart0.pattern_len = 0;
+    pthread_mutex_unlock(&uart0.lock);
+    return ESP_OK;
+}
+
+int uart_pattern_pop_pos(uart_port_t port) {
+    int pos = -1;
+    pthread_mutex_lock(&uart0.lock);
+    if (port == UART_NUM_0 && uart0.pattern_len) {
+        pos = uart0.pattern_pos[uart0.pattern_head];
+        uart0.pattern_head = (uart0.pattern_head + 1) % uart0.pattern_cap;
+        uart0.pattern_len--;
+    }
+    pthread_mutex_unlock(&uart0.lock);
+    return pos;
+}
+
+esp_err_t uart_set_rx_timeout(uart_port_t port, uint8_t tout_thresh) {
+    return ESP_OK;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t* size) {
+    if (port != UART_NUM_0 || !size) return ESP_ERR_INVALID_ARG;
+    pthread_mutex_lock(&uart0.lock);
+    *size = uart0.rx_len;
+    pthread_mutex_unlock(&uart0.lock);
+    return ESP_OK;
+}
+
+int uart_read_bytes(uart_port_t port, void* buf, uint32_t length, TickType_t ticks_to_wait) {
+    if (port != UART_NUM_0 || !uart0.installed) return -1;
+    int64_t deadline = sim_ticks_deadline_us(ticks_to_wait);
+    uint8_t* out = buf;
+    size_t n = 0;
+    pthread_mutex_lock(&uart0.lock);
+    while (n < length) {
+        while (uart0.rx_len == 0 && sim_cond_wait_until(&uart0.cond, &uart0.lock, deadline)) {
+        }
+        if (uart0.rx_len == 0) break;
+        while (n < length && uart0.rx_len) {
+            out[n++] = uart0.rx_buf[uart0.rx_head];
+            uart0.rx_head = (uart0.rx_head + 1) % uart0.rx_size;
+            uart0.rx_len--;
+        }
+    }
+    // Pattern positions are relative to the start of the buffered data.
+    for (size_t i = 0; i < uart0.pattern_len; i++) {
+        int* pos = &uart0.pattern_pos[(uart0.pattern_head + i) % uart0.pattern_cap];
+        *pos = *pos >= (int)n ? *pos - (int)n : -1;
+    }
+    pthread_mutex_unlock(&uart0.lock);
+    return (int)n;
+}
+
+esp_err_t uart_flush_input(uart_port_t port) {
+    if (port != UART_NUM_0) return ESP_OK;
+    pthread_mutex_lock(&uart0.lock);
+    uart0.rx_head = 0;
+    uart0.rx_len = 0;
+    uart0.pattern_head = 0;
+    uart0.pattern_len = 0;
+    pthread_mutex_unlock(&uart0.lock);
+    return ESP_OK;
+}
+
+int uart_write_bytes(uart_port_t port, const void* src, size_t size) {
+    if (port == UART_NUM_1) return (int)fwrite(src, 1, size, stderr);
+    if (port != UART_NUM_0 || !uart0.installed) return -1;
+    const uint8_t* in = src;
+    pthread_mutex_lock(&uart0.lock);
+    for (size_t i = 0; i < size;) {
+        while (uart0.tx_len == uart0.tx_size) pthread_cond_wait(&uart0.cond, &uart0.lock);
+        while (i < size && uart0.tx_len < uart0.tx_size) {
+            uart0.tx_buf[(uart0.tx_head + uart0.tx_len) % uart0.tx_size] = in[i++];
+            uart0.tx_len++;
+        }
+        pthread_cond_broadcast(&uart0.cond);
+    }
+    pthread_mutex_unlock(&uart0.lock);
+    return (int)size;
+}
+
+esp_err_t uart_wait_tx_done(uart_port_t port, TickType_t ticks_to_wait) {
+    if (port != UART_NUM_0) return ESP_OK;
+    int64_t deadline = sim_ticks_deadline_us(ticks_to_wait);
+    pthread_mutex_lock(&uart0.lock);
+    while ((uart0.tx_len || uart0.tx_busy) && sim_cond_wait_until(&uart0.cond, &uart0.lock, deadline)) {
+    }
+    esp_err_t err = uart0.tx_len || uart0.tx_busy ? ESP_ERR_TIMEOUT : ESP_OK;
+    pthread_mutex_unlock(&uart0.lock);
+    return err;
+}
@@ -441,6 +441,14 @@ def api_tts_elevenlabs():
     )
 
 
+@app.post("/api/estop")
+def api_estop():
+    payload = request.get_json(silent=True) or {}
+    if not isinstance(payload, dict):
+        return jsonify(fsm.status() | {"ok": False, "message": "Request JSON must be an object."}), 400
+    return jsonify(fsm.emergency_stop(payload))
+
+
 @app.post("/api/reset")
 def api_reset():
     return jsonify(fsm.reset())
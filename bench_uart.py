@@ -0,0 +1,352 @@
+"""
+End-to-end UART benchmark for the ESP32 dispenser firmware.
+
+Drives the firmware with a configurable mix of SAURON_UART_V1 frames, JSON lines
+and SAURON_UART_V2 batches (optionally with line noise between messages and any
+number of orders in flight), then reports p50/p95/p99 round-trip time to the
+"queued" and final ACK, ACK loss and throughput as JSON so runs against
+different firmware builds can be compared:
+
+    python bench_uart.py --label main --orders 500 --mix v1=1,json=1,v2=2 --out main.json
+    python bench_uart.py --label pr-123 --orders 500 --mix v1=1,json=1,v2=2 \\
+        --compare main.json --max-regression 10
+
+With the default all-zero counts no servo moves, so the numbers are the
+firmware's protocol path (uart_task parsing, queueing, ACK output); pass
+--counts to include motion (execute_channel_counts) in the final-ACK time.
+
+Matching: V2 ACKs carry (seq, order). V1/JSON ACKs carry no seq, so they are
+matched first-in first-out, which holds because the firmware handles input and
+runs orders strictly in arrival order. Noise is drawn from bytes that cannot
+start a frame or a line, so it exercises the resync path without swallowing
+the next message.
+"""
+
+from __future__ import annotations
+
+import argparse
+import collections
+import json
+import queue
+import random
+import sys
+import threading
+import time
+from typing import Any
+
+import serial
+
+import sauron_uart
+
+PROTOCOLS = ("v1", "json", "v2")
+NOISE_EXCLUDED = {sauron_uart.FRAME_START, ord("{"), ord("\n"), ord("\r"), ord(" "), ord("\t")}
+NOISE_ALPHABET = bytes(b for b in range(256) if b not in NOISE_EXCLUDED)
+FINAL_OK_STATUSES = {"done"}
+
+
+class Pending:
+    __slots__ = ("protocol", "key", "sent_at", "queued_at", "done_at", "status")
+
+    def __init__(self, protocol: str, key: tuple[int, int] | None, sent_at: float) -> None:
+        self.protocol = protocol
+        self.key = key
+        self.sent_at = sent_at
+        self.queued_at: float | None = None
+        self.done_at: float | None = None
+        self.status = ""
+
+
+def parse_mix(text: str) -> list[tuple[str, float]]:
+    mix = []
+    for part in text.split(","):
+        name, _, weight = part.partition("=")
+        name = name.strip().lower()
+        if name not in PROTOCOLS:
+            raise argparse.ArgumentTypeError(f"unknown protocol {name!r} (use {', '.join(PROTOCOLS)})")
+        mix.append((name, float(weight or 1)))
+    if not mix or sum(w for _, w in mix) <= 0:
+        raise argparse.ArgumentTypeError("mix needs at least one protocol with a positive weight")
+    return mix
+
+
+def percentile(sorted_values: list[float], q: float) -> float:
+    """Nearest-rank percentile of an already sorted list."""
+    if not sorted_values:
+        return 0.0
+    rank = max(1, min(len(sorted_values), int(round(q * len(sorted_values) + 0.5))))
+    return sorted_values[rank - 1]
+
+
+def summarize(values_s: list[float]) -> dict[str, Any]:
+    ms = sorted(v * 1000.0 for v in values_s)
+    if not ms:
+        return {"n": 0}
+    return {
+        "n": len(ms),
+        "mean": round(sum(ms) / len(ms), 3),
+        "p50": round(percentile(ms, 0.50), 3),
+        "p95": round(percentile(ms, 0.95), 3),
+        "p99": round(percentile(ms, 0.99), 3),
+        "max": round(ms[-1], 3),
+    }
+
+
+def json_order_line(counts: list[int]) -> bytes:
+    return (json.dumps({f"pill{i + 1}": c for i, c in enumerate(counts)}) + "\n").encode("utf-8")
+
+
+def reader(ser: Any, out: queue.Queue, stop: threading.Event) -> None:
+    while not stop.is_set():
+        received = sauron_uart.read_ack(ser)
+        if received is not None:
+            out.put((time.perf_counter(), received[0], received[1]))
+
+
+def request_reply(ser: Any, acks: queue.Queue, line: bytes, status: str, timeout_s: float) -> dict[str, Any] | None:
+    """Send a control line and wait for the reply with the given status (reader thread running)."""
+    ser.write(line)
+    ser.flush()
+    deadline = time.perf_counter() + timeout_s
+    while time.perf_counter() < deadline:
+        try:
+            _, ack, _ = acks.get(timeout=max(0.0, deadline - time.perf_counter()))
+        except queue.Empty:
+            break
+        if ack.get("status") == status:
+            return ack
+    return None
+
+
+def run(args: argparse.Namespace) -> dict[str, Any]:
+    rng = random.Random(args.seed)
+    counts = [int(c) for c in args.counts.split(",")]
+    names = [name for name, _ in args.mix]
+    weights = [weight for _, weight in args.mix]
+
+    ser = serial.Serial(args.port, args.baud, timeout=0.2, rtscts=args.rtscts)
+    ser.reset_input_buffer()
+    if args.target_baud and args.target_baud != args.baud:
+        if not sauron_uart.negotiate_baud(ser, args.target_baud):
+            raise SystemExit(f"baud negotiation to {args.target_baud} failed")
+
+    acks: queue.Queue = queue.Queue()
+    stop = threading.Event()
+    thread = threading.Thread(target=reader, args=(ser, acks, stop), daemon=True)
+    thread.start()
+
+    if args.binary_acks and request_reply(ser, acks, sauron_uart.build_json_ack_mode_line(binary=True),
+                                          "ack_mode_ok", args.timeout) is None:
+        raise SystemExit("firmware did not confirm binary ACK mode")
+    if args.stats:
+        request_reply(ser, acks, sauron_uart.build_json_command_line("stats", reset=True), "stats", args.timeout)
+
+    pendings: list[Pending] = []
+    by_key: dict[tuple[int, int], Pending] = {}
+    fifo_queued: collections.deque[Pending] = collections.deque()
+    fifo_final: collections.deque[Pending] = collections.deque()
+    in_flight = 0
+    seq = 0
+    unmatched = 0
+    noise_bytes = 0
+    interval = 1.0 / args.rate if args.rate > 0 else 0.0
+    next_send = time.perf_counter()
+    started = next_send
+    last_progress = started
+
+    def finish(p: Pending, status: str, at: float) -> None:
+        nonlocal in_flight
+        if p.done_at is None:
+            p.done_at = at
+            p.status = status
+            in_flight -= 1
+
+    while True:
+        now = time.perf_counter()
+        sent = len(pendings)
+        if sent < args.orders and in_flight < args.window and now >= next_send:
+            protocol = rng.choices(names, weights)[0]
+            batch = min(args.batch, args.orders - sent, args.window - in_flight) if protocol == "v2" else 1
+            if args.noise > 0 and rng.random() < args.noise:
+                noise = bytes(rng.choice(NOISE_ALPHABET) for _ in range(rng.randint(1, args.noise_max)))
+                ser.write(noise)
+                noise_bytes += len(noise)
+            if protocol == "v1":
+                request = sauron_uart.build_v1_frame(counts)
+            elif protocol == "json":
+                request = json_order_line(counts)
+            else:
+                seq = (seq + 1) & 0xFFFF
+                request = sauron_uart.build_v2_dispense_batch(seq, [counts] * batch, channel_count=len(counts))
+            sent_at = time.perf_counter()
+            ser.write(request)
+            for order in range(batch):
+                p = Pending(protocol, (seq, order) if protocol == "v2" else None, sent_at)
+                pendings.append(p)
+                if p.key is not None:
+                    by_key[p.key] = p
+                else:
+                    fifo_queued.append(p)
+                    fifo_final.append(p)
+            in_flight += batch
+            next_send = max(next_send + interval, now) if interval else now
+            continue
+
+        if sent >= args.orders and in_flight == 0:
+            break
+        if now - last_progress > args.timeout:
+            break  # whatever is still in flight counts as lost
+
+        try:
+            at, ack, _ = acks.get(timeout=0.001 if sent < args.orders else 0.05)
+        except queue.Empty:
+            continue
+        last_progress = at
+        status = str(ack.get("status", ""))
+        if status == "progress":
+            continue  # per-pill event: keeps the run alive, settles nothing
+        if "seq" in ack:
+            if status in {"queued", "done", "short"}:
+                targets = [by_key.get((ack["seq"], int(ack.get("order", 0))))]
+            else:  # frame-level NACK: applies to every order in the batch
+                targets = [p for k, p in by_key.items() if k[0] == ack["seq"]]
+        elif status == "queued":
+            targets = [fifo_queued.popleft()] if fifo_queued else []
+        elif status in {"done", "short"}:
+            targets = [fifo_final.popleft()] if fifo_final else []
+        elif status in {"busy", "bad_json", "bad_crc", "bad_payload"} and fifo_queued:
+            p = fifo_queued.popleft()
+            fifo_final.remove(p)
+            targets = [p]
+        else:
+            targets = []
+        targets = [p for p in targets if p is not None and p.done_at is None]
+        if not targets:
+            unmatched += 1
+            continue
+        for p in targets:
+            if status == "queued":
+                p.queued_at = at
+            else:
+                finish(p, status, at)
+
+    elapsed = time.perf_counter() - started
+    firmware_stats = None
+    if args.stats:
+        firmware_stats = request_reply(ser, acks, sauron_uart.build_json_command_line("stats"), "stats", args.timeout)
+    stop.set()
+    thread.join(timeout=1.0)
+    ser.close()
+
+    def section(subset: list[Pending]) -> dict[str, Any]:
+        ok = [p for p in subset if p.status in FINAL_OK_STATUSES]
+        lost = [p for p in subset if p.done_at is None]
+        failures = collections.Counter(p.status for p in subset if p.done_at is not None and p.status not in FINAL_OK_STATUSES)
+        return {
+            "sent": len(subset),
+            "ok": len(ok),
+            "lost": len(lost),
+            "loss_rate": round(len(lost) / len(subset), 6) if subset else 0.0,
+            "failures": dict(failures),
+            "rtt_queued_ms": summarize([p.queued_at - p.sent_at for p in subset if p.queued_at is not None]),
+            "rtt_final_ms": summarize([p.done_at - p.sent_at for p in ok if p.done_at is not None]),
+        }
+
+    report = {
+        "label": args.label,
+        "timestamp": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        "config": {
+            "port": args.port,
+            "baud": args.target_baud or args.baud,
+            "rtscts": args.rtscts,
+            "binary_acks": args.binary_acks,
+            "orders": args.orders,
+            "mix": dict(args.mix),
+            "batch": args.batch,
+            "window": args.window,
+            "rate": args.rate,
+            "noise": args.noise,
+            "counts": counts,
+            "seed": args.seed,
+        },
+        "duration_s": round(elapsed, 3),
+        "throughput_orders_per_s": round(sum(1 for p in pendings if p.status in FINAL_OK_STATUSES) / elapsed, 3)
+        if elapsed > 0 else 0.0,
+        "noise_bytes": noise_bytes,
+        "unmatched_acks": unmatched,
+        "overall": section(pendings),
+        "per_protocol": {name: section([p for p in pendings if p.protocol == name]) for name in names},
+    }
+    if firmware_stats is not None:
+        report["firmware_stats"] = firmware_stats
+    return report
+
+
+def compare(report: dict[str, Any], baseline: dict[str, Any], max_regression_pct: float | None) -> bool:
+    """Print report vs baseline; returns False if any latency/throughput metric regressed past the limit."""
+    ok = True
+    rows = []
+    for phase in ("rtt_queued_ms", "rtt_final_ms"):
+        for q in ("p50", "p95", "p99"):
+            rows.append((f"{phase}.{q}", baseline["overall"][phase].get(q), report["overall"][phase].get(q), True))
+    rows.append(("loss_rate", baseline["overall"]["loss_rate"], report["overall"]["loss_rate"], True))
+    rows.append(("throughput_orders_per_s", baseline["throughput_orders_per_s"], report["throughput_orders_per_s"], False))
+
+    print(f"{'metric':<28}{baseline.get('label', 'baseline'):>14}{report.get('label', 'current'):>14}{'change':>10}")
+    for name, old, new, lower_is_better in rows:
+        if old is None or new is None:
+            continue
+        change = ((new - old) / old * 100.0) if old else 0.0
+        worse = change > 0 if lower_is_better else change < 0
+        flag = ""
+        if max_regression_pct is not None and worse and abs(change) > max_regression_pct:
+            flag = "  REGRESSION"
+            ok = False
+        print(f"{name:<28}{old:>14}{new:>14}{change:>+9.1f}%{flag}")
+    return ok
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[1], formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", default="/dev/ttyUSB0")
+    parser.add_argument("--baud", type=int, default=sauron_uart.BOOT_BAUD_RATE)
+    parser.add_argument("--target-baud", type=int, default=0, help="negotiate this rate after connecting")
+    parser.add_argument("--rtscts", action="store_true")
+    parser.add_argument("--binary-acks", action="store_true")
+    parser.add_argument("--label", default="unlabeled", help="firmware build name recorded in the report")
+    parser.add_argument("--orders", type=int, default=200)
+    parser.add_argument("--mix", type=parse_mix, default=parse_mix("v1=1,json=1,v2=1"),
+                        help="protocol weights, e.g. v1=1,json=2,v2=1")
+    parser.add_argument("--batch", type=int, default=1, help="orders per V2 frame (1..%d)" % sauron_uart.V2_MAX_BATCH_ORDERS)
+    parser.add_argument("--window", type=int, default=4, help="max orders in flight (firmware queue holds 8)")
+    parser.add_argument("--rate", type=float, default=0.0, help="orders/s to offer; 0 = back-to-back")
+    parser.add_argument("--noise", type=float, default=0.0, help="probability of noise before each message")
+    parser.add_argument("--noise-max", type=int, default=16, help="longest noise burst in bytes")
+    parser.add_argument("--counts", default="0,0,0,0", help="per-channel pill counts in every order")
+    parser.add_argument("--timeout", type=float, default=5.0, help="seconds without any ACK before giving up")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--stats", action="store_true", help="reset and attach the firmware's stats counters")
+    parser.add_argument("--out", help="write the JSON report here (default: stdout)")
+    parser.add_argument("--compare", help="baseline report to compare against")
+    parser.add_argument("--max-regression", type=float, help="fail if any metric is this many %% worse than baseline")
+    args = parser.parse_args()
+    args.batch = max(1, min(sauron_uart.V2_MAX_BATCH_ORDERS, args.batch))
+    args.window = max(1, args.window)
+
+    report = run(args)
+    text = json.dumps(report, indent=2)
+    if args.out:
+        with open(args.out, "w", encoding="utf-8") as fh:
+            fh.write(text + "\n")
+    else:
+        print(text)
+
+    if args.compare:
+        with open(args.compare, encoding="utf-8") as fh:
+            baseline = json.load(fh)
+        if not compare(report, baseline, args.max_regression):
+            return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,95 @@
+"""
+Firmware update for the ESP32 dispenser over its UART link.
+
+Streams an application image (the .bin from `idf.py build`) into the inactive
+OTA partition, has the firmware verify it and reboot into it, then waits for the
+new firmware's hello banner. Replying to that banner is what confirms the new
+image; one that boots but never hears from the host is rolled back by the
+bootloader after a minute:
+
+    python ota_uart.py ESP32/build/ESP32.bin --key <64 hex digits>
+    DISPENSER_OTA_KEY=... python ota_uart.py ESP32/build/ESP32.bin --port /dev/ttyTHS1 --target-baud 2000000
+
+The key is the DISPENSER_OTA_KEY the running firmware was built with; the
+firmware refuses an image whose tag does not match it ("auth").
+
+Orders are refused while the update runs. A transfer that is interrupted leaves
+the running firmware untouched; simply run the command again.
+"""
+
+from __future__ import annotations
+
+import argparse
+import os
+import sys
+import time
+
+import sauron_uart
+
+
+def wait_for_reboot(session: sauron_uart.UartSession, old_boot_id: int | None, timeout_s: float) -> bool:
+    deadline = time.monotonic() + timeout_s
+    while time.monotonic() < deadline:
+        if session.boot_id is not None and session.boot_id != old_boot_id:
+            return True
+        time.sleep(0.2)
+    return False
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[1], formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image", help="application image (.bin)")
+    parser.add_argument("--key", default=os.environ.get("DISPENSER_OTA_KEY", ""), help="update key, 64 hex digits (default: $DISPENSER_OTA_KEY)")
+    parser.add_argument("--port", default="/dev/ttyUSB0")
+    parser.add_argument("--baud", type=int, default=sauron_uart.BOOT_BAUD_RATE)
+    parser.add_argument("--target-baud", type=int, default=0, help="negotiate this rate for the transfer")
+    parser.add_argument("--rtscts", action="store_true")
+    parser.add_argument("--window", type=int, default=8, help="OTA_DATA frames in flight")
+    parser.add_argument("--timeout", type=float, default=1.0, help="seconds to wait for each chunk's reply")
+    parser.add_argument("--reboot-timeout", type=float, default=15.0, help="seconds to wait for the new firmware")
+    args = parser.parse_args()
+    try:
+        key = bytes.fromhex(args.key)
+    except ValueError:
+        key = b""
+    if len(key) != 32:
+        parser.error("--key (or DISPENSER_OTA_KEY) must be 64 hex digits")
+
+    with open(args.image, "rb") as fh:
+        image = fh.read()
+
+    with sauron_uart.UartSession(args.port, args.baud, rtscts=args.rtscts) as session:
+        before = session.describe()
+        print(f"running {before['app']} from {before['partition']} ({before['ota']}), image {len(image)} bytes")
+        if args.target_baud and not session.negotiate_baud(args.target_baud):
+            print(f"could not switch to {args.target_baud} baud, staying at {session.baud}", file=sys.stderr)
+
+        started = time.monotonic()
+        last_print = [0.0]
+
+        def progress(done: int, total: int) -> None:
+            now = time.monotonic()
+            if now - last_print[0] >= 0.5 or done == total:
+                last_print[0] = now
+                rate = done / max(now - started, 1e-6) / 1024.0
+                print(f"\r{done}/{total} bytes ({100.0 * done / total:.0f}%, {rate:.1f} KiB/s)", end="", flush=True)
+
+        reply = session.ota_update(image, key, window=args.window, timeout_s=args.timeout, progress=progress)
+        print()
+        if reply is None or reply.get("status") != "ota_ok":
+            print(f"update failed: {reply}", file=sys.stderr)
+            return 1
+        print(f"image accepted in {time.monotonic() - started:.1f}s, firmware rebooting")
+
+        if not wait_for_reboot(session, before["boot_id"], args.reboot_timeout):
+            print("no hello from the new firmware; it rolls back if it does not come up", file=sys.stderr)
+            return 1
+        # Any valid host line confirms the new image; this also refreshes session.hello.
+        session.request(sauron_uart.build_json_command_line("hello"), timeout_s=1.0)
+        after = session.describe()
+        print(f"now running {after['app']} from {after['partition']} ({after['ota']})")
+        return 0 if after["partition"] != before["partition"] else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -4,6 +4,7 @@ import base64
 import json
 import os
 import re
+import time
 from datetime import datetime, timedelta, timezone
 from enum import Enum
 from pathlib import Path
@@ -11,6 +12,7 @@ from threading import RLock
 from typing import Any
 from zoneinfo import ZoneInfo
 
+import sauron_uart
 from advice_engine import generate_advice_payload
 from shared_user_storage import SharedUserStorage
 
@@ -39,6 +41,9 @@ class PillDispenserFSM:
     ESP32, RealSense, and Gemini calls are represented with placeholders.
     """
 
+    # Firmware replies to an order that stopped or never started it.
+    UART_REFUSED_STATUSES = frozenset({"cancelled", "estop", "busy", "bad_json", "bad_crc", "bad_payload", "bad_opcode"})
+
     def __init__(
         self,
         distance_threshold_m: float = 0.7,
@@ -80,6 +85,26 @@ class PillDispenserFSM:
         self._uart_baud = 115200
         self._uart_protocol = (str(os.getenv("UART_PROTOCOL", "json")).strip().lower() or "json")
         self._uart_timeout_s = max(0.5, float(os.getenv("UART_TIMEOUT_S", "6") or "6"))
+        # Once an order is queued: allowed silence = 1.5x the firmware's gap_ms + this.
+        self._uart_stall_slack_s = max(0.1, float(os.getenv("UART_STALL_SLACK_S", "1") or "1"))
+        self._uart_v2_retries = max(0, int(os.getenv("UART_V2_RETRIES", "2") or "2"))
+        self._uart_ack_mode = (str(os.getenv("UART_ACK_MODE", "json")).strip().lower() or "json")
+        # "serial" | "pipelined"; empty keeps the firmware's default.
+        self._uart_cycle_mode = str(os.getenv("UART_CYCLE_MODE", "")).strip().lower()
+        # "fifo" | "coalesce" (back-to-back orders share one motion run); empty keeps the default.
+        self._uart_schedule_mode = str(os.getenv("UART_SCHEDULE", "")).strip().lower()
+        # Optional post-handshake baud upgrade (0 = stay at the boot rate) and RTS/CTS.
+        self._uart_target_baud = int(os.getenv("UART_BAUD_TARGET", "0") or "0")
+        self._uart_rtscts = str(os.getenv("UART_RTSCTS", "0")).strip().lower() in {"1", "true", "yes", "on"}
+        self._uart_active_baud = self._uart_baud
+        self._uart_seq = 0
+        # The running order's latest queued/progress ACK, for status() while the
+        # dispense holds the lock; replaced whole, never mutated.
+        self._uart_progress: dict[str, Any] = {}
+        self._last_snapshot: dict[str, Any] = {}
+        self._uart_session: sauron_uart.UartSession | None = None
+        # Order the firmware journalled as cut short by a reset (see _check_uart_journal).
+        self._uart_interrupted_order: dict[str, Any] = {}
         self._uart_serial_enabled = str(os.getenv("UART_SERIAL_ENABLED", "1")).strip().lower() not in {"0", "false", "no", "off"}
         self._uart_offline_fallback = str(os.getenv("UART_OFFLINE_FALLBACK", "1")).strip().lower() not in {"0", "false", "no", "off"}
         self._motor_power = "EXTERNAL_BATTERY"
@@ -104,9 +129,17 @@ class PillDispenserFSM:
         self._record_event("INIT", self._state.value, "FSM initialized.")
 
     def status(self) -> dict:
-        with self._lock:
+        # A dispense holds the lock until the ESP32's final ACK; meanwhile answer from
+        # the last snapshot with the live progress, so the UI keeps updating.
+        if not self._lock.acquire(timeout=0.2):
+            return dict(self._last_snapshot, uart_progress=self._uart_progress)
+        try:
             self._maybe_auto_progress()
-            return self._snapshot()
+            snapshot = self._snapshot()
+            self._last_snapshot = dict(snapshot)
+            return snapshot
+        finally:
+            self._lock.release()
 
     def list_users(self) -> list[dict[str, str]]:
         with self._lock:
@@ -246,7 +279,7 @@ class PillDispenserFSM:
                     user_id=resolved_user_id,
                     medication=str(profile.get("medication", "")),
                     result="FAILED",
-                    details=f"uart={self._uart_transport} status={self._last_uart_result.get('status', 'UNKNOWN')}",
+                    details=f"uart={self._uart_transport} status={self._last_uart_result.get('status', 'UNKNOWN')}{self._uart_dispensed_detail()}",
                 )
                 return self._to_error("Failed to dispense pill for existing user.")
 
@@ -254,7 +287,7 @@ class PillDispenserFSM:
                 user_id=resolved_user_id,
                 medication=str(profile.get("medication", "")),
                 result="SKIPPED" if str(self._last_uart_result.get("status", "")).upper() == "NO_DUE" else "SUCCESS",
-                details=f"uart={self._uart_transport} status={self._last_uart_result.get('status', 'UNKNOWN')}",
+                details=f"uart={self._uart_transport} status={self._last_uart_result.get('status', 'UNKNOWN')}{self._uart_dispensed_detail()}",
             )
             self._dispense_stage_ends_at = self._now() + timedelta(
                 seconds=self._dispense_display_seconds
@@ -466,12 +499,30 @@ class PillDispenserFSM:
                 user_id=str(profile.get("id", "")),
                 medication=str(profile.get("medication", "")),
                 result="SUCCESS",
-                details=f"manual_override uart={self._uart_transport} status={self._last_uart_result.get('status', 'UNKNOWN')}",
+                details=f"manual_override uart={self._uart_transport} status={self._last_uart_result.get('status', 'UNKNOWN')}{self._uart_dispensed_detail()}",
             )
             self._manual_override_available = False
             return self._response(True, "Manual override dispense executed.")
 
+    def emergency_stop(self, payload: dict[str, Any] | None = None) -> dict:
+        payload = payload if isinstance(payload, dict) else {}
+        release = bool(payload.get("release", False))
+        confirmed = self._cancel_uart_orders(estop=True, release=release)
+        with self._lock:
+            action = "released" if release else "engaged"
+            self._record_event(
+                self._state.value,
+                self._state.value,
+                f"E-stop {action}{'' if confirmed else ' (not confirmed by the ESP32)'}.",
+            )
+            if not confirmed:
+                return self._response(False, "E-stop not confirmed: ESP32 not connected or not responding.")
+            return self._response(True, f"E-stop {action}.")
+
     def reset(self) -> dict:
+        # Cancel first, outside the lock: a dispense in progress holds the lock while
+        # it waits on the firmware, and its "cancelled" ACK is what lets it return.
+        self._cancel_uart_orders()
         with self._lock:
             if self._session_context:
                 self._finalize_session_record(
@@ -583,7 +634,11 @@ class PillDispenserFSM:
             return True
 
         channel_counts = list(dispense_plan.get("channel_counts", [0, 0, 0, 0]))
-        frame = self._build_uart_dispense_frame_from_channel_counts(channel_counts)
+        if self._uart_protocol == "frame_v2":
+            frame = self._build_uart_v2_dispense_frame(self._next_uart_seq(), [channel_counts])
+        else:
+            frame = self._build_uart_dispense_frame_from_channel_counts(channel_counts)
+        frame_format = str(frame.get("frame_format", "SAURON_UART_V1"))
         command = {
             "cmd": "DISPENSE",
             "request_id": request_id,
@@ -595,7 +650,8 @@ class PillDispenserFSM:
             "transport": self._uart_transport,
             "port": self._uart_port,
             "baud": self._uart_baud,
-            "frame_format": "SAURON_UART_V1",
+            "frame_format": frame_format,
+            "seq": frame.get("seq"),
             "channel_counts": channel_counts,
             "frame_hex": frame["frame_hex"],
             "frame_bytes": frame["frame_bytes"],
@@ -609,12 +665,14 @@ class PillDispenserFSM:
                 "request_id": request_id,
                 "transport": self._uart_transport,
                 "protocol": self._uart_protocol,
-                "frame_format": "SAURON_UART_V1",
+                "frame_format": frame_format,
                 "frame_hex": frame["frame_hex"],
             }
         )
         self._session_context["dispense_payload"] = plan_for_session
 
+        # What status() serves while the send below holds the lock.
+        self._last_snapshot = self._snapshot()
         response = self._send_uart_dispense_command(command)
         self._last_uart_result = response
         self._session_context["uart_ack"] = dict(response)
@@ -748,7 +806,10 @@ class PillDispenserFSM:
         try:
             response = self._send_uart_via_serial(command)
             if isinstance(response, dict):
-                if not bool(response.get("ack", False)) and self._uart_offline_fallback:
+                # A cancelled, e-stopped or refused order really did not dispense:
+                # never paper over it.
+                stopped = str(response.get("status", "")).lower() in self.UART_REFUSED_STATUSES
+                if not bool(response.get("ack", False)) and self._uart_offline_fallback and not stopped:
                     merged_fallback = dict(base)
                     merged_fallback.update(
                         {
@@ -797,6 +858,17 @@ class PillDispenserFSM:
         base.update({"status": "NO_UART_RESPONSE", "message": "UART returned no response."})
         return base
 
+    def _uart_session_for_command(self) -> sauron_uart.UartSession:
+        # One session for the FSM's lifetime: reopening the port per command toggles
+        # DTR/RTS and resets most dev boards. Reopened only after the port failed.
+        session = self._uart_session
+        if session is None:
+            session = sauron_uart.UartSession(self._uart_port, self._uart_baud, rtscts=self._uart_rtscts)
+            self._uart_session = session
+        if not session.is_open:
+            session.open()
+        return session
+
     def _send_uart_via_serial(self, command: dict[str, Any]) -> dict[str, Any]:
         if serial is None:
             raise RuntimeError("pyserial unavailable")
@@ -806,61 +878,213 @@ class PillDispenserFSM:
         channel_counts = command.get("channel_counts", [0, 0, 0, 0])
         if not isinstance(channel_counts, list):
             channel_counts = [0, 0, 0, 0]
+        expected_seq = command.get("seq") if proto == "frame_v2" else None
+
+        session = self._uart_session_for_command()
+        # Everything negotiated is forgotten by the session when the firmware resets,
+        # so these run again after every reboot and are free otherwise.
+        if self._uart_target_baud and session.baud != self._uart_target_baud:
+            session.negotiate_baud(self._uart_target_baud)
+        self._uart_active_baud = session.baud
+        if self._uart_ack_mode == "binary" and "ack_mode" not in session.negotiated:
+            self._negotiate_uart_ack_mode(session, timeout_s)
+        if self._uart_cycle_mode in sauron_uart.CYCLE_MODES and "cycle_mode" not in session.negotiated:
+            self._negotiate_uart_cycle_mode(session, timeout_s)
+        if self._uart_schedule_mode in sauron_uart.SCHEDULE_MODES and "schedule" not in session.negotiated:
+            self._negotiate_uart_schedule_mode(session, timeout_s)
+        if "journal" not in session.negotiated:
+            self._check_uart_journal(session, timeout_s)
+
+        if proto in {"frame", "frame_v2"}:
+            frame_bytes = command.get("frame_bytes")
+            if not isinstance(frame_bytes, list) or not frame_bytes:
+                raise ValueError("Missing frame_bytes for UART frame protocol.")
+            request = bytes(int(b) & 0xFF for b in frame_bytes)
+        else:
+            payload = {
+                "pill1": int(channel_counts[0] or 0),
+                "pill2": int(channel_counts[1] or 0),
+                "pill3": int(channel_counts[2] or 0),
+                "pill4": int(channel_counts[3] or 0),
+            }
+            request = (json.dumps(payload) + "\n").encode("utf-8")
+
+        # Firmware replies "queued" as soon as the order is accepted, a "progress"
+        # line per pill, then "done" once the motion task finishes. The receipt
+        # carries the order's gap_ms (longest expected wait for the next pill), so
+        # from then on a silence of about that long means stuck rather than slow;
+        # progress of an order sharing the motion run counts too. Before the receipt,
+        # or when the firmware sends no estimate (binary ACKs), timeout_s applies.
+        # The session routes V2 ACKs by seq; seq-less ones arrive in order, so a
+        # done/short before this order's "queued" is a late reply to an earlier one.
+        # A CRC NACK is retransmitted immediately instead of waiting out the timeout.
+        queued_payload: dict[str, Any] = {}
+        retries_left = self._uart_v2_retries if expected_seq is not None else 0
+        total = sum(int(c or 0) for c in channel_counts)
+        wait_s = timeout_s
+        next_wait_s = wait_s
+        self._uart_progress = {"status": "sent", "seq": expected_seq, "dispensed": 0, "total": total}
+        with session.send(request, seq=expected_seq, order=True) as exchange:
+            while True:
+                try:
+                    parsed = exchange.next(next_wait_s)
+                except sauron_uart.FirmwareReset as exc:
+                    return {
+                        "ack": False,
+                        "status": "RESET",
+                        "message": f"{exc}; see uart_interrupted_order",
+                        "hardware_online": True,
+                        "queued_ack": queued_payload,
+                    }
+                if parsed is None:
+                    last = session.last_progress_at
+                    idle_s = time.monotonic() - last if last is not None else wait_s
+                    if queued_payload and idle_s < wait_s:
+                        next_wait_s = wait_s - idle_s
+                        continue
+                    # The ESP32 may have reset (and returned to the boot rate).
+                    session.check_link()
+                    self._uart_active_baud = session.baud
+                    return {
+                        "ack": False,
+                        "status": "TIMEOUT",
+                        "message": f"No ACK within {wait_s:.1f}s",
+                        "hardware_online": bool(queued_payload),
+                        "queued_ack": queued_payload,
+                    }
 
-        with serial.Serial(self._uart_port, self._uart_baud, timeout=timeout_s) as ser:  # type: ignore[attr-defined]
-            try:
-                ser.reset_input_buffer()
-                ser.reset_output_buffer()
-            except Exception:
-                pass
+                status_key = str(parsed.get("status", "")).strip().lower()
+                next_wait_s = wait_s
+                if status_key == "queued":
+                    queued_payload = parsed
+                    gap_ms = parsed.get("gap_ms")
+                    if isinstance(gap_ms, int) and gap_ms > 0:
+                        wait_s = next_wait_s = 1.5 * gap_ms / 1000.0 + self._uart_stall_slack_s
+                    self._uart_progress = {
+                        "status": "queued",
+                        "seq": expected_seq,
+                        "dispensed": 0,
+                        "total": total,
+                        "eta_ms": parsed.get("eta_ms"),
+                    }
+                    continue
+                if status_key == "progress":
+                    if queued_payload:
+                        self._uart_progress = self._uart_progress_from_ack(parsed, queued_payload, expected_seq, total)
+                    continue
+                if expected_seq is None and status_key in {"done", "short"} and not queued_payload:
+                    continue
+                if status_key == "bad_crc" and retries_left > 0:
+                    retries_left -= 1
+                    session.write(request)
+                    continue
+                break
+            text = exchange.last_text
+
+        ack_status = str(parsed.get("status", text or "ACK")).strip()
+        self._uart_progress = dict(self._uart_progress, status=ack_status.lower())
+        if expected_seq is not None or parsed:
+            # Any firmware reply short of "done" means the order did not complete:
+            # "short" (fewer pills seen), "cancelled", "estop", "busy" (queue full or
+            # an update running), "bad_json", ...
+            ack_ok = ack_status.lower() == "done"
+        else:
+            # Legacy firmware answering with plain text.
+            ack_ok = ack_status.lower() in {"done", "ok", "success", "ack"}
 
-            if proto == "frame":
-                frame_bytes = command.get("frame_bytes")
-                if not isinstance(frame_bytes, list) or not frame_bytes:
-                    raise ValueError("Missing frame_bytes for UART frame protocol.")
-                ser.write(bytes(int(b) & 0xFF for b in frame_bytes))
-            else:
-                payload = {
-                    "pill1": int(channel_counts[0] or 0),
-                    "pill2": int(channel_counts[1] or 0),
-                    "pill3": int(channel_counts[2] or 0),
-                    "pill4": int(channel_counts[3] or 0),
-                }
-                ser.write((json.dumps(payload) + "\n").encode("utf-8"))
-
-            ser.flush()
-            raw = ser.readline()
-            if not raw:
-                return {
-                    "ack": False,
-                    "status": "TIMEOUT",
-                    "message": f"No ACK within {timeout_s:.1f}s",
-                    "hardware_online": False,
-                }
+        return {
+            "ack": bool(ack_ok),
+            "status": ack_status or "ACK",
+            "raw_ack": text,
+            "protocol": proto,
+            "seq": expected_seq,
+            "hardware_online": True,
+            "degraded": False,
+            "ack_payload": parsed,
+            "ack_counts": parsed.get("counts") if isinstance(parsed.get("counts"), list) else [],
+            "dispensed_counts": parsed.get("dispensed") if isinstance(parsed.get("dispensed"), list) else [],
+            "queued_ack": queued_payload,
+        }
 
-            text = raw.decode("utf-8", errors="replace").strip()
-            parsed: dict[str, Any] = {}
-            if text.startswith("{") and text.endswith("}"):
-                try:
-                    obj = json.loads(text)
-                except json.JSONDecodeError:
-                    obj = {}
-                if isinstance(obj, dict):
-                    parsed = obj
-
-            ack_status = str(parsed.get("status", text or "ACK")).strip()
-            ack_ok = ack_status.lower() in {"done", "ok", "success", "ack"} or bool(parsed)
-
-            return {
-                "ack": bool(ack_ok),
-                "status": ack_status or "ACK",
-                "raw_ack": text,
-                "protocol": proto,
-                "hardware_online": True,
-                "degraded": False,
-                "ack_payload": parsed,
-                "ack_counts": parsed.get("counts") if isinstance(parsed.get("counts"), list) else [],
-            }
+    @staticmethod
+    def _uart_progress_from_ack(
+        ack: dict[str, Any], queued: dict[str, Any], seq: int | None, total: int
+    ) -> dict[str, Any]:
+        dispensed = ack.get("dispensed") if isinstance(ack.get("dispensed"), list) else []
+        return {
+            "status": "progress",
+            "seq": seq,
+            "dispensed": sum(int(n or 0) for n in dispensed),
+            "total": total,
+            "channel": ack.get("channel"),
+            "elapsed_ms": ack.get("elapsed_ms"),
+            "eta_ms": queued.get("eta_ms"),
+        }
+
+    def _cancel_uart_orders(self, *, estop: bool = False, release: bool = False) -> bool:
+        # Only an open session can have orders running; never opens the port for this.
+        session = self._uart_session
+        if session is None or not session.is_open:
+            return False
+        try:
+            return session.cancel(estop=estop, release=release)
+        except Exception:
+            return False
+
+    def _negotiate_uart_cycle_mode(self, session: sauron_uart.UartSession, timeout_s: float) -> None:
+        # Only a throughput setting: if the firmware does not confirm, dispense in
+        # whatever mode it is already in (and do not ask again until it resets).
+        session.request(
+            sauron_uart.build_json_command_line("cycle_mode", mode=self._uart_cycle_mode), timeout_s=timeout_s
+        )
+        session.negotiated["cycle_mode"] = self._uart_cycle_mode
+
+    def _negotiate_uart_schedule_mode(self, session: sauron_uart.UartSession, timeout_s: float) -> None:
+        # Like the cycle mode: only throughput, so an unconfirmed switch is not an error.
+        session.request(
+            sauron_uart.build_json_command_line("schedule", mode=self._uart_schedule_mode), timeout_s=timeout_s
+        )
+        session.negotiated["schedule"] = self._uart_schedule_mode
+
+    def _check_uart_journal(self, session: sauron_uart.UartSession, timeout_s: float) -> None:
+        # Best-effort: firmware without a journal answers bad_opcode, which counts as
+        # checked. The interrupted order is recorded before the firmware is told to
+        # forget it; resuming it is left to the operator (remaining counts assume any
+        # pill that was mid-cycle did drop, so nothing is dispensed twice).
+        reply = session.request(sauron_uart.build_json_command_line("journal"), timeout_s=timeout_s)
+        if reply is None:
+            return
+        session.negotiated["journal"] = True
+        interrupted = reply.get("interrupted") if reply.get("status") == "journal" else None
+        if not isinstance(interrupted, dict):
+            return
+        order = dict(interrupted)
+        order["remaining"] = sauron_uart.journal_remaining_counts(interrupted)
+        order["reported_at"] = self._now().isoformat()
+        order["reset_reason"] = session.hello.get("reset_reason")
+        self._uart_interrupted_order = order
+        self._record_event(
+            self._state.value,
+            self._state.value,
+            "ESP32 reset mid-order: "
+            f"{order.get('protocol')} seq={order.get('seq')} counts={order.get('counts')} "
+            f"dispensed={order.get('dispensed')} remaining={order['remaining']}",
+        )
+        session.request(sauron_uart.build_json_command_line("journal", clear=True), timeout_s=timeout_s)
+
+    def _uart_dispensed_detail(self) -> str:
+        dispensed = self._last_uart_result.get("dispensed_counts")
+        if not isinstance(dispensed, list) or not dispensed:
+            return ""
+        return " dispensed=" + ",".join(str(int(n or 0)) for n in dispensed)
+
+    def _negotiate_uart_ack_mode(self, session: sauron_uart.UartSession, timeout_s: float) -> None:
+        # Binary ACKs are opt-in (JSON stays the firmware default); the confirmation
+        # already arrives in the new format.
+        reply = session.request(sauron_uart.build_json_ack_mode_line(binary=True), timeout_s=timeout_s)
+        if reply is None or reply.get("status") != "ack_mode_ok":
+            raise TimeoutError(f"Binary ACK mode not confirmed within {timeout_s:.1f}s")
+        session.negotiated["ack_mode"] = "binary"
 
     def _phase_for_state(self, state: WorkflowState) -> str:
         if state == WorkflowState.WAITING_FOR_USER:
@@ -926,24 +1150,36 @@ class PillDispenserFSM:
         return self._build_uart_dispense_frame_from_channel_counts(channel_counts)
 
     def _build_uart_dispense_frame_from_channel_counts(self, channel_counts: list[int]) -> dict[str, Any]:
-        counts = [0, 0, 0, 0]
-        if isinstance(channel_counts, list):
-            for idx in range(min(4, len(channel_counts))):
-                try:
-                    counts[idx] = max(0, min(20, int(channel_counts[idx] or 0)))
-                except (TypeError, ValueError):
-                    counts[idx] = 0
-        frame_body = [0x01, *counts]
-        checksum = sum(frame_body) & 0xFF
-        frame_bytes = [0xAA, *frame_body, checksum, 0x55]
-        frame_hex = " ".join(f"{b:02X}" for b in frame_bytes)
+        counts = sauron_uart.normalize_channel_counts(channel_counts if isinstance(channel_counts, list) else [])
+        frame_bytes = list(sauron_uart.build_v1_frame(counts))
         return {
+            "frame_format": "SAURON_UART_V1",
             "channel_counts": counts,
-            "checksum": checksum,
+            "checksum": frame_bytes[6],
             "frame_bytes": frame_bytes,
-            "frame_hex": frame_hex,
+            "frame_hex": sauron_uart.frame_hex(frame_bytes),
         }
 
+    def _build_uart_v2_dispense_frame(self, seq: int, orders: list[list[int]]) -> dict[str, Any]:
+        """
+        SAURON_UART_V2 dispense batch (see sauron_uart.py for the byte layout).
+        Carries one or more orders under a single seq; the ESP32 ACKs each order
+        with {"seq": seq, "order": index}.
+        """
+        normalized = [sauron_uart.normalize_channel_counts(order) for order in orders]
+        frame_bytes = list(sauron_uart.build_v2_dispense_batch(seq, normalized))
+        return {
+            "frame_format": "SAURON_UART_V2",
+            "seq": seq & 0xFFFF,
+            "channel_counts": normalized[0] if len(normalized) == 1 else normalized,
+            "frame_bytes": frame_bytes,
+            "frame_hex": sauron_uart.frame_hex(frame_bytes),
+        }
+
+    def _next_uart_seq(self) -> int:
+        self._uart_seq = (self._uart_seq + 1) % sauron_uart.SESSION_CONTROL_SEQ
+        return self._uart_seq
+
     def _default_timezone_name(self) -> str:
         try:
             tzname = datetime.now().astimezone().tzinfo
@@ -1600,11 +1836,13 @@ class PillDispenserFSM:
             "uart_transport": self._uart_transport,
             "uart_port": self._uart_port,
             "uart_baud": self._uart_baud,
+            "uart_active_baud": self._uart_active_baud,
             "motor_power_domain": self._motor_power,
             "compute_node": self._compute_node,
             "camera_source": self._camera_source,
             "last_uart_command": self._last_uart_command,
             "last_uart_result": self._last_uart_result,
+            "uart_progress": self._uart_progress,
             "last_dispense_plan": self._last_dispense_plan,
             "advice_text": self._advice_text,
             "last_advice_payload": self._last_advice_payload,
@@ -1626,6 +1864,10 @@ class PillDispenserFSM:
             "last_session_summary": self._last_session_summary,
             "hardware_degrade_mode": bool(self._uart_offline_fallback),
             "uart_protocol": self._uart_protocol,
+            "uart_ack_mode": self._uart_ack_mode,
+            "uart_cycle_mode": self._uart_cycle_mode or "firmware_default",
+            "uart_interrupted_order": self._uart_interrupted_order,
+            "uart_session": self._uart_session.describe() if self._uart_session else {"open": False},
             "uart_serial_enabled": bool(self._uart_serial_enabled),
         }
 
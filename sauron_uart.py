@@ -0,0 +1,890 @@
+"""
+Host-side codec for the Jetson <-> ESP32 UART protocol.
+
+Shared by the Flask FSM (`pill_dispenser_fsm.py`) and the bench/test scripts so
+frame layouts and checksums live in one place and match the firmware in `ESP32/components/dispenser`.
+
+SAURON_UART_V1 (8 bytes, no sequence number):
+  [0] 0xAA  [1] 0x01  [2..5] ch1..ch4 counts  [6] sum(bytes[1:6]) & 0xFF  [7] 0x55
+
+SAURON_UART_V2 (9 + N bytes):
+  [0]        0xAA start
+  [1]        0x02 version
+  [2..3]     seq (u16, little-endian), echoed back in every ACK for the frame
+  [4]        opcode
+  [5]        payload length N (<= 240)
+  [6..6+N-1] payload
+  [6+N..7+N] CRC16-CCITT (poly 0x1021, init 0xFFFF) over bytes [1..5+N], little-endian
+  [8+N]      0x55 end
+
+V2 DISPENSE_BATCH payload: [0] n_orders  [1] n_channels C  then C counts per order.
+The firmware zero-fills channels beyond C, so a 4-channel host works unchanged
+against a wider build.
+
+Binary ACK (ESP32 -> host, 11 + N bytes, enabled via ack-mode negotiation):
+  [0] 0xA5  [1..2] seq (LE, 0xFFFF = none)  [3] status code  [4] order
+  [5] n_channels N  [6..5+N] counts
+  [6+N..7+N] detail (u16 LE; result bits for done/short, queue depth for queued/busy)
+  [8+N..9+N] CRC16-CCITT over bytes [1..7+N] (LE)  [10+N] 0x5A
+For done/short the counts are what was actually dispensed (drop-sensed channels
+can fall short); JSON ACKs carry them as "dispensed" next to the requested "counts".
+
+A cancel or e-stop ends every order it stops with a final "cancelled" ACK
+(carrying what was dispensed), after the command's own cancel_ok/estop_ok.
+
+Firmware update (OTA_BEGIN / OTA_DATA / OTA_END): the image goes into the inactive
+flash partition and the firmware reboots into it after END, which carries
+HMAC-SHA256 of the image under the key the firmware was built with; every reply is a JSON
+"ota_ok"/"ota_error" line carrying "offset", the bytes accepted so far. The new
+image has to hear from the host within a minute of booting or the bootloader
+rolls back to the previous one.
+
+Unsolicited JSON lines (protocol "boot", "heartbeat" or "ota"): a "hello" banner when
+the firmware is ready, a "journal" report if a reset interrupted an order, a
+"heartbeat" every heartbeat_ms and the result of a Wi-Fi update. read_ack() skips
+them unless asked not to; UartSession uses them to notice resets while it holds
+the port open.
+"""
+
+from __future__ import annotations
+
+import hashlib
+import hmac
+import itertools
+import json
+import queue
+import threading
+import time
+import zlib
+from typing import Any, Iterable
+
+FRAME_START = 0xAA
+FRAME_END = 0x55
+FRAME_VERSION_V1 = 0x01
+FRAME_VERSION_V2 = 0x02
+
+V2_MAX_PAYLOAD = 240
+V2_MAX_BATCH_ORDERS = 8
+
+V2_OP_DISPENSE_BATCH = 0x01
+V2_OP_PING = 0x02
+V2_OP_SET_ACK_MODE = 0x03
+V2_OP_SET_BAUD = 0x04
+V2_OP_SET_CHANNEL_NAME = 0x05
+V2_OP_SET_PROFILE = 0x06
+V2_OP_SET_CYCLE_MODE = 0x07
+V2_OP_GET_STATS = 0x08
+V2_OP_GET_JOURNAL = 0x09
+V2_OP_HELLO = 0x0A
+V2_OP_CANCEL = 0x0B
+V2_OP_ESTOP = 0x0C
+V2_OP_SET_SCHEDULE = 0x0D
+V2_OP_OTA_BEGIN = 0x0E
+V2_OP_OTA_DATA = 0x0F
+V2_OP_OTA_END = 0x10
+V2_OP_OTA_ABORT = 0x11
+V2_OP_SET_CALIBRATION = 0x12
+V2_OP_SERVO_PULSE = 0x13
+
+# Image bytes per OTA_DATA frame (the u32 offset takes the rest of the payload).
+OTA_CHUNK_MAX = V2_MAX_PAYLOAD - 4
+
+# Index = motion_shape_t in the firmware.
+MOTION_SHAPES = ("linear", "trapezoid", "scurve")
+
+BOOT_BAUD_RATE = 115200
+SUPPORTED_BAUD_RATES = (115200, 230400, 460800, 921600, 2000000)
+BAUD_CONFIRM_WINDOW_S = 1.0
+
+ACK_MODE_JSON = 0
+ACK_MODE_BINARY = 1
+
+# Index = cycle_mode_t in the firmware.
+CYCLE_MODES = ("serial", "pipelined")
+
+# Index = schedule_mode_t in the firmware. "coalesce" runs every waiting order in
+# one motion run; each order still gets its own done/short ACK.
+SCHEDULE_MODES = ("fifo", "coalesce")
+
+ACK_FRAME_START = 0xA5
+ACK_FRAME_END = 0x5A
+ACK_FRAME_HEADER_LEN = 6
+ACK_FRAME_OVERHEAD = 11
+ACK_NO_SEQ = 0xFFFF
+# Seq for UartSession's own control frames (cancel/e-stop); order seqs stay below it.
+SESSION_CONTROL_SEQ = 0xFFFE
+
+# Index = binary status code (matches ack_status_t in the firmware).
+ACK_STATUS_NAMES = [
+    "",
+    "queued",
+    "done",
+    "busy",
+    "bad_json",
+    "bad_crc",
+    "bad_payload",
+    "bad_opcode",
+    "pong",
+    "ack_mode_ok",
+    "baud_ok",
+    "map_ok",
+    "profile_ok",
+    "short",
+    "cycle_mode_ok",
+    "stats",
+    "journal",
+    "hello",
+    "heartbeat",
+    "cancelled",
+    "cancel_ok",
+    "estop_ok",
+    "estop",
+    "schedule_ok",
+    "progress",
+    "ota_ok",
+    "ota_error",
+    "cal_ok",
+]
+
+MAX_PILLS_PER_CHANNEL = 20
+CHANNEL_COUNT = 4
+MAX_CHANNELS = 16
+
+# Statuses that end a command exchange; "queued" is only an intermediate receipt
+# and "progress" (one per pill counted) only says the order is still moving.
+TERMINAL_ACK_STATUSES = {"done", "busy", "bad_json", "bad_crc", "bad_payload", "bad_opcode", "pong", "ack_mode_ok", "baud_ok", "map_ok", "profile_ok", "short", "cycle_mode_ok", "stats", "journal", "hello", "cancelled", "cancel_ok", "estop_ok", "estop", "schedule_ok", "ota_ok", "ota_error", "cal_ok"}
+# "ota" is the result of an update the firmware fetched over Wi-Fi on its own.
+UNSOLICITED_PROTOCOLS = {"boot", "heartbeat", "ota"}
+# Seq-less replies by family: these only ever belong to an order (its receipt,
+# progress and final reply), these are refusals either an order or a command can
+# get as its one and only reply, and every other status answers a command.
+ORDER_ACK_STATUSES = {"queued", "progress", "done", "short", "cancelled"}
+REFUSAL_ACK_STATUSES = {"busy", "estop", "bad_json", "bad_crc", "bad_payload", "bad_opcode"}
+
+
+def normalize_channel_counts(channel_counts: Iterable[Any] | None, channel_count: int = CHANNEL_COUNT) -> list[int]:
+    counts = [0] * channel_count
+    for idx, raw in enumerate(list(channel_counts or [])[:channel_count]):
+        try:
+            counts[idx] = max(0, min(MAX_PILLS_PER_CHANNEL, int(raw or 0)))
+        except (TypeError, ValueError):
+            counts[idx] = 0
+    return counts
+
+
+def crc16_ccitt(data: bytes | bytearray | Iterable[int], crc: int = 0xFFFF) -> int:
+    for byte in data:
+        crc ^= (int(byte) & 0xFF) << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if (crc & 0x8000) else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def build_v1_frame(channel_counts: Iterable[Any]) -> bytes:
+    body = [FRAME_VERSION_V1, *normalize_channel_counts(channel_counts)]
+    checksum = sum(body) & 0xFF
+    return bytes([FRAME_START, *body, checksum, FRAME_END])
+
+
+def build_v2_frame(seq: int, opcode: int, payload: bytes | bytearray | Iterable[int] = b"") -> bytes:
+    payload = bytes(int(b) & 0xFF for b in payload)
+    if len(payload) > V2_MAX_PAYLOAD:
+        raise ValueError(f"V2 payload too long ({len(payload)} > {V2_MAX_PAYLOAD})")
+    seq &= 0xFFFF
+    header = bytes([FRAME_VERSION_V2, seq & 0xFF, (seq >> 8) & 0xFF, opcode & 0xFF, len(payload)])
+    crc = crc16_ccitt(header + payload)
+    return bytes([FRAME_START]) + header + payload + bytes([crc & 0xFF, (crc >> 8) & 0xFF, FRAME_END])
+
+
+def build_v2_dispense_batch(
+    seq: int, orders: Iterable[Iterable[Any]], channel_count: int = CHANNEL_COUNT
+) -> bytes:
+    """One frame carrying several orders; the firmware ACKs each with (seq, order)."""
+    if not 1 <= channel_count <= MAX_CHANNELS:
+        raise ValueError(f"V2 batch channel count must be 1..{MAX_CHANNELS}")
+    order_list = [normalize_channel_counts(order, channel_count) for order in orders]
+    if not order_list or len(order_list) > V2_MAX_BATCH_ORDERS:
+        raise ValueError(f"V2 batch must carry 1..{V2_MAX_BATCH_ORDERS} orders")
+    payload = [len(order_list), channel_count]
+    for counts in order_list:
+        payload.extend(counts)
+    return build_v2_frame(seq, V2_OP_DISPENSE_BATCH, payload)
+
+
+def build_v2_ping(seq: int) -> bytes:
+    return build_v2_frame(seq, V2_OP_PING)
+
+
+def frame_hex(frame: bytes | bytearray | Iterable[int]) -> str:
+    return " ".join(f"{int(b) & 0xFF:02X}" for b in frame)
+
+
+def build_v2_set_ack_mode(seq: int, mode: int) -> bytes:
+    return build_v2_frame(seq, V2_OP_SET_ACK_MODE, [mode])
+
+
+def build_json_ack_mode_line(binary: bool) -> bytes:
+    return build_json_command_line("ack_mode", mode="binary" if binary else "json")
+
+
+def build_v2_set_cycle_mode(seq: int, mode: str) -> bytes:
+    return build_v2_frame(seq, V2_OP_SET_CYCLE_MODE, [CYCLE_MODES.index(mode)])
+
+
+def build_v2_set_schedule(seq: int, mode: str) -> bytes:
+    return build_v2_frame(seq, V2_OP_SET_SCHEDULE, [SCHEDULE_MODES.index(mode)])
+
+
+def decode_binary_ack(frame: bytes | bytearray) -> dict[str, Any] | None:
+    """Decode one binary ACK into the same keys the JSON ACK uses."""
+    if len(frame) < ACK_FRAME_HEADER_LEN or frame[0] != ACK_FRAME_START or frame[-1] != ACK_FRAME_END:
+        return None
+    nch = frame[5]
+    if len(frame) != ACK_FRAME_OVERHEAD + nch:
+        return None
+    crc_at = ACK_FRAME_HEADER_LEN + nch + 2
+    if crc16_ccitt(frame[1:crc_at]) != (frame[crc_at] | (frame[crc_at + 1] << 8)):
+        return None
+    seq = frame[1] | (frame[2] << 8)
+    code = frame[3]
+    detail = frame[crc_at - 2] | (frame[crc_at - 1] << 8)
+    status = ACK_STATUS_NAMES[code] if 0 < code < len(ACK_STATUS_NAMES) else f"code_{code}"
+    ack: dict[str, Any] = {
+        "status": status,
+        "protocol": "binary_ack",
+        "counts": list(frame[ACK_FRAME_HEADER_LEN:ACK_FRAME_HEADER_LEN + nch]),
+        "order": frame[4],
+    }
+    if seq != ACK_NO_SEQ:
+        ack["seq"] = seq
+    if status in {"done", "short"}:
+        ack["dispensed"] = ack["counts"]
+        ack["result_bits"] = detail
+    elif status == "progress":
+        ack["dispensed"] = ack["counts"]
+        ack["channel"] = detail
+    elif status in {"queued", "busy"}:
+        ack["queue_depth"] = detail
+    return ack
+
+
+def parse_json_ack(text: str) -> dict[str, Any]:
+    if not (text.startswith("{") and text.endswith("}")):
+        return {}
+    try:
+        obj = json.loads(text)
+    except json.JSONDecodeError:
+        return {}
+    return obj if isinstance(obj, dict) else {}
+
+
+def read_ack(ser: Any, include_unsolicited: bool = False) -> tuple[dict[str, Any], str] | None:
+    """
+    Read the next ACK from a pyserial-like port, accepting either a JSON line or a
+    binary ACK frame. Returns (parsed, raw_text) or None when the port times out.
+    A corrupt binary frame is skipped; a non-JSON line returns ({}, text).
+    Heartbeats and boot reports are skipped unless include_unsolicited; the port
+    timeout then bounds the whole call, so a steady heartbeat cannot hold it open.
+    """
+    timeout = getattr(ser, "timeout", None)
+    deadline = None if timeout is None else time.monotonic() + float(timeout)
+    while True:
+        received = _read_one_ack(ser)
+        if received is None or include_unsolicited or received[0].get("protocol") not in UNSOLICITED_PROTOCOLS:
+            return received
+        if deadline is not None and time.monotonic() >= deadline:
+            return None
+
+
+def _read_one_ack(ser: Any) -> tuple[dict[str, Any], str] | None:
+    while True:
+        first = ser.read(1)
+        if not first:
+            return None
+        if first[0] == ACK_FRAME_START:
+            header = first + ser.read(ACK_FRAME_HEADER_LEN - 1)
+            if len(header) < ACK_FRAME_HEADER_LEN:
+                return None
+            if header[5] > MAX_CHANNELS:
+                continue
+            rest_len = ACK_FRAME_OVERHEAD - ACK_FRAME_HEADER_LEN + header[5]
+            frame = header + ser.read(rest_len)
+            if len(frame) < ACK_FRAME_HEADER_LEN + rest_len:
+                return None
+            ack = decode_binary_ack(frame)
+            if ack is not None:
+                return ack, frame_hex(frame)
+            continue
+        if first in (b"\r", b"\n"):
+            continue
+        text = (first + ser.readline()).decode("utf-8", errors="replace").strip()
+        if text:
+            return parse_json_ack(text), text
+
+
+def build_v2_set_baud(seq: int, baud: int) -> bytes:
+    return build_v2_frame(seq, V2_OP_SET_BAUD, int(baud).to_bytes(4, "little"))
+
+
+def build_v2_set_channel_name(seq: int, channel: int, name: str) -> bytes:
+    """Rename a slot (channel 1-N) in the firmware's NVS-backed map; "" restores the default."""
+    return build_v2_frame(seq, V2_OP_SET_CHANNEL_NAME, bytes([int(channel)]) + name.encode("ascii"))
+
+
+def build_v2_set_profile(
+    seq: int,
+    channel: int,
+    shape: str = "scurve",
+    travel_deg: int = 180,
+    vmax_dps: int = 720,
+    accel_dps2: int = 6000,
+    dwell_ms: int = 0,
+    pause_ms: int = 200,
+) -> bytes:
+    """Store a channel's (1-N) motion profile; the firmware replies with all profiles."""
+    payload = bytes([int(channel), MOTION_SHAPES.index(shape), int(travel_deg)])
+    for value in (vmax_dps, accel_dps2, dwell_ms, pause_ms):
+        payload += int(value).to_bytes(2, "little")
+    return build_v2_frame(seq, V2_OP_SET_PROFILE, payload)
+
+
+def build_v2_reset_profile(seq: int, channel: int) -> bytes:
+    return build_v2_frame(seq, V2_OP_SET_PROFILE, [int(channel)])
+
+
+def build_v2_set_calibration(seq: int, channel: int, min_pulse_us: int, max_pulse_us: int) -> bytes:
+    """
+    Store a channel's (1-N) pulse widths at 0 and 180 deg (min > max reverses the
+    servo); the firmware replies "cal_ok" with every channel's range, or "busy"
+    while an order is queued or running.
+    """
+    payload = bytes([int(channel)]) + int(min_pulse_us).to_bytes(2, "little") + int(max_pulse_us).to_bytes(2, "little")
+    return build_v2_frame(seq, V2_OP_SET_CALIBRATION, payload)
+
+
+def build_v2_reset_calibration(seq: int, channel: int) -> bytes:
+    return build_v2_frame(seq, V2_OP_SET_CALIBRATION, [int(channel)])
+
+
+def build_v2_servo_pulse(seq: int, channel: int, pulse_us: int) -> bytes:
+    """Calibration jog: drive a channel's servo to a raw pulse width (300-2700 us)."""
+    return build_v2_frame(seq, V2_OP_SERVO_PULSE, bytes([int(channel)]) + int(pulse_us).to_bytes(2, "little"))
+
+
+def build_v2_get_stats(seq: int, reset: bool = False) -> bytes:
+    return build_v2_frame(seq, V2_OP_GET_STATS, [1] if reset else [])
+
+
+def build_v2_hello(seq: int) -> bytes:
+    return build_v2_frame(seq, V2_OP_HELLO)
+
+
+def build_v2_cancel(seq: int) -> bytes:
+    """Stop the running order (servos to the safe angle within one servo period) and drop the queued ones."""
+    return build_v2_frame(seq, V2_OP_CANCEL)
+
+
+def build_v2_estop(seq: int, release: bool = False) -> bytes:
+    """Cancel and refuse further orders ("estop") until called again with release=True."""
+    return build_v2_frame(seq, V2_OP_ESTOP, [1] if release else [])
+
+
+def build_v2_ota_begin(seq: int, size: int, crc32: int) -> bytes:
+    """Start an update of size bytes; the firmware erases each sector as the data reaches it."""
+    return build_v2_frame(seq, V2_OP_OTA_BEGIN, int(size).to_bytes(4, "little") + (int(crc32) & 0xFFFFFFFF).to_bytes(4, "little"))
+
+
+def build_v2_ota_data(seq: int, offset: int, chunk: bytes) -> bytes:
+    if not 0 < len(chunk) <= OTA_CHUNK_MAX:
+        raise ValueError(f"OTA chunk must be 1..{OTA_CHUNK_MAX} bytes")
+    return build_v2_frame(seq, V2_OP_OTA_DATA, int(offset).to_bytes(4, "little") + bytes(chunk))
+
+
+def ota_image_tag(image: bytes, key: bytes) -> bytes:
+    """The tag OTA_END must carry: HMAC-SHA256 of the whole image under the firmware's update key."""
+    return hmac.new(key, image, hashlib.sha256).digest()
+
+
+def build_v2_ota_end(seq: int, tag: bytes) -> bytes:
+    """Check the image against tag (see ota_image_tag), make it the boot partition and reboot into it."""
+    if len(tag) != 32:
+        raise ValueError("OTA tag must be 32 bytes")
+    return build_v2_frame(seq, V2_OP_OTA_END, bytes(tag))
+
+
+def build_v2_ota_abort(seq: int) -> bytes:
+    return build_v2_frame(seq, V2_OP_OTA_ABORT)
+
+
+def build_v2_get_journal(seq: int, clear: bool = False) -> bytes:
+    """Ask for the order a reset interrupted; clear=True forgets it after this reply."""
+    return build_v2_frame(seq, V2_OP_GET_JOURNAL, [1] if clear else [])
+
+
+def journal_remaining_counts(interrupted: dict[str, Any]) -> list[int]:
+    """
+    Pills still owed for an interrupted order from a "journal" reply. A channel
+    that was mid-cycle may already have dropped its next pill, so it is counted as
+    delivered: resuming with these counts never dispenses more than was ordered.
+    For a coalesced run ("orders" > 1) these are the run's totals.
+    """
+    counts = list(interrupted.get("counts") or [])
+    dispensed = list(interrupted.get("dispensed") or [])
+    in_flight = int(interrupted.get("in_flight", 0) or 0)
+    remaining = []
+    for ch, target in enumerate(counts):
+        done = int(dispensed[ch]) if ch < len(dispensed) else 0
+        if in_flight & (1 << ch):
+            done += 1
+        remaining.append(max(0, int(target) - done))
+    return remaining
+
+
+def stats_hist_percentile(hist: dict[str, Any], q: float) -> int:
+    """
+    Approximate the q-th percentile (0..1) of a firmware stats histogram, e.g.
+    reply["latency_us"]. Bucket b holds [2^(b-1), 2^b) us, so this returns the
+    upper bound of the bucket containing the percentile (capped at "max").
+    """
+    buckets = list(hist.get("log2") or [])
+    total = sum(buckets)
+    if total == 0:
+        return 0
+    target = q * total
+    seen = 0
+    for b, n in enumerate(buckets):
+        seen += n
+        if seen >= target:
+            return min(1 << b, int(hist.get("max", 1 << b))) if b else 0
+    return int(hist.get("max", 0))
+
+
+def build_json_command_line(cmd: str, **fields: Any) -> bytes:
+    return (json.dumps({"cmd": cmd, **fields}) + "\n").encode("utf-8")
+
+
+def negotiate_baud(ser: Any, target_baud: int) -> bool:
+    """
+    Switch an open pyserial port and the firmware to target_baud.
+
+    The firmware ACKs "baud_ok" at the current rate, switches, and falls back to
+    BOOT_BAUD_RATE unless a valid message arrives at the new rate within
+    BAUD_CONFIRM_WINDOW_S. On any failure this restores the port to the boot rate
+    (after the firmware's window expires) and returns False.
+    """
+    if int(target_baud) not in SUPPORTED_BAUD_RATES:
+        raise ValueError(f"Unsupported baud rate {target_baud}")
+    if int(ser.baudrate) == int(target_baud):
+        return True
+
+    ser.write(build_json_command_line("baud", rate=int(target_baud)))
+    ser.flush()
+    received = read_ack(ser)
+    if received is None or received[0].get("status") != "baud_ok":
+        return False
+
+    ser.baudrate = int(target_baud)
+    ser.reset_input_buffer()
+    ser.write(build_json_command_line("ping"))
+    ser.flush()
+    received = read_ack(ser)
+    if received is not None and received[0].get("status") == "pong":
+        return True
+
+    time.sleep(BAUD_CONFIRM_WINDOW_S)
+    ser.baudrate = BOOT_BAUD_RATE
+    ser.reset_input_buffer()
+    return False
+
+
+class FirmwareReset(Exception):
+    """The firmware rebooted (new boot_id) while an exchange was waiting for replies."""
+
+
+class UartExchange:
+    """
+    Replies to one request, routed by UartSession's reader thread: by seq when the
+    request has one (V2), otherwise first-in first-out among seq-less requests
+    (V1/JSON, which the firmware answers strictly in order) of the same kind. An
+    order's replies go to the oldest seq-less order, a command's to the oldest
+    seq-less command, so a stats or hello reply never ends an order still running
+    and an order's late "done" never answers a command. A refusal goes to the
+    oldest seq-less request that has no reply yet. Close it (or use it as a context
+    manager) once the final reply is in, or later replies pile up here.
+    """
+
+    def __init__(self, session: "UartSession", seq: int | None, order: bool = False) -> None:
+        self.seq = seq
+        self.order = order
+        self.answered = False  # a reply has been routed here (set by the reader thread)
+        self.last_text = ""
+        self._session = session
+        self._replies: queue.Queue = queue.Queue()
+
+    def accepts(self, ack: dict[str, Any]) -> bool:
+        if self.seq is not None:
+            return ack.get("seq") == self.seq
+        if "seq" in ack:
+            return False
+        status = ack.get("status")
+        if status in ORDER_ACK_STATUSES:
+            return self.order
+        if status in REFUSAL_ACK_STATUSES:
+            return not self.answered
+        return not self.order
+
+    def next(self, timeout_s: float) -> dict[str, Any] | None:
+        """Next reply, or None on timeout. Raises FirmwareReset or ConnectionError."""
+        try:
+            item = self._replies.get(timeout=max(0.0, timeout_s))
+        except queue.Empty:
+            return None
+        if isinstance(item, BaseException):
+            raise item
+        ack, self.last_text = item
+        return ack
+
+    def close(self) -> None:
+        self._session._release(self)
+
+    def __enter__(self) -> "UartExchange":
+        return self
+
+    def __exit__(self, *exc: Any) -> None:
+        self.close()
+
+
+class UartSession:
+    """
+    One long-lived connection to the firmware, instead of a port opened per command.
+
+    Opening a port toggles DTR/RTS, which on most ESP32 dev boards pulses EN and
+    resets the chip; the session opens the port once with both lines released and
+    keeps it. A reader thread parses everything the firmware sends and hands each
+    reply to the UartExchange waiting for it. The hello banner and heartbeats carry
+    a boot_id: when it changes the firmware has reset, so pending exchanges fail
+    with FirmwareReset, the negotiated settings (baud rate, ack mode, ...) recorded
+    in `negotiated` are forgotten and the caller renegotiates on its next command.
+    """
+
+    LIVENESS_HEARTBEATS = 3  # missed heartbeats before the link counts as down
+
+    def __init__(self, port: str, baud: int = BOOT_BAUD_RATE, *, rtscts: bool = False, serial_factory: Any = None) -> None:
+        self.port = port
+        self.boot_baud = int(baud)
+        self.baud = int(baud)
+        self.rtscts = bool(rtscts)
+        self.hello: dict[str, Any] = {}
+        self.boot_id: int | None = None
+        self.boot_journal: dict[str, Any] = {}
+        self.ota_result: dict[str, Any] = {}  # last unsolicited (Wi-Fi) update result
+        self.estop = False  # as of the last hello/heartbeat
+        self.resets = 0
+        self.unclaimed = 0
+        self.last_rx_at: float | None = None
+        self.last_progress_at: float | None = None  # any order's last progress event
+        self.negotiated: dict[str, Any] = {}
+        self._serial_factory = serial_factory
+        self._ser: Any = None
+        self._reader: threading.Thread | None = None
+        self._stop = threading.Event()
+        self._lock = threading.Lock()
+        self._write_lock = threading.Lock()
+        self._exchanges: list[UartExchange] = []
+
+    @property
+    def is_open(self) -> bool:
+        return self._ser is not None and self._reader is not None and self._reader.is_alive()
+
+    def open(self, hello_timeout_s: float = 1.0) -> None:
+        if self.is_open:
+            return
+        if self._serial_factory is not None:
+            ser = self._serial_factory()
+        else:
+            import serial  # type: ignore
+
+            ser = serial.Serial()
+            ser.port = self.port
+            ser.baudrate = self.boot_baud
+            ser.timeout = 0.2
+            ser.rtscts = self.rtscts
+            # Released before open, so the auto-reset circuit never sees EN pulled low.
+            ser.dtr = False
+            ser.rts = False
+            ser.open()
+        self._ser = ser
+        self.baud = int(getattr(ser, "baudrate", self.boot_baud))
+        self.negotiated.clear()
+        self._stop.clear()
+        self._reader = threading.Thread(target=self._read_loop, name="uart-session", daemon=True)
+        self._reader.start()
+        # Learn the boot_id now; firmware without a banner answers bad_opcode.
+        self.request(build_json_command_line("hello"), timeout_s=hello_timeout_s)
+
+    def close(self) -> None:
+        self._stop.set()
+        if self._reader is not None:
+            self._reader.join(timeout=1.0)
+        if self._ser is not None:
+            try:
+                self._ser.close()
+            except Exception:
+                pass
+        self._ser = None
+        self._reader = None
+        self._fail(ConnectionError("UART session closed"))
+
+    def __enter__(self) -> "UartSession":
+        self.open()
+        return self
+
+    def __exit__(self, *exc: Any) -> None:
+        self.close()
+
+    def alive(self) -> bool:
+        """True while the firmware has been heard from within a few heartbeat periods."""
+        heartbeat_ms = int(self.hello.get("heartbeat_ms", 1000) or 1000)
+        if self.last_rx_at is None:
+            return False
+        return time.monotonic() - self.last_rx_at < self.LIVENESS_HEARTBEATS * heartbeat_ms / 1000.0
+
+    def check_link(self) -> None:
+        """
+        After a timeout: if the firmware has gone quiet at a negotiated rate it
+        probably reset to the boot rate, so drop back there (and forget what was
+        negotiated); its next heartbeat then confirms the reset.
+        """
+        if self.alive() or self._ser is None or self.baud == self.boot_baud:
+            return
+        self._ser.baudrate = self.boot_baud
+        self.baud = self.boot_baud
+        self.negotiated.clear()
+
+    def write(self, data: bytes) -> None:
+        if self._ser is None:
+            raise ConnectionError("UART session not open")
+        with self._write_lock:
+            self._ser.write(data)
+            self._ser.flush()
+
+    def send(self, data: bytes, seq: int | None = None, *, order: bool = False) -> UartExchange:
+        """Register an exchange for the replies, then write the request (order: a dispense order)."""
+        exchange = UartExchange(self, seq, order)
+        with self._lock:
+            self._exchanges.append(exchange)
+        try:
+            self.write(data)
+        except Exception:
+            self._release(exchange)
+            raise
+        return exchange
+
+    def request(
+        self,
+        data: bytes,
+        *,
+        seq: int | None = None,
+        statuses: Iterable[str] | None = None,
+        timeout_s: float = 2.0,
+    ) -> dict[str, Any] | None:
+        """Send and return the first reply whose status is in statuses (default: terminal), else None."""
+        wanted = set(statuses) if statuses is not None else TERMINAL_ACK_STATUSES
+        deadline = time.monotonic() + timeout_s
+        with self.send(data, seq=seq) as exchange:
+            while True:
+                ack = exchange.next(deadline - time.monotonic())
+                if ack is None or ack.get("status") in wanted:
+                    return ack
+
+    def negotiate_baud(self, target_baud: int, timeout_s: float = 1.0) -> bool:
+        """negotiate_baud() for a port owned by the session's reader thread."""
+        if int(target_baud) not in SUPPORTED_BAUD_RATES:
+            raise ValueError(f"Unsupported baud rate {target_baud}")
+        if self.baud == int(target_baud):
+            return True
+        reply = self.request(build_json_command_line("baud", rate=int(target_baud)), timeout_s=timeout_s)
+        if reply is None or reply.get("status") != "baud_ok":
+            return False
+        self._ser.baudrate = int(target_baud)
+        self.baud = int(target_baud)
+        if self.request(build_json_command_line("ping"), statuses={"pong"}, timeout_s=timeout_s):
+            return True
+        time.sleep(BAUD_CONFIRM_WINDOW_S)
+        self._ser.baudrate = self.boot_baud
+        self.baud = self.boot_baud
+        return False
+
+    def cancel(self, *, estop: bool = False, release: bool = False, timeout_s: float = 0.5) -> bool:
+        """
+        Cancel (or e-stop, or release an e-stop) from any thread, even while another
+        thread waits on an order: that exchange then gets its final "cancelled" ACK.
+        Sent as a V2 frame under SESSION_CONTROL_SEQ whatever protocol the orders
+        use, so the confirmation can never be taken for a seq-less order's reply.
+        """
+        seq = SESSION_CONTROL_SEQ
+        frame = build_v2_estop(seq, release=release) if estop or release else build_v2_cancel(seq)
+        reply = self.request(frame, seq=seq, statuses={"cancel_ok", "estop_ok", "bad_opcode"}, timeout_s=timeout_s)
+        return reply is not None and reply.get("status") in {"cancel_ok", "estop_ok"}
+
+    def ota_update(
+        self,
+        image: bytes,
+        key: bytes,
+        *,
+        window: int = 8,
+        timeout_s: float = 1.0,
+        begin_timeout_s: float = 30.0,
+        max_retries: int = 5,
+        progress: Any = None,
+    ) -> dict[str, Any] | None:
+        """
+        Write image to the firmware's inactive partition and switch to it. key is the
+        32-byte update key the firmware was built with (DISPENSER_OTA_KEY).
+
+        Keeps up to `window` OTA_DATA frames in flight, each under its own seq.
+        When a reply is missing, a CRC fails or the firmware reports a gap, it goes
+        back to the offset the firmware has accepted and resends from there. The
+        firmware ignores chunks it already holds, so resending is always safe.
+        progress(done, total) is called as chunks are accepted. The return value is
+        the final reply: "ota_ok" once END succeeded (the firmware is rebooting,
+        and this session falls back to the boot rate), otherwise the failing reply
+        or None. Any failure aborts the update.
+        """
+        size = len(image)
+        crc = zlib.crc32(image) & 0xFFFFFFFF
+        seqs = itertools.cycle(range(1, SESSION_CONTROL_SEQ))
+        reply = self.request(build_v2_ota_begin(0, size, crc), seq=0, timeout_s=begin_timeout_s)
+        if reply is None or reply.get("status") != "ota_ok":
+            return reply
+
+        acked = 0
+        sent = 0
+        retries = 0
+        in_flight: list[tuple[UartExchange, int]] = []
+        try:
+            while acked < size:
+                while len(in_flight) < max(1, window) and sent < size:
+                    chunk = image[sent : sent + OTA_CHUNK_MAX]
+                    seq = next(seqs)
+                    in_flight.append((self.send(build_v2_ota_data(seq, sent, chunk), seq=seq), sent + len(chunk)))
+                    sent += len(chunk)
+                exchange, end = in_flight.pop(0)
+                reply = exchange.next(timeout_s)
+                exchange.close()
+                if reply is not None and reply.get("status") == "ota_ok":
+                    acked = max(acked, int(reply.get("offset", end)))
+                    retries = 0
+                    if progress is not None:
+                        progress(acked, size)
+                    continue
+                if reply is not None and reply.get("status") == "ota_error" and reply.get("error") != "offset":
+                    return reply
+                retries += 1
+                if retries > max_retries:
+                    return reply
+                for stale, _ in in_flight:
+                    stale.close()
+                in_flight.clear()
+                if reply is not None and "offset" in reply:
+                    acked = max(acked, int(reply["offset"]))
+                sent = acked
+            for stale, _ in in_flight:
+                stale.close()
+            in_flight.clear()
+
+            seq = next(seqs)
+            reply = self.request(build_v2_ota_end(seq, ota_image_tag(image, key)), seq=seq, timeout_s=begin_timeout_s)
+            if reply is not None and reply.get("status") == "ota_ok":
+                # The firmware comes back at its boot rate.
+                if self._ser is not None:
+                    self._ser.baudrate = self.boot_baud
+                self.baud = self.boot_baud
+                self.negotiated.clear()
+            return reply
+        finally:
+            for stale, _ in in_flight:
+                stale.close()
+            if reply is None or reply.get("status") != "ota_ok":
+                try:
+                    seq = SESSION_CONTROL_SEQ
+                    self.request(build_v2_ota_abort(seq), seq=seq, statuses={"ota_ok"}, timeout_s=timeout_s)
+                except Exception:
+                    pass
+
+    def describe(self) -> dict[str, Any]:
+        return {
+            "open": self.is_open,
+            "port": self.port,
+            "baud": self.baud,
+            "boot_id": self.boot_id,
+            "reset_reason": self.hello.get("reset_reason"),
+            "app": self.hello.get("app"),
+            "partition": self.hello.get("partition"),
+            "ota": self.hello.get("ota"),
+            "resets": self.resets,
+            "alive": self.alive(),
+            "estop": self.estop,
+            "unclaimed_replies": self.unclaimed,
+        }
+
+    def _release(self, exchange: UartExchange) -> None:
+        with self._lock:
+            if exchange in self._exchanges:
+                self._exchanges.remove(exchange)
+
+    def _fail(self, exc: BaseException) -> None:
+        with self._lock:
+            pending, self._exchanges = self._exchanges, []
+        for exchange in pending:
+            exchange._replies.put(exc)
+
+    def _note_boot_id(self, ack: dict[str, Any]) -> None:
+        boot_id = ack.get("boot_id")
+        if not isinstance(boot_id, int):
+            return
+        if self.boot_id is not None and boot_id != self.boot_id:
+            self.resets += 1
+            self.negotiated.clear()
+            self.baud = int(getattr(self._ser, "baudrate", self.boot_baud))
+            self._fail(FirmwareReset(f"firmware reset (boot_id {self.boot_id} -> {boot_id})"))
+        self.boot_id = boot_id
+
+    def _read_loop(self) -> None:
+        while not self._stop.is_set():
+            try:
+                received = read_ack(self._ser, include_unsolicited=True)
+            except Exception as exc:  # unplugged, permission lost, ...
+                self._ser = None
+                self._fail(ConnectionError(f"UART read failed: {exc}"))
+                return
+            if received is None:
+                continue
+            self.last_rx_at = time.monotonic()
+            ack, text = received
+            status = ack.get("status")
+            if status in {"hello", "heartbeat"}:
+                self._note_boot_id(ack)
+                self.estop = bool(ack.get("estop", False))
+            if status == "hello":
+                self.hello = ack
+            if status == "progress":
+                self.last_progress_at = self.last_rx_at
+            if ack.get("protocol") in UNSOLICITED_PROTOCOLS:
+                if status == "journal":
+                    self.boot_journal = ack
+                elif status in {"ota_ok", "ota_error"}:
+                    self.ota_result = ack
+                continue
+            self._route(ack, text)
+
+    def _route(self, ack: dict[str, Any], text: str) -> None:
+        with self._lock:
+            target = next((ex for ex in self._exchanges if ex.accepts(ack)), None)
+            if target is not None:
+                target.answered = True
+        if target is None:
+            self.unclaimed += 1
+            return
+        target._replies.put((ack, text))
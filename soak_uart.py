@@ -0,0 +1,519 @@
+"""
+Long-running UART soak for the ESP32 dispenser firmware (or the host simulator).
+
+Cycles through traffic phases for --duration seconds and reports, per phase,
+throughput, how much of the host->firmware line rate it used, the drop rate (orders that never got a final
+reply), busy rejections and the firmware's own error counters, plus the stack
+and heap high-water marks over the whole run:
+
+    python soak_uart.py --port /tmp/dispenser --duration 3600 --out soak.json
+    python soak_uart.py --port /dev/ttyUSB0 --target-baud 921600 --replay session_log.jsonl
+
+Phases:
+  replay       recorded traffic, one message at a time: every "frame_hex" in the
+               given JSONL logs, or files with one hex frame or JSON order line
+               per line. Only orders, pings, hello and stats are replayed; V2
+               frames get fresh seqs.
+  clean        V2 batches back-to-back, --window frames in flight.
+  noise        the same with bytes between frames that cannot start a frame
+               or a line, so resync must never cost an order.
+  adversarial  the same with random bytes (frame starts, '{', newlines) and
+               corrupted frames; orders swallowed here are reported but only
+               resets and memory count against the run.
+  burst        full-size batches at line rate with a deep window, so the queue
+               fills and the firmware has to answer "busy" without losing input.
+  coalesce     batches of random size in coalesce schedule mode, so later
+               batches arrive while a run holds orders the queue no longer
+               shows; each must still be queued or rejected as a whole.
+
+All orders the soak generates are V2, matched by seq. Stats are read with V2
+GET_STATS between frames and reset at the start, so the firmware counters in
+the report cover this run. The exit status is 1 if the firmware reset, a
+non-adversarial phase dropped more than --max-drop-rate, a batch was
+split between "queued" and "busy", the RX buffer overflowed, an order's final
+ACK or a JSON parse was dropped for lack of memory, a task's
+stack headroom fell below --min-stack-free or the heap low-water mark kept
+falling after the first cycle.
+"""
+
+from __future__ import annotations
+
+import argparse
+import itertools
+import json
+import random
+import sys
+import time
+from typing import Any, Iterable
+
+import sauron_uart
+from bench_uart import NOISE_ALPHABET, summarize
+
+PHASES = ("replay", "clean", "noise", "adversarial", "burst", "coalesce")
+OPTIONAL_PHASES = {"replay"}
+ORDER_STATUSES = {"done", "short", "cancelled"}  # per-order finals carry "order"
+OK_STATUSES = {"done", "short", "pong", "hello", "stats"}
+REPLAY_OPCODES = {sauron_uart.V2_OP_DISPENSE_BATCH, sauron_uart.V2_OP_PING, sauron_uart.V2_OP_HELLO, sauron_uart.V2_OP_GET_STATS}
+REPLAY_JSON_CMDS = {"ping", "hello", "stats"}
+FIRMWARE_COUNTERS = ("rx_bytes", "orders", "resync_bytes", "checksum_failures", "bad_json", "rx_overflows",
+                     "log_drops", "tx_drops", "tx_final_drops", "json_oom", "cancelled")
+
+
+class Frame:
+    __slots__ = ("seq", "exchange", "orders", "sent_at", "last_reply_at", "finals", "statuses")
+
+    def __init__(self, seq: int | None, exchange: sauron_uart.UartExchange, orders: int, sent_at: float) -> None:
+        self.seq = seq
+        self.exchange = exchange
+        self.orders = orders
+        self.sent_at = sent_at
+        self.last_reply_at = sent_at
+        self.finals: dict[int, tuple[str, float]] = {}
+        self.statuses: set[str] = set()
+
+    def complete(self) -> bool:
+        return len(self.finals) >= self.orders
+
+
+class PhaseStats:
+    def __init__(self, name: str) -> None:
+        self.name = name
+        self.runs = 0
+        self.seconds = 0.0
+        self.frames = 0
+        self.orders = 0
+        self.statuses: dict[str, int] = {}
+        self.lost = 0
+        self.split_batches = 0
+        self.tx_bytes = 0
+        self.noise_bytes = 0
+        self.rtt_s: list[float] = []
+        self.firmware: dict[str, int] = {}
+
+    def settle(self, frame: Frame) -> None:
+        if {"queued", "busy"} <= frame.statuses:
+            self.split_batches += 1
+        for order in range(frame.orders):
+            final = frame.finals.get(order)
+            if final is None:
+                self.lost += 1
+                continue
+            status, at = final
+            self.statuses[status] = self.statuses.get(status, 0) + 1
+            if status in {"done", "short"}:
+                self.rtt_s.append(at - frame.sent_at)
+
+    def report(self, baud: int) -> dict[str, Any]:
+        done = self.statuses.get("done", 0) + self.statuses.get("short", 0)
+        return {
+            "runs": self.runs,
+            "seconds": round(self.seconds, 3),
+            "frames": self.frames,
+            "orders": self.orders,
+            "done": done,
+            "busy": self.statuses.get("busy", 0),
+            "failures": {k: v for k, v in self.statuses.items() if k not in OK_STATUSES | {"busy"}},
+            "lost": self.lost,
+            "split_batches": self.split_batches,
+            "drop_rate": round(self.lost / self.orders, 6) if self.orders else 0.0,
+            "throughput_orders_per_s": round(done / self.seconds, 3) if self.seconds > 0 else 0.0,
+            "host_tx_utilization": round(self.tx_bytes * 10 / baud / self.seconds, 4) if self.seconds > 0 else 0.0,
+            "noise_bytes": self.noise_bytes,
+            "rtt_final_ms": summarize(self.rtt_s),
+            "firmware": self.firmware,
+        }
+
+
+def parse_hex_frame(text: str) -> bytes | None:
+    digits = "".join(text.split())
+    if not digits or len(digits) % 2:
+        return None
+    try:
+        return bytes.fromhex(digits)
+    except ValueError:
+        return None
+
+
+def find_frame_hex(obj: Any) -> Iterable[str]:
+    if isinstance(obj, dict):
+        for key, value in obj.items():
+            if key == "frame_hex" and isinstance(value, str):
+                yield value
+            else:
+                yield from find_frame_hex(value)
+    elif isinstance(obj, list):
+        for value in obj:
+            yield from find_frame_hex(value)
+
+
+def load_replay(paths: list[str]) -> list[bytes]:
+    """Recorded messages as raw bytes: binary frames, or JSON lines ending in newline."""
+    messages: list[bytes] = []
+    for path in paths:
+        with open(path, encoding="utf-8") as fh:
+            for line in fh:
+                line = line.strip()
+                if not line:
+                    continue
+                if line.startswith("{"):
+                    try:
+                        obj = json.loads(line)
+                    except json.JSONDecodeError:
+                        continue
+                    hexes = list(dict.fromkeys(find_frame_hex(obj)))  # a session log repeats the frame in its ACK
+                    if hexes:
+                        messages.extend(f for f in (parse_hex_frame(h) for h in hexes) if f)
+                    elif isinstance(obj, dict) and (obj["cmd"] in REPLAY_JSON_CMDS if "cmd" in obj
+                                                    else any(str(k).startswith("pill") for k in obj)):
+                        messages.append(line.encode("utf-8") + b"\n")
+                    continue
+                frame = parse_hex_frame(line)
+                if frame:
+                    messages.append(frame)
+    return messages
+
+
+def replay_message(message: bytes, seq: int) -> tuple[bytes, int | None, int, bool] | None:
+    """
+    (bytes to send, seq to match or None, final replies expected, whether it is a
+    dispense order rather than a command), or None if not replayable.
+    """
+    if message.endswith(b"\n"):
+        try:
+            obj = json.loads(message)
+        except json.JSONDecodeError:
+            return None
+        return message, None, 1, not (isinstance(obj, dict) and "cmd" in obj)
+    if len(message) >= 9 and message[0] == sauron_uart.FRAME_START and message[1] == sauron_uart.FRAME_VERSION_V2:
+        opcode, length = message[4], message[5]
+        payload = message[6:6 + length]
+        if opcode not in REPLAY_OPCODES or len(payload) != length:
+            return None
+        orders = payload[0] if opcode == sauron_uart.V2_OP_DISPENSE_BATCH and payload else 1
+        return sauron_uart.build_v2_frame(seq, opcode, payload), seq, max(1, orders), opcode == sauron_uart.V2_OP_DISPENSE_BATCH
+    if len(message) == 8 and message[0] == sauron_uart.FRAME_START and message[1] == sauron_uart.FRAME_VERSION_V1:
+        return message, None, 1, True
+    return None
+
+
+def adversarial_noise(rng: random.Random, max_len: int, valid: bytes) -> bytes:
+    kind = rng.random()
+    if kind < 0.4:
+        return bytes(rng.randrange(256) for _ in range(rng.randint(1, max_len)))
+    if kind < 0.7:  # a frame cut short
+        return valid[:rng.randint(1, len(valid) - 1)]
+    corrupt = bytearray(valid)  # a frame with a flipped bit
+    corrupt[rng.randrange(1, len(corrupt))] ^= 1 << rng.randrange(8)
+    return bytes(corrupt)
+
+
+class Soak:
+    def __init__(self, session: sauron_uart.UartSession, args: argparse.Namespace) -> None:
+        self.session = session
+        self.args = args
+        self.rng = random.Random(args.seed)
+        self.counts = [int(c) for c in args.counts.split(",")]
+        self.seqs = itertools.cycle(range(1, sauron_uart.SESSION_CONTROL_SEQ))
+        self.in_flight: dict[int, Frame] = {}
+        self.phases = {name: PhaseStats(name) for name in PHASES}
+        self.samples: list[dict[str, Any]] = []
+        self.resets: list[str] = []
+        self.last_counters = {k: 0 for k in FIRMWARE_COUNTERS}
+        self.replay_count = 0
+        self.started = time.monotonic()
+
+    def next_seq(self) -> int:
+        while True:
+            seq = next(self.seqs)
+            if seq not in self.in_flight:
+                return seq
+
+    def poll(self, phase: PhaseStats, block_s: float = 0.0) -> None:
+        """Collect replies for the frames in flight; settle finished and timed-out ones."""
+        now = time.monotonic()
+        got_any = False
+        for seq, frame in list(self.in_flight.items()):
+            while True:
+                try:
+                    ack = frame.exchange.next(0.0)
+                except sauron_uart.FirmwareReset as exc:
+                    self.resets.append(str(exc))
+                    ack = None
+                    frame.last_reply_at = float("-inf")  # its replies are gone
+                if ack is None:
+                    break
+                got_any = True
+                at = time.monotonic()
+                frame.last_reply_at = at
+                status = str(ack.get("status", ""))
+                frame.statuses.add(status)
+                if status in {"queued", "progress"}:
+                    continue
+                if status in ORDER_STATUSES and "order" in ack:
+                    frame.finals.setdefault(int(ack["order"]), (status, at))
+                elif status in sauron_uart.TERMINAL_ACK_STATUSES:
+                    for order in range(frame.orders):  # frame-level reply: busy, bad_*, pong, ...
+                        frame.finals.setdefault(order, (status, at))
+            if frame.complete() or now - frame.last_reply_at > self.args.timeout:
+                frame.exchange.close()
+                del self.in_flight[seq]
+                phase.settle(frame)
+        if not got_any and block_s > 0:
+            time.sleep(block_s)
+
+    def send(self, phase: PhaseStats, data: bytes, seq: int | None, orders: int, noise: bytes = b"", order: bool = True) -> Frame:
+        if noise:
+            self.session.write(noise)
+            phase.noise_bytes += len(noise)
+        sent_at = time.monotonic()
+        frame = Frame(seq, self.session.send(data, seq=seq, order=order), orders, sent_at)
+        phase.frames += 1
+        phase.orders += orders
+        phase.tx_bytes += len(data) + len(noise)
+        return frame
+
+    def drain(self, phase: PhaseStats) -> None:
+        while self.in_flight:
+            self.poll(phase, block_s=0.005)
+
+    def sample(self) -> dict[str, Any] | None:
+        """GET_STATS by seq, so it can go out while orders are in flight."""
+        seq = self.next_seq()
+        try:
+            stats = self.session.request(sauron_uart.build_v2_get_stats(seq, reset=not self.samples), seq=seq,
+                                         statuses={"stats"}, timeout_s=self.args.timeout)
+        except sauron_uart.FirmwareReset as exc:
+            self.resets.append(str(exc))
+            return None
+        if stats is None:
+            return None
+        sample = {
+            "t": round(time.monotonic() - self.started, 3),
+            "heap_min_free": stats.get("heap_min_free"),
+            "stack_free": dict(stats.get("stack_free", {})),
+            "counters": {k: int(stats.get(k, 0)) for k in FIRMWARE_COUNTERS},
+        }
+        self.samples.append(sample)
+        return sample
+
+    def account_firmware(self, phase: PhaseStats) -> None:
+        sample = self.sample()
+        if sample is None:
+            return
+        for key, value in sample["counters"].items():
+            delta = value - self.last_counters.get(key, 0)
+            if delta < 0:  # counters restarted (firmware reset)
+                delta = value
+            phase.firmware[key] = phase.firmware.get(key, 0) + delta
+        self.last_counters = sample["counters"]
+
+    def run_windowed(self, phase: PhaseStats, until: float, window: int, batch: int,
+                     noise: str | None = None) -> None:
+        """batch 0: a random number of orders per frame."""
+        next_sample = time.monotonic() + self.args.sample_interval
+        while time.monotonic() < until:
+            if time.monotonic() >= next_sample:
+                self.account_firmware(phase)
+                next_sample = time.monotonic() + self.args.sample_interval
+            if len(self.in_flight) >= window:
+                self.poll(phase, block_s=0.001)
+                continue
+            seq = self.next_seq()
+            orders = batch or self.rng.randint(1, sauron_uart.V2_MAX_BATCH_ORDERS)
+            data = sauron_uart.build_v2_dispense_batch(seq, [self.counts] * orders, channel_count=len(self.counts))
+            extra = b""
+            if noise and self.rng.random() < self.args.noise:
+                if noise == "safe":
+                    extra = bytes(self.rng.choice(NOISE_ALPHABET) for _ in range(self.rng.randint(1, self.args.noise_max)))
+                else:
+                    extra = adversarial_noise(self.rng, self.args.noise_max, data)
+            self.in_flight[seq] = self.send(phase, data, seq, orders, extra)
+            self.poll(phase)
+        self.drain(phase)
+
+    def run_replay(self, phase: PhaseStats, until: float, messages: list[bytes]) -> None:
+        for message in itertools.cycle(messages):
+            if time.monotonic() >= until:
+                break
+            seq = self.next_seq()
+            prepared = replay_message(message, seq)
+            if prepared is None:
+                continue
+            data, match_seq, orders, order = prepared
+            frame = self.send(phase, data, match_seq, orders, order=order)
+            # Seq-less messages are matched in order, so replay waits for each one.
+            key = match_seq if match_seq is not None else -1
+            self.in_flight[key] = frame
+            self.drain(phase)
+
+    def set_schedule(self, mode: str) -> bool:
+        seq = self.next_seq()
+        try:
+            return self.session.request(sauron_uart.build_v2_set_schedule(seq, mode), seq=seq,
+                                        statuses={"schedule_ok"}, timeout_s=self.args.timeout) is not None
+        except sauron_uart.FirmwareReset as exc:
+            self.resets.append(str(exc))
+            return False
+
+    def run(self) -> dict[str, Any]:
+        args = self.args
+        replay = load_replay(args.replay) if args.replay else []
+        self.replay_count = len(replay)
+        phases = [p for p in args.phases if p not in OPTIONAL_PHASES or (p == "replay" and replay)]
+        self.started = time.monotonic()
+        self.sample()  # resets the firmware counters
+        first_cycle: dict[str, Any] | None = None
+        cycles = 0
+        end = self.started + args.duration
+        while time.monotonic() < end:
+            for name in phases:
+                now = time.monotonic()
+                if now >= end:
+                    break
+                phase = self.phases[name]
+                until = min(end, now + args.phase_seconds)
+                if name == "replay":
+                    self.run_replay(phase, until, replay)
+                elif name == "burst":
+                    self.run_windowed(phase, until, args.burst_window, sauron_uart.V2_MAX_BATCH_ORDERS)
+                elif name == "coalesce":
+                    if self.set_schedule("coalesce"):
+                        self.run_windowed(phase, until, args.window, 0)
+                    self.set_schedule("fifo")
+                else:
+                    self.run_windowed(phase, until, args.window, args.batch,
+                                      {"clean": None, "noise": "safe", "adversarial": "adversarial"}[name])
+                if name == "adversarial":
+                    # A stray '{' leaves the parser waiting for the end of a line;
+                    # end it so the next phase starts clean.
+                    self.session.write(b"\n")
+                phase.runs += 1
+                phase.seconds += time.monotonic() - now
+                self.account_firmware(phase)
+            cycles += 1
+            if cycles == 1 and self.samples:
+                first_cycle = self.samples[-1]
+        return self.report(phases, cycles, first_cycle)
+
+    def report(self, phases: list[str], cycles: int, first_cycle: dict[str, Any] | None) -> dict[str, Any]:
+        args = self.args
+        baud = self.session.baud
+        last = self.samples[-1] if self.samples else None
+        # A task that reports 0 throughout is not running in this build (ota_task without Wi-Fi).
+        tasks = sorted({t for s in self.samples for t, free in s["stack_free"].items() if free})
+        memory = {
+            "stack_free_min": {t: min((s["stack_free"].get(t, 0) for s in self.samples if t in s["stack_free"]), default=0)
+                               for t in tasks},
+            "stack_free_after_first_cycle": first_cycle["stack_free"] if first_cycle else None,
+            "heap_min_free_first": self.samples[0]["heap_min_free"] if self.samples else None,
+            "heap_min_free_after_first_cycle": first_cycle["heap_min_free"] if first_cycle else None,
+            "heap_min_free_last": last["heap_min_free"] if last else None,
+        }
+
+        failures = []
+        if self.resets or self.session.resets:
+            failures.append(f"firmware reset {max(len(self.resets), self.session.resets)} time(s)")
+        for name in phases:
+            report = self.phases[name].report(baud)
+            if name != "adversarial" and report["drop_rate"] > args.max_drop_rate:
+                failures.append(f"{name}: drop rate {report['drop_rate']} > {args.max_drop_rate}")
+            if report["split_batches"]:
+                failures.append(f"{name}: {report['split_batches']} batch(es) split between queued and busy")
+        totals = last["counters"] if last else {}
+        # tx_drops alone is only queued/progress/heartbeat events, which may go under load.
+        for key in ("rx_overflows", "tx_final_drops", "json_oom"):
+            if totals.get(key, 0):
+                failures.append(f"{key} = {totals[key]}")
+        for task, free in memory["stack_free_min"].items():
+            if free < args.min_stack_free:
+                failures.append(f"{task}: stack headroom {free} < {args.min_stack_free}")
+        if first_cycle and last and cycles > 1 and (last["heap_min_free"] or 0) < (first_cycle["heap_min_free"] or 0):
+            failures.append(f"heap low-water fell after the first cycle ({first_cycle['heap_min_free']} -> {last['heap_min_free']})")
+
+        return {
+            "label": args.label,
+            "timestamp": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+            "config": {
+                "port": args.port,
+                "baud": baud,
+                "duration_s": args.duration,
+                "phase_seconds": args.phase_seconds,
+                "phases": phases,
+                "window": args.window,
+                "burst_window": args.burst_window,
+                "batch": args.batch,
+                "noise": args.noise,
+                "counts": self.counts,
+                "binary_acks": args.binary_acks,
+                "seed": args.seed,
+                "replay_messages": self.replay_count,
+            },
+            "elapsed_s": round(time.monotonic() - self.started, 3),
+            "cycles": cycles,
+            "phases": {name: self.phases[name].report(baud) for name in phases},
+            "firmware_totals": totals,
+            "memory": memory,
+            "resets": self.resets,
+            "unclaimed_replies": self.session.unclaimed,
+            "samples": self.samples if args.samples else len(self.samples),
+            "failures": failures,
+            "ok": not failures,
+        }
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[1], formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", default="/dev/ttyUSB0")
+    parser.add_argument("--baud", type=int, default=sauron_uart.BOOT_BAUD_RATE)
+    parser.add_argument("--target-baud", type=int, default=0, help="negotiate this rate after connecting")
+    parser.add_argument("--rtscts", action="store_true")
+    parser.add_argument("--binary-acks", action="store_true", help="switch the firmware to binary ACKs first")
+    parser.add_argument("--label", default="unlabeled", help="firmware build name recorded in the report")
+    parser.add_argument("--duration", type=float, default=600.0, help="seconds to soak")
+    parser.add_argument("--phase-seconds", type=float, default=30.0, help="seconds per phase before moving on")
+    parser.add_argument("--phases", default=",".join(PHASES),
+                        help="comma-separated subset of %s, run in this order" % ", ".join(PHASES))
+    parser.add_argument("--replay", action="append", default=[], help="recorded traffic to replay (repeatable)")
+    parser.add_argument("--window", type=int, default=4, help="V2 frames in flight (firmware queue holds 8 orders)")
+    parser.add_argument("--burst-window", type=int, default=8, help="frames in flight during the burst phase")
+    parser.add_argument("--batch", type=int, default=1, help="orders per V2 frame outside the burst phase")
+    parser.add_argument("--noise", type=float, default=0.5, help="probability of noise before each frame")
+    parser.add_argument("--noise-max", type=int, default=24, help="longest noise burst in bytes")
+    parser.add_argument("--counts", default="0,0,0,0", help="per-channel pill counts in every order")
+    parser.add_argument("--timeout", type=float, default=5.0, help="seconds without a reply before a frame counts as lost")
+    parser.add_argument("--sample-interval", type=float, default=10.0, help="seconds between stats samples")
+    parser.add_argument("--max-drop-rate", type=float, default=0.0)
+    parser.add_argument("--min-stack-free", type=int, default=256, help="bytes of stack headroom every task must keep")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--samples", action="store_true", help="include every stats sample in the report")
+    parser.add_argument("--out", help="write the JSON report here (default: stdout)")
+    args = parser.parse_args()
+    args.phases = [p.strip() for p in args.phases.split(",") if p.strip()]
+    unknown = [p for p in args.phases if p not in PHASES]
+    if unknown:
+        parser.error(f"unknown phase(s): {', '.join(unknown)}")
+    args.batch = max(1, min(sauron_uart.V2_MAX_BATCH_ORDERS, args.batch))
+    args.window = max(1, args.window)
+    args.burst_window = max(1, args.burst_window)
+
+    with sauron_uart.UartSession(args.port, args.baud, rtscts=args.rtscts) as session:
+        if args.target_baud and not session.negotiate_baud(args.target_baud):
+            raise SystemExit(f"baud negotiation to {args.target_baud} failed")
+        if args.binary_acks and session.request(sauron_uart.build_json_ack_mode_line(binary=True),
+                                                statuses={"ack_mode_ok"}, timeout_s=args.timeout) is None:
+            raise SystemExit("firmware did not confirm binary ACK mode")
+        report = Soak(session, args).run()
+
+    text = json.dumps(report, indent=2)
+    if args.out:
+        with open(args.out, "w", encoding="utf-8") as fh:
+            fh.write(text + "\n")
+    else:
+        print(text)
+    for failure in report["failures"]:
+        print(f"FAIL: {failure}", file=sys.stderr)
+    return 0 if report["ok"] else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
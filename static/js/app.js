@@ -52,6 +52,7 @@ const dispenseUserName = document.getElementById("dispenseUserName");
 const dispenseMedication = document.getElementById("dispenseMedication");
 const dispenseServoChannel = document.getElementById("dispenseServoChannel");
 const dispenseUartStatus = document.getElementById("dispenseUartStatus");
+const dispenseUartProgress = document.getElementById("dispenseUartProgress");
 
 const adviceTitle = document.getElementById("adviceTitle");
 const adviceSubtitle = document.getElementById("adviceSubtitle");
@@ -806,9 +807,34 @@ function typewriteAdvice(text) {
   }, 28);
 }
 
+// "2 of 5 (channel 3, 4.1 s)" from the FSM's uart_progress, or "" before the
+// ESP32 has accepted the order.
+function formatUartProgress(progress) {
+  if (!progress || !progress.total || progress.status === "sent") {
+    return "";
+  }
+  let text = `${progress.dispensed || 0} of ${progress.total}`;
+  const details = [];
+  if (progress.channel) {
+    details.push(`channel ${progress.channel}`);
+  }
+  if (typeof progress.elapsed_ms === "number") {
+    details.push(`${(progress.elapsed_ms / 1000).toFixed(1)} s`);
+  }
+  if (details.length) {
+    text += ` (${details.join(", ")})`;
+  }
+  return text;
+}
+
 function updateDispenseView(data) {
   const user = data.active_user || {};
-  const uartStatus = data.last_uart_result?.status || data.last_uart_command?.status || "Pending";
+  const progress = data.uart_progress || {};
+  const inFlight = ["sent", "queued", "progress"].includes(progress.status);
+  const uartStatus = inFlight
+    ? progress.status
+    : data.last_uart_result?.status || data.last_uart_command?.status || "Pending";
+  const progressText = formatUartProgress(progress);
 
   if (dispenseUserName) {
     dispenseUserName.textContent = user.name || "--";
@@ -822,13 +848,18 @@ function updateDispenseView(data) {
   if (dispenseUartStatus) {
     dispenseUartStatus.textContent = String(uartStatus);
   }
+  if (dispenseUartProgress) {
+    dispenseUartProgress.textContent = progressText || "--";
+  }
 
   if (data.state === "DISPENSING_PILL") {
     if (dispenseTitle) {
       dispenseTitle.textContent = user.name ? `Dispensing for ${user.name}` : "Dispensing Medication";
     }
     if (dispenseSubtitle) {
-      dispenseSubtitle.textContent = `Sending USB-UART command to ESP32. Status: ${uartStatus}`;
+      dispenseSubtitle.textContent = inFlight && progressText
+        ? `Dispensing pill ${progressText}.`
+        : `Sending USB-UART command to ESP32. Status: ${uartStatus}`;
     }
     return;
   }
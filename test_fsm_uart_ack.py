@@ -0,0 +1,98 @@
+"""
+How PillDispenserFSM reads the firmware's final reply to an order, against a
+scripted session instead of a serial port:
+
+    python -m unittest test_fsm_uart_ack
+"""
+
+from __future__ import annotations
+
+import unittest
+from typing import Any
+
+import pill_dispenser_fsm
+
+
+class ScriptedExchange:
+    def __init__(self, replies: list[tuple[dict[str, Any], str]]) -> None:
+        self._replies = list(replies)
+        self.last_text = ""
+
+    def next(self, timeout_s: float) -> dict[str, Any] | None:
+        if not self._replies:
+            return None
+        ack, self.last_text = self._replies.pop(0)
+        return ack
+
+    def __enter__(self) -> "ScriptedExchange":
+        return self
+
+    def __exit__(self, *exc: Any) -> None:
+        pass
+
+
+class ScriptedSession:
+    """Just the UartSession surface _send_uart_via_serial uses; replies are canned."""
+
+    def __init__(self, replies: list[tuple[dict[str, Any], str]]) -> None:
+        self._replies = replies
+        self.is_open = True
+        self.baud = 115200
+        self.negotiated = {"journal": True}
+        self.last_progress_at = None
+        self.sent: list[bytes] = []
+
+    def send(self, data: bytes, seq: int | None = None, order: bool = False) -> ScriptedExchange:
+        self.sent.append(data)
+        return ScriptedExchange(self._replies)
+
+    def check_link(self) -> None:
+        pass
+
+
+def json_reply(status: str, **fields: Any) -> tuple[dict[str, Any], str]:
+    ack = {"status": status, "protocol": "json_line", "counts": [1, 0, 0, 0], **fields}
+    return ack, str(ack)
+
+
+COMMAND = {"channel_counts": [1, 0, 0, 0], "frame_format": "JSON"}
+
+
+class SeqlessAckTest(unittest.TestCase):
+    def setUp(self) -> None:
+        if pill_dispenser_fsm.serial is None:
+            self.skipTest("pyserial not installed")
+        self.fsm = pill_dispenser_fsm.PillDispenserFSM()
+        self.fsm._uart_protocol = "json"
+
+    def send(self, replies: list[tuple[dict[str, Any], str]], fallback: bool = False) -> dict[str, Any]:
+        self.fsm._uart_session = ScriptedSession(replies)
+        self.fsm._uart_offline_fallback = fallback
+        return self.fsm._send_uart_dispense_command(COMMAND)
+
+    def test_done_is_ack(self) -> None:
+        result = self.send([json_reply("queued", queue_depth=1), json_reply("done", dispensed=[1, 0, 0, 0])])
+        self.assertTrue(result["ack"])
+        self.assertEqual(result["status"], "done")
+
+    def test_busy_is_not_ack(self) -> None:
+        result = self.send([json_reply("busy", queue_depth=8)])
+        self.assertFalse(result["ack"])
+        self.assertEqual(result["status"], "busy")
+
+    def test_busy_is_not_papered_over_by_offline_fallback(self) -> None:
+        result = self.send([json_reply("busy", queue_depth=8)], fallback=True)
+        self.assertFalse(result["ack"])
+        self.assertEqual(result["status"], "busy")
+
+    def test_bad_json_is_not_ack(self) -> None:
+        result = self.send([json_reply("bad_json")])
+        self.assertFalse(result["ack"])
+
+    def test_legacy_text_ok_is_ack(self) -> None:
+        result = self.send([({}, "OK")])
+        self.assertTrue(result["ack"])
+
+
+if __name__ == "__main__":
+    unittest.main()
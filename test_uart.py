@@ -2,10 +2,13 @@ import json
 import serial
 import time
 
+import sauron_uart
+
 # UART port on Jetson (check with `ls /dev/ttyUSB*` or `dmesg`)
 UART_PORT = "/dev/ttyUSB0"
 BAUD_RATE = 115200
-DEFAULT_PROTOCOL = "json"  # "frame" (SAURON_UART_V1) or "json" (legacy compatibility)
+DEFAULT_PROTOCOL = "json"  # "frame" (SAURON_UART_V1), "frame_v2" (SAURON_UART_V2) or "json" (legacy)
+BINARY_ACKS = False  # ask the firmware for compact binary ACK frames instead of JSON lines
 
 # Open serial port (timeout=None blocks until a full line is received)
 ser = serial.Serial(UART_PORT, BAUD_RATE, timeout=None)
@@ -14,6 +17,8 @@ FRAME_START = 0xAA
 FRAME_END = 0x55
 FRAME_VERSION = 0x01
 
+_v2_seq = 0
+
 
 def _normalize_pill_counts(pill_counts):
     return [
@@ -43,15 +48,32 @@ def build_sauron_uart_v1_frame(pill_counts):
     return frame
 
 
-def _recv_ack_line():
-    # Wait forever for confirmation (Ctrl+C to stop the script)
+def _recv_ack_line(expected_seq=None):
+    # Wait forever for confirmation (Ctrl+C to stop the script).
+    # The "queued" ACK only means the order was accepted, and "progress" lines come
+    # once per pill; keep reading for "done".
+    # For V2, ACKs belonging to another seq are printed but not returned.
     while True:
-        line = ser.readline().decode("utf-8", errors="replace").strip()
-        if line:
-            print(f"Received: {line}")
+        received = sauron_uart.read_ack(ser)
+        if received is None:
+            continue
+        ack, line = received
+        print(f"Received: {line}" + (f" -> {ack}" if BINARY_ACKS else ""))
+        if expected_seq is not None and ack.get("seq") != expected_seq:
+            continue
+        if ack.get("status") not in {"queued", "progress"}:
             return line
 
 
+def build_sauron_uart_v2_frame(pill_counts_list, seq):
+    """
+    SAURON_UART_V2 dispense batch: one frame, several orders, one seq.
+    Byte layout is documented in sauron_uart.py.
+    """
+    orders = [_normalize_pill_counts(pill_counts) for pill_counts in pill_counts_list]
+    return sauron_uart.build_v2_dispense_batch(seq, orders)
+
+
 def send_pill_command(pill_counts, protocol=DEFAULT_PROTOCOL):
     """
     pill_counts: dict like {"pill1": 2, "pill2": 1, "pill3":0, "pill4":3}
@@ -67,12 +89,24 @@ def send_pill_command(pill_counts, protocol=DEFAULT_PROTOCOL):
         print(f"Sent JSON: {json_cmd}")
         return _recv_ack_line()
 
+    if proto == "frame_v2":
+        global _v2_seq
+        _v2_seq = (_v2_seq + 1) & 0xFFFF
+        frame = build_sauron_uart_v2_frame([pill_counts], _v2_seq)
+        print(f"Sent Frame (SAURON_UART_V2 seq={_v2_seq}):", sauron_uart.frame_hex(frame))
+        ser.write(frame)
+        return _recv_ack_line(expected_seq=_v2_seq)
+
     frame = build_sauron_uart_v1_frame(pill_counts)
     print("Sent Frame (SAURON_UART_V1):", " ".join(f"{b:02X}" for b in frame))
     ser.write(frame)
     return _recv_ack_line()
 
 if __name__ == "__main__":
+    if BINARY_ACKS:
+        ser.write(sauron_uart.build_json_ack_mode_line(binary=True))
+        _recv_ack_line()
+
     # Example command: actuate servos 1-4
     pill_cmd = {"Vitamin C": 2, "Fish Oil": 2, "Vitamin B": 2, "Tylenol": 3}
     response = send_pill_command(pill_cmd)
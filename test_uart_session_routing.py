@@ -0,0 +1,114 @@
+"""
+How UartSession hands seq-less (V1/JSON) replies to the exchanges waiting for
+them, without a serial port:
+
+    python -m unittest test_uart_session_routing
+"""
+
+from __future__ import annotations
+
+import unittest
+from typing import Any
+
+import sauron_uart
+import soak_uart
+
+
+class NullSerial:
+    def write(self, data: bytes) -> None:
+        pass
+
+    def flush(self) -> None:
+        pass
+
+
+def reply(status: str, **fields: Any) -> dict[str, Any]:
+    return {"status": status, "protocol": "json_line", **fields}
+
+
+class SessionTestCase(unittest.TestCase):
+    def setUp(self) -> None:
+        self.session = sauron_uart.UartSession("unused")
+        self.session._ser = NullSerial()  # no reader thread: replies are routed by hand
+
+    def route(self, ack: dict[str, Any]) -> None:
+        self.session._route(ack, str(ack))
+
+    def statuses(self, exchange: sauron_uart.UartExchange) -> list[str]:
+        seen = []
+        while True:
+            ack = exchange.next(0.0)
+            if ack is None:
+                return seen
+            seen.append(ack["status"])
+
+
+class SeqlessRoutingTest(SessionTestCase):
+    def test_stats_reply_does_not_end_a_running_order(self) -> None:
+        order = self.session.send(b"{}\n", order=True)
+        self.route(reply("queued", queue_depth=1))
+        stats = self.session.send(b"{}\n")
+        self.route(reply("stats"))
+        self.route(reply("done", dispensed=[1, 0, 0, 0]))
+        self.assertEqual(self.statuses(order), ["queued", "done"])
+        self.assertEqual(self.statuses(stats), ["stats"])
+        self.assertEqual(self.session.unclaimed, 0)
+
+    def test_command_sent_first_still_gets_its_own_reply(self) -> None:
+        hello = self.session.send(b"{}\n")
+        order = self.session.send(b"{}\n", order=True)
+        self.route(reply("queued", queue_depth=1))
+        self.route(reply("hello", boot_id=7))
+        self.assertEqual(self.statuses(hello), ["hello"])
+        self.assertEqual(self.statuses(order), ["queued"])
+
+    def test_refusal_goes_to_the_request_without_a_reply(self) -> None:
+        running = self.session.send(b"{}\n", order=True)
+        self.route(reply("queued", queue_depth=1))
+        refused = self.session.send(b"{}\n", order=True)
+        self.route(reply("busy", queue_depth=8))
+        stats = self.session.send(b"{}\n")
+        self.route(reply("bad_json"))
+        self.assertEqual(self.statuses(running), ["queued"])
+        self.assertEqual(self.statuses(refused), ["busy"])
+        self.assertEqual(self.statuses(stats), ["bad_json"])
+
+    def test_seq_replies_are_not_taken_by_seqless_exchanges(self) -> None:
+        seqless = self.session.send(b"{}\n", order=True)
+        v2 = self.session.send(b"", seq=5, order=True)
+        self.route(reply("done", seq=5, order=0))
+        self.assertEqual(self.statuses(seqless), [])
+        self.assertEqual(self.statuses(v2), ["done"])
+
+
+class ReplayKindTest(SessionTestCase):
+    """Replayed command lines and frames must be routed as commands, not orders."""
+
+    def replay(self, message: bytes) -> sauron_uart.UartExchange:
+        data, seq, _, order = soak_uart.replay_message(message, 5)
+        return self.session.send(data, seq=seq, order=order)
+
+    def test_replayed_json_commands_get_their_replies(self) -> None:
+        for line, status in ((b'{"cmd":"ping"}\n', "pong"), (b'{"cmd":"hello"}\n', "hello"),
+                             (b'{"cmd":"stats"}\n', "stats")):
+            exchange = self.replay(line)
+            self.route(reply(status))
+            self.assertEqual(self.statuses(exchange), [status])
+            exchange.close()
+        self.assertEqual(self.session.unclaimed, 0)
+
+    def test_replayed_orders_are_orders(self) -> None:
+        orders = [
+            b'{"pill1": 1, "pill2": 0}\n',
+            sauron_uart.build_v1_frame([1, 0, 0, 0]),
+            sauron_uart.build_v2_dispense_batch(9, [[1, 0, 0, 0]]),
+        ]
+        for message in orders:
+            self.assertTrue(soak_uart.replay_message(message, 5)[3], message)
+        for frame in (sauron_uart.build_v2_ping(9), sauron_uart.build_v2_hello(9),
+                      sauron_uart.build_v2_get_stats(9)):
+            self.assertFalse(soak_uart.replay_message(frame, 5)[3], frame)
+
+
+if __name__ == "__main__":
+    unittest.main()